@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+# performance gate for lab3a
+#
+#	bench.sh image FILE
+#		build the synthetic benchmark image
+#	bench.sh record BINARY BASELINE IMAGE...
+#		store per-phase timings and read counts as the baseline
+#	bench.sh check BINARY BASELINE THRESHOLD IMAGE...
+#		fail if any phase got more than THRESHOLD percent slower
+#		than the baseline, or issues more image reads
+#
+#	Every image is scanned $RUNS times with --timings and the fastest
+#	run of each phase is kept. Differences under $SLACK seconds are
+#	treated as noise.
+#
+
+RUNS=${RUNS:-5}
+SLACK=${SLACK:-0.002}
+
+# file system size
+BLOCKS=65536
+INODES=16384
+BSIZE=1024
+DIRS=40
+FILES=250
+
+function makeImage {
+	TREE=$(mktemp -d)
+	for d in $(seq 1 $DIRS); do
+		mkdir -p $TREE/dir$d/sub
+		for f in $(seq 1 $FILES); do
+			head -c $(( (f * 37) % 3000 )) /dev/zero > $TREE/dir$d/file$f
+		done
+		head -c $(( d * 20000 )) /dev/zero | tr '\0' 'x' > $TREE/dir$d/sub/large
+	done
+	rm -f $1
+	mke2fs -q -F -t ext4 -b $BSIZE -N $INODES -U 0b1d6a3e-3c58-4d43-9a4e-2f6a1f3b7c11 -d $TREE $1 $BLOCKS
+	STATUS=$?
+	rm -rf $TREE
+	return $STATUS
+}
+
+# prints "image phase seconds reads" for every phase of every image
+function measure {
+	BINARY=$(realpath $1)
+	shift
+	WORKDIR=$(mktemp -d)
+	for IMAGE in "$@"; do
+		IMAGE=$(realpath $IMAGE)
+		for run in $(seq 1 $RUNS); do
+			(cd $WORKDIR && $BINARY --timings $IMAGE 2>&1 >/dev/null) | grep "^PHASE," |
+				awk -F, -v img=$(basename $IMAGE) '{ print img, $2, $3, $4 }'
+		done
+	done | awk '{
+		key = $1 " " $2
+		if (!(key in best) || $3 < best[key]) best[key] = $3
+		reads[key] = $4
+		if (!(key in seen)) { seen[key] = 1; order[n++] = key }
+	}
+	END { for (i = 0; i < n; i++) print order[i], best[order[i]], reads[order[i]] }'
+	rm -rf $WORKDIR
+}
+
+case "$1" in
+image)
+	makeImage $2
+	;;
+record)
+	measure $2 "${@:4}" > $3 || exit 1
+	cat $3
+	;;
+check)
+	if [ ! -s "$3" ]; then
+		>&2 echo "no baseline in $3; run 'make bench-baseline' first"
+		exit 1
+	fi
+	measure $2 "${@:5}" | awk -v threshold=$4 -v slack=$SLACK '
+		NR == FNR { time[$1 " " $2] = $3; reads[$1 " " $2] = $4; next }
+		{
+			key = $1 " " $2
+			if (!(key in time)) { printf "%-30s %10.6f  (no baseline)\n", key, $3; next }
+			verdict = "ok"
+			if ($3 > time[key] * (1 + threshold / 100) && $3 - time[key] > slack) verdict = "SLOWER"
+			if ($4 > reads[key]) verdict = "MORE READS"
+			if (verdict != "ok") failed = 1
+			printf "%-30s %10.6f s (baseline %10.6f)  %8d reads (baseline %8d)  %s\n", key, $3, time[key], $4, reads[key], verdict
+		}
+		END { exit failed }' $3 -
+	;;
+*)
+	>&2 echo "USAGE: bench.sh image FILE | record BINARY BASELINE IMAGE... | check BINARY BASELINE THRESHOLD IMAGE..."
+	exit 1
+	;;
+esac
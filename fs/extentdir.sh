@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# create an ext4 file system whose only subdirectory has an extent tree
+# of depth 1, to test the EXTENT and DIRENT records for such directories
+#
+# output:
+#	extentdir.img	ext4 file system image
+#	extentdir.csv	summary of file system data structures
+#
+#	Adding one small file at a time makes mke2fs -d grow the directory
+#	between file data blocks, so each directory block becomes its own
+#	extent and the extents no longer fit in the inode.
+#
+
+# file system size
+BLOCKS=1024
+INODES=512
+FILES=300
+
+# I-node/Indirect block sizes
+BSIZE=1024
+
+# file names
+FILE="extentdir.img"
+OUTPUT="extentdir.csv"
+PGM=../lab3a
+
+echo "... populating a directory with" $FILES "files"
+TREE=$(mktemp -d)
+mkdir $TREE/big
+for f in $(seq 1 $FILES); do
+	echo "data $f" > $TREE/big/file_with_a_fairly_long_name_$f
+done
+
+echo "... creating an ext4 file system in" $FILE
+rm -f $FILE
+E2FSPROGS_FAKE_TIME=1500000000 mke2fs -q -F -t ext4 -O ^has_journal -b $BSIZE -N $INODES \
+	-U 5a1c3b9e-0d4f-4e2a-8c71-6b2f9d0e4a13 -d $TREE $FILE $BLOCKS
+rm -rf $TREE
+
+echo
+echo "... generating golden output:" $OUTPUT
+$PGM $FILE > $OUTPUT
@@ -30,6 +30,8 @@ e2fsck_src_files :=  \
 	region.c \
 	sigcatcher.c \
 	readahead.c \
+	pscan.c \
+	dscan.c \
 	extents.c
 
 e2fsck_shared_libraries := \
@@ -14,77 +14,53 @@
 #include "uuid/uuid.h"
 
 #include "ext2fs/ext2fs.h"
-#include <ext2fs/tdb.h>
 
+/*
+ * The dir_info entries are kept in an array sorted by inode number.
+ * Normally the array is in memory, but on systems which are short of
+ * memory the [scratch_files] section of e2fsck.conf can ask for it to
+ * be kept in a scratch file instead; in that case the array lives in
+ * a file-backed arena which the kernel is free to page out.
+ */
 struct dir_info_db {
 	int		count;
 	int		size;
 	struct dir_info *array;
 	struct dir_info *last_lookup;
-#ifdef CONFIG_TDB
-	char		*tdb_fn;
-	TDB_CONTEXT	*tdb;
-#endif
+	ext2_scratch_t	scratch;
 };
 
 struct dir_info_iter {
 	int	i;
-#ifdef CONFIG_TDB
-	TDB_DATA	tdb_iter;
-#endif
 };
 
-struct dir_info_ent {
-	ext2_ino_t		dotdot;	/* Parent according to '..' */
-	ext2_ino_t		parent; /* Parent according to treewalk */
-};
-
-
-static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir);
-
-#ifdef CONFIG_TDB
-static void setup_tdb(e2fsck_t ctx, ext2_ino_t num_dirs)
+static void setup_scratch(e2fsck_t ctx, ext2_ino_t num_dirs)
 {
 	struct dir_info_db	*db = ctx->dir_info;
 	unsigned int		threshold;
-	errcode_t		retval;
-	mode_t			save_umask;
-	char			*tdb_dir, uuid[40];
-	int			fd, enable;
+	char			*scratch_dir, name[48];
+	int			enable;
 
 	profile_get_string(ctx->profile, "scratch_files", "directory", 0, 0,
-			   &tdb_dir);
+			   &scratch_dir);
 	profile_get_uint(ctx->profile, "scratch_files",
 			 "numdirs_threshold", 0, 0, &threshold);
 	profile_get_boolean(ctx->profile, "scratch_files",
 			    "dirinfo", 0, 1, &enable);
 
-	if (!enable || !tdb_dir || access(tdb_dir, W_OK) ||
+	if (!enable || !scratch_dir || access(scratch_dir, W_OK) ||
 	    (threshold && num_dirs <= threshold))
 		return;
 
-	retval = ext2fs_get_mem(strlen(tdb_dir) + 64, &db->tdb_fn);
-	if (retval)
+	uuid_unparse(ctx->fs->super->s_uuid, name);
+	strcat(name, "-dirinfo");
+	if (ext2fs_scratch_open(scratch_dir, name, (size_t) (num_dirs + 10) *
+				sizeof(struct dir_info), &db->scratch))
 		return;
 
-	uuid_unparse(ctx->fs->super->s_uuid, uuid);
-	sprintf(db->tdb_fn, "%s/%s-dirinfo-XXXXXX", tdb_dir, uuid);
-	save_umask = umask(077);
-	fd = mkstemp(db->tdb_fn);
-	umask(save_umask);
-	if (fd < 0) {
-		db->tdb = NULL;
-		return;
-	}
-
-	if (num_dirs < 99991)
-		num_dirs = 99991; /* largest 5 digit prime */
-
-	db->tdb = tdb_open(db->tdb_fn, num_dirs, TDB_NOLOCK | TDB_NOSYNC,
-			   O_RDWR | O_CREAT | O_TRUNC, 0600);
-	close(fd);
+	db->size = num_dirs + 10;
+	db->array = ext2fs_scratch_base(db->scratch);
 }
-#endif
 
 static void setup_db(e2fsck_t ctx)
 {
@@ -97,6 +73,7 @@ static void setup_db(e2fsck_t ctx)
 				       "directory map db");
 	db->count = db->size = 0;
 	db->array = 0;
+	db->scratch = 0;
 
 	ctx->dir_info = db;
 
@@ -104,16 +81,14 @@ static void setup_db(e2fsck_t ctx)
 	if (retval)
 		num_dirs = 1024;	/* Guess */
 
-#ifdef CONFIG_TDB
-	setup_tdb(ctx, num_dirs);
+	setup_scratch(ctx, num_dirs);
 
-	if (db->tdb) {
+	if (db->scratch) {
 #ifdef DIRINFO_DEBUG
-		printf("Note: using tdb!\n");
+		printf("Note: using a scratch file!\n");
 #endif
 		return;
 	}
-#endif
 
 	db->size = num_dirs + 10;
 	db->array  = (struct dir_info *)
@@ -142,35 +117,38 @@ void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
 
 	if (ctx->dir_info->count >= ctx->dir_info->size) {
 		old_size = ctx->dir_info->size * sizeof(struct dir_info);
-		ctx->dir_info->size += 10;
 		old_array = ctx->dir_info->array;
-		retval = ext2fs_resize_mem(old_size, ctx->dir_info->size *
-					   sizeof(struct dir_info),
-					   &ctx->dir_info->array);
+		if (ctx->dir_info->scratch) {
+			/* Remapping is expensive, so grow geometrically */
+			ctx->dir_info->size *= 2;
+			retval = ext2fs_scratch_resize(ctx->dir_info->scratch,
+						       ctx->dir_info->size *
+						       sizeof(struct dir_info));
+			if (!retval)
+				ctx->dir_info->array = ext2fs_scratch_base(
+						ctx->dir_info->scratch);
+			else
+				ctx->dir_info->size /= 2;
+		} else {
+			ctx->dir_info->size += 10;
+			retval = ext2fs_resize_mem(old_size,
+						   ctx->dir_info->size *
+						   sizeof(struct dir_info),
+						   &ctx->dir_info->array);
+			if (retval)
+				ctx->dir_info->size -= 10;
+		}
 		if (retval) {
 			fprintf(stderr, "Couldn't reallocate dir_info "
 				"structure to %d entries\n",
 				ctx->dir_info->size);
 			fatal_error(ctx, 0);
-			ctx->dir_info->size -= 10;
 			return;
 		}
 		if (old_array != ctx->dir_info->array)
 			ctx->dir_info->last_lookup = NULL;
 	}
 
-#ifdef CONFIG_TDB
-	if (ctx->dir_info->tdb) {
-		struct dir_info ent;
-
-		ent.ino = ino;
-		ent.parent = parent;
-		ent.dotdot = parent;
-		e2fsck_put_dir_info(ctx, &ent);
-		return;
-	}
-#endif
-
 	/*
 	 * Normally, add_dir_info is called with each inode in
 	 * sequential order; but once in a while (like when pass 3
@@ -213,35 +191,6 @@ static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 	printf("e2fsck_get_dir_info %d...", ino);
 #endif
 
-#ifdef CONFIG_TDB
-	if (db->tdb) {
-		static struct dir_info	ret_dir_info;
-		TDB_DATA key, data;
-		struct dir_info_ent	*buf;
-
-		key.dptr = (unsigned char *) &ino;
-		key.dsize = sizeof(ext2_ino_t);
-
-		data = tdb_fetch(db->tdb, key);
-		if (!data.dptr) {
-			if (tdb_error(db->tdb) != TDB_ERR_NOEXIST)
-				printf("fetch failed: %s\n",
-				       tdb_errorstr(db->tdb));
-			return 0;
-		}
-
-		buf = (struct dir_info_ent *) data.dptr;
-		ret_dir_info.ino = ino;
-		ret_dir_info.dotdot = buf->dotdot;
-		ret_dir_info.parent = buf->parent;
-#ifdef DIRINFO_DEBUG
-		printf("(%d,%d,%d)\n", ino, buf->dotdot, buf->parent);
-#endif
-		free(data.dptr);
-		return &ret_dir_info;
-	}
-#endif
-
 	if (db->last_lookup && db->last_lookup->ino == ino)
 		return db->last_lookup;
 
@@ -284,53 +233,15 @@ static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 	return 0;
 }
 
-static void e2fsck_put_dir_info(e2fsck_t ctx EXT2FS_NO_TDB_UNUSED,
-				struct dir_info *dir EXT2FS_NO_TDB_UNUSED)
-{
-#ifdef CONFIG_TDB
-	struct dir_info_db	*db = ctx->dir_info;
-	struct dir_info_ent	buf;
-	TDB_DATA		key, data;
-#endif
-
-#ifdef DIRINFO_DEBUG
-	printf("e2fsck_put_dir_info (%d, %d, %d)...", dir->ino, dir->dotdot,
-	       dir->parent);
-#endif
-
-#ifdef CONFIG_TDB
-	if (!db->tdb)
-		return;
-
-	buf.parent = dir->parent;
-	buf.dotdot = dir->dotdot;
-
-	key.dptr = (unsigned char *) &dir->ino;
-	key.dsize = sizeof(ext2_ino_t);
-	data.dptr = (unsigned char *) &buf;
-	data.dsize = sizeof(buf);
-
-	if (tdb_store(db->tdb, key, data, TDB_REPLACE) == -1) {
-		printf("store failed: %s\n", tdb_errorstr(db->tdb));
-	}
-#endif
-}
-
 /*
  * Free the dir_info structure when it isn't needed any more.
  */
 void e2fsck_free_dir_info(e2fsck_t ctx)
 {
 	if (ctx->dir_info) {
-#ifdef CONFIG_TDB
-		if (ctx->dir_info->tdb)
-			tdb_close(ctx->dir_info->tdb);
-		if (ctx->dir_info->tdb_fn) {
-			unlink(ctx->dir_info->tdb_fn);
-			free(ctx->dir_info->tdb_fn);
-		}
-#endif
-		if (ctx->dir_info->array)
+		if (ctx->dir_info->scratch)
+			ext2fs_scratch_close(ctx->dir_info->scratch);
+		else if (ctx->dir_info->array)
 			ext2fs_free_mem(&ctx->dir_info->array);
 		ctx->dir_info->array = 0;
 		ctx->dir_info->size = 0;
@@ -355,20 +266,12 @@ struct dir_info_iter *e2fsck_dir_info_iter_begin(e2fsck_t ctx)
 	iter = e2fsck_allocate_memory(ctx, sizeof(struct dir_info_iter),
 				      "dir_info iterator");
 
-#ifdef CONFIG_TDB
-	if (ctx->dir_info->tdb)
-		iter->tdb_iter = tdb_firstkey(ctx->dir_info->tdb);
-#endif
-
 	return iter;
 }
 
 void e2fsck_dir_info_iter_end(e2fsck_t ctx EXT2FS_ATTR((unused)),
 			      struct dir_info_iter *iter)
 {
-#ifdef CONFIG_TDB
-	free(iter->tdb_iter.dptr);
-#endif
 	ext2fs_free_mem(&iter);
 }
 
@@ -380,32 +283,6 @@ struct dir_info *e2fsck_dir_info_iter(e2fsck_t ctx, struct dir_info_iter *iter)
 	if (!ctx->dir_info || !iter)
 		return 0;
 
-#ifdef CONFIG_TDB
-	if (ctx->dir_info->tdb) {
-		static struct dir_info ret_dir_info;
-		struct dir_info_ent *buf;
-		TDB_DATA data, key;
-
-		if (iter->tdb_iter.dptr == 0)
-			return 0;
-		key = iter->tdb_iter;
-		data = tdb_fetch(ctx->dir_info->tdb, key);
-		if (!data.dptr) {
-			printf("iter fetch failed: %s\n",
-			       tdb_errorstr(ctx->dir_info->tdb));
-			return 0;
-		}
-		buf = (struct dir_info_ent *) data.dptr;
-		ret_dir_info.ino = *((ext2_ino_t *) iter->tdb_iter.dptr);
-		ret_dir_info.dotdot = buf->dotdot;
-		ret_dir_info.parent = buf->parent;
-		iter->tdb_iter = tdb_nextkey(ctx->dir_info->tdb, key);
-		free(key.dptr);
-		free(data.dptr);
-		return &ret_dir_info;
-	}
-#endif
-
 	if (iter->i >= ctx->dir_info->count)
 		return 0;
 
@@ -431,7 +308,6 @@ int e2fsck_dir_info_set_parent(e2fsck_t ctx, ext2_ino_t ino,
 	if (!p)
 		return 1;
 	p->parent = parent;
-	e2fsck_put_dir_info(ctx, p);
 	return 0;
 }
 
@@ -448,7 +324,6 @@ int e2fsck_dir_info_set_dotdot(e2fsck_t ctx, ext2_ino_t ino,
 	if (!p)
 		return 1;
 	p->dotdot = dotdot;
-	e2fsck_put_dir_info(ctx, p);
 	return 0;
 }
 
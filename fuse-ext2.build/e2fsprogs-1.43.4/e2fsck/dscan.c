@@ -0,0 +1,364 @@
+/*
+ * dscan.c --- multi-threaded directory block read-ahead for pass 2
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ *
+ * Pass 2 walks the sorted directory block list and, for every entry,
+ * reads the block, verifies its checksum and then checks the entries
+ * in it.  The first two steps do not depend on anything pass 2 has
+ * done so far, so a set of worker threads does them ahead of time, in
+ * dblist order, into a ring of block buffers.  The checking itself,
+ * the inode link counts and every fix stay on the main thread and
+ * happen in dblist order, so the questions asked and the result are
+ * the same no matter how many threads were used.
+ *
+ * A worker only hands back a block that it read without error and
+ * whose checksum it found to be good.  Anything else (read errors,
+ * bad checksums, holes, inline directories) is left for the main
+ * thread, which reads the block itself as it always has.  The worker
+ * takes the directory's i_generation straight from the inode table
+ * rather than through the inode cache, which the main thread is
+ * busy rewriting.
+ *
+ * Pass 2 only ever writes the directory block it is looking at, so a
+ * block read ahead can only go stale if it belongs to more than one
+ * directory.  We don't run when pass 1 found multiply-claimed blocks.
+ */
+
+#include "config.h"
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "e2fsck.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/* How many directory blocks each worker may be ahead of the checker */
+#define DSCAN_BLOCKS_PER_THREAD	32
+
+enum dscan_state { SLOT_FREE, SLOT_BUSY, SLOT_READY };
+
+struct dscan_slot {
+	enum dscan_state state;
+	unsigned long long index;	/* position in the dblist */
+	ext2_ino_t	ino;
+	blk64_t		blk;
+	int		valid;		/* buf holds a good copy of blk */
+	char		*buf;
+};
+
+struct dscan_worker {
+	struct e2fsck_dscan_struct *dscan;
+	char		*itable_buf;	/* last inode table block read */
+	blk64_t		itable_blk;
+	pthread_t	thread;
+	int		started;
+};
+
+struct e2fsck_dscan_struct {
+	ext2_filsys	fs;
+	ext2_dblist	dblist;
+	unsigned long long count;	/* entries in the dblist */
+	int		nr_workers;
+	struct dscan_worker *workers;
+	unsigned int	nr_slots;
+	struct dscan_slot *slots;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	ready;		/* a slot was filled */
+	pthread_cond_t	space;		/* a slot was freed */
+	unsigned long long next_index;	/* next entry to hand to a worker */
+	unsigned long long cur_index;	/* entry the checker is looking at */
+	int		cur_ready;	/* cur_index's slot has been filled */
+	int		stop;
+};
+
+static int copy_db_entry(ext2_filsys fs EXT2FS_ATTR((unused)),
+			 struct ext2_db_entry2 *db, void *priv_data)
+{
+	struct dscan_slot *slot = (struct dscan_slot *) priv_data;
+
+	slot->ino = db->ino;
+	slot->blk = db->blk;
+	return DBLIST_ABORT;
+}
+
+/*
+ * Fetch the directory's i_generation from the inode table, checking
+ * the inode's own checksum on the way.
+ */
+static int dir_generation(struct dscan_worker *w, ext2_ino_t ino, __u32 *gen)
+{
+	ext2_filsys	fs = w->dscan->fs;
+	struct ext2_inode_large *inode;
+	unsigned long	group, offset;
+	blk64_t		blk;
+
+	if (ino == 0 || ino > fs->super->s_inodes_count)
+		return 0;
+	group = (ino - 1) / fs->super->s_inodes_per_group;
+	offset = ((ino - 1) % fs->super->s_inodes_per_group) *
+		EXT2_INODE_SIZE(fs->super);
+	blk = ext2fs_inode_table_loc(fs, group);
+	if (!blk || blk < fs->super->s_first_data_block ||
+	    blk + fs->inode_blocks_per_group - 1 >=
+	    ext2fs_blocks_count(fs->super))
+		return 0;
+	blk += offset / fs->blocksize;
+	if (blk != w->itable_blk) {
+		w->itable_blk = 0;
+		if (io_channel_read_blk64(fs->io, blk, 1, w->itable_buf))
+			return 0;
+		w->itable_blk = blk;
+	}
+	inode = (struct ext2_inode_large *)
+		(w->itable_buf + offset % fs->blocksize);
+	if (!ext2fs_inode_csum_verify(fs, ino, inode))
+		return 0;
+	*gen = ext2fs_le32_to_cpu(inode->i_generation);
+	return 1;
+}
+
+static void read_dir_block(struct dscan_worker *w, struct dscan_slot *slot)
+{
+	ext2_filsys	fs = w->dscan->fs;
+	__u32		gen;
+
+	slot->valid = 0;
+	if (slot->blk < fs->super->s_first_data_block ||
+	    slot->blk >= ext2fs_blocks_count(fs->super))
+		return;
+	if (io_channel_read_blk64(fs->io, slot->blk, 1, slot->buf))
+		return;
+	if (ext2fs_has_feature_metadata_csum(fs->super) &&
+	    (!dir_generation(w, slot->ino, &gen) ||
+	     !ext2fs_dir_block_csum_verify2(fs, slot->ino, gen,
+					(struct ext2_dir_entry *) slot->buf)))
+		return;
+#ifdef WORDS_BIGENDIAN
+	if (ext2fs_dirent_swab_in(fs, slot->buf, 0))
+		return;
+#endif
+	slot->valid = 1;
+}
+
+static void *dscan_worker_thread(void *arg)
+{
+	struct dscan_worker *w = (struct dscan_worker *) arg;
+	e2fsck_dscan_t	dscan = w->dscan;
+	struct dscan_slot *slot;
+	unsigned long long index;
+
+	pthread_mutex_lock(&dscan->lock);
+	while (1) {
+		while (!dscan->stop &&
+		       dscan->next_index < dscan->count &&
+		       dscan->next_index >= dscan->cur_index + dscan->nr_slots)
+			pthread_cond_wait(&dscan->space, &dscan->lock);
+		if (dscan->stop || dscan->next_index >= dscan->count)
+			break;
+		index = dscan->next_index++;
+		slot = &dscan->slots[index % dscan->nr_slots];
+		slot->index = index;
+		slot->state = SLOT_BUSY;
+		/*
+		 * The checker may fill in a hole's block number once it
+		 * gets to it, so copy the entry while holding the lock.
+		 */
+		ext2fs_dblist_iterate3(dscan->dblist, copy_db_entry,
+				       index, 1, slot);
+		pthread_mutex_unlock(&dscan->lock);
+
+		if (slot->blk)
+			read_dir_block(w, slot);
+		else
+			slot->valid = 0;
+
+		pthread_mutex_lock(&dscan->lock);
+		slot->state = SLOT_READY;
+		pthread_cond_broadcast(&dscan->ready);
+	}
+	pthread_mutex_unlock(&dscan->lock);
+	return NULL;
+}
+
+void e2fsck_close_dscan(e2fsck_dscan_t dscan)
+{
+	int	i;
+
+	if (!dscan)
+		return;
+
+	pthread_mutex_lock(&dscan->lock);
+	dscan->stop = 1;
+	pthread_cond_broadcast(&dscan->space);
+	pthread_mutex_unlock(&dscan->lock);
+
+	for (i = 0; dscan->workers && i < dscan->nr_workers; i++) {
+		if (dscan->workers[i].started)
+			pthread_join(dscan->workers[i].thread, NULL);
+		if (dscan->workers[i].itable_buf)
+			ext2fs_free_mem(&dscan->workers[i].itable_buf);
+	}
+	for (i = 0; dscan->slots && i < (int) dscan->nr_slots; i++)
+		if (dscan->slots[i].buf)
+			ext2fs_free_mem(&dscan->slots[i].buf);
+	pthread_cond_destroy(&dscan->space);
+	pthread_cond_destroy(&dscan->ready);
+	pthread_mutex_destroy(&dscan->lock);
+	if (dscan->slots)
+		ext2fs_free_mem(&dscan->slots);
+	if (dscan->workers)
+		ext2fs_free_mem(&dscan->workers);
+	ext2fs_free_mem(&dscan);
+}
+
+/*
+ * The dblist must already be in the order it will be checked in.
+ */
+errcode_t e2fsck_open_dscan(e2fsck_t ctx, int threads, e2fsck_dscan_t *ret)
+{
+	ext2_filsys	fs = ctx->fs;
+	e2fsck_dscan_t	dscan;
+	errcode_t	retval;
+	int		i;
+
+	if (threads < 2 || !(fs->flags & EXT2_FLAG_THREADS) ||
+	    !fs->dblist || ctx->block_dup_map)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+
+	retval = ext2fs_get_memzero(sizeof(struct e2fsck_dscan_struct),
+				    &dscan);
+	if (retval)
+		return retval;
+	dscan->fs = fs;
+	dscan->dblist = fs->dblist;
+	dscan->count = ext2fs_dblist_count2(fs->dblist);
+	dscan->nr_workers = threads;
+	dscan->nr_slots = threads * DSCAN_BLOCKS_PER_THREAD;
+	pthread_mutex_init(&dscan->lock, NULL);
+	pthread_cond_init(&dscan->ready, NULL);
+	pthread_cond_init(&dscan->space, NULL);
+
+	retval = ext2fs_get_arrayzero(threads, sizeof(struct dscan_worker),
+				      &dscan->workers);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_arrayzero(dscan->nr_slots,
+				      sizeof(struct dscan_slot),
+				      &dscan->slots);
+	if (retval)
+		goto errout;
+	for (i = 0; i < (int) dscan->nr_slots; i++) {
+		retval = ext2fs_get_mem(fs->blocksize, &dscan->slots[i].buf);
+		if (retval)
+			goto errout;
+	}
+	for (i = 0; i < threads; i++) {
+		dscan->workers[i].dscan = dscan;
+		retval = ext2fs_get_mem(fs->blocksize,
+					&dscan->workers[i].itable_buf);
+		if (retval)
+			goto errout;
+	}
+
+	for (i = 0; i < threads; i++) {
+		struct dscan_worker *w = &dscan->workers[i];
+
+		if (pthread_create(&w->thread, NULL, dscan_worker_thread, w)) {
+			retval = EXT2_ET_OP_NOT_SUPPORTED;
+			if (i)
+				break;
+			goto errout;
+		}
+		w->started = 1;
+	}
+
+	*ret = dscan;
+	return 0;
+
+errout:
+	e2fsck_close_dscan(dscan);
+	return retval;
+}
+
+/*
+ * Move on to the dblist entry at index, releasing the ones before it.
+ * This must be called for an entry before the checker looks at it or
+ * changes it.
+ */
+void e2fsck_dscan_seek(e2fsck_dscan_t dscan, unsigned long long index)
+{
+	struct dscan_slot *slot;
+
+	dscan->cur_ready = 0;
+	if (index >= dscan->count)
+		return;
+
+	pthread_mutex_lock(&dscan->lock);
+	while (dscan->cur_index < index) {
+		slot = &dscan->slots[dscan->cur_index % dscan->nr_slots];
+		while (slot->state != SLOT_READY ||
+		       slot->index != dscan->cur_index)
+			pthread_cond_wait(&dscan->ready, &dscan->lock);
+		slot->state = SLOT_FREE;
+		dscan->cur_index++;
+		pthread_cond_broadcast(&dscan->space);
+	}
+	slot = &dscan->slots[index % dscan->nr_slots];
+	while (slot->state != SLOT_READY || slot->index != index)
+		pthread_cond_wait(&dscan->ready, &dscan->lock);
+	pthread_mutex_unlock(&dscan->lock);
+	dscan->cur_ready = 1;
+}
+
+/*
+ * Copy out the current entry's block if a worker read and verified it.
+ * Returns 0 on success; otherwise the caller must read the block.
+ */
+errcode_t e2fsck_dscan_read(e2fsck_dscan_t dscan, ext2_ino_t ino,
+			    blk64_t blk, void *buf)
+{
+	struct dscan_slot *slot;
+
+	if (!dscan->cur_ready)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	slot = &dscan->slots[dscan->cur_index % dscan->nr_slots];
+	if (!slot->valid || slot->ino != ino || slot->blk != blk)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	memcpy(buf, slot->buf, dscan->fs->blocksize);
+	return 0;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+errcode_t e2fsck_open_dscan(e2fsck_t ctx EXT2FS_ATTR((unused)),
+			    int threads EXT2FS_ATTR((unused)),
+			    e2fsck_dscan_t *ret EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+void e2fsck_dscan_seek(e2fsck_dscan_t dscan EXT2FS_ATTR((unused)),
+		       unsigned long long index EXT2FS_ATTR((unused)))
+{
+}
+
+errcode_t e2fsck_dscan_read(e2fsck_dscan_t dscan EXT2FS_ATTR((unused)),
+			    ext2_ino_t ino EXT2FS_ATTR((unused)),
+			    blk64_t blk EXT2FS_ATTR((unused)),
+			    void *buf EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+void e2fsck_close_dscan(e2fsck_dscan_t dscan EXT2FS_ATTR((unused)))
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
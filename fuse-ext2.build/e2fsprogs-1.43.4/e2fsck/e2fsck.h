@@ -215,6 +215,8 @@ typedef struct ea_refcount *ext2_refcount_t;
  * This is the global e2fsck structure.
  */
 typedef struct e2fsck_struct *e2fsck_t;
+typedef struct e2fsck_pscan_struct *e2fsck_pscan_t;
+typedef struct e2fsck_dscan_struct *e2fsck_dscan_t;
 
 #define MAX_EXTENT_DEPTH_COUNT 5
 
@@ -386,6 +388,9 @@ struct e2fsck_struct {
 	/* How much are we allowed to readahead? */
 	unsigned long long readahead_kb;
 
+	/* Worker threads for the passes that can use them */
+	int num_threads;
+
 	/*
 	 * Inodes to rebuild extent trees
 	 */
@@ -476,6 +481,14 @@ extern blk_t ext2fs_get_refcount_size(ext2_refcount_t refcount);
 extern void ea_refcount_intr_begin(ext2_refcount_t refcount);
 extern blk64_t ea_refcount_intr_next(ext2_refcount_t refcount, int *ret);
 
+/* dscan.c */
+extern errcode_t e2fsck_open_dscan(e2fsck_t ctx, int threads,
+				   e2fsck_dscan_t *ret);
+extern void e2fsck_dscan_seek(e2fsck_dscan_t dscan, unsigned long long index);
+extern errcode_t e2fsck_dscan_read(e2fsck_dscan_t dscan, ext2_ino_t ino,
+				   blk64_t blk, void *buf);
+extern void e2fsck_close_dscan(e2fsck_dscan_t dscan);
+
 /* ehandler.c */
 extern const char *ehandler_operation(const char *op);
 extern void ehandler_init(io_channel channel);
@@ -493,6 +506,19 @@ errcode_t e2fsck_should_rebuild_extents(e2fsck_t ctx,
 					struct extent_tree_info *eti,
 					struct ext2_extent_info *info);
 
+/* pscan.c */
+extern errcode_t e2fsck_open_pscan(e2fsck_t ctx, int threads, int scan_flags,
+				   e2fsck_pscan_t *ret);
+extern void e2fsck_pscan_set_callback(e2fsck_pscan_t pscan,
+				      errcode_t (*done_group)(ext2_filsys fs,
+							ext2_inode_scan scan,
+							dgrp_t group,
+							void *priv_data),
+				      void *done_group_data);
+extern errcode_t e2fsck_pscan_next(e2fsck_pscan_t pscan, ext2_ino_t *ino,
+				   struct ext2_inode *inode, int bufsize);
+extern void e2fsck_close_pscan(e2fsck_pscan_t pscan);
+
 /* journal.c */
 extern errcode_t e2fsck_check_ext3_journal(e2fsck_t ctx);
 extern errcode_t e2fsck_run_ext3_journal(e2fsck_t ctx);
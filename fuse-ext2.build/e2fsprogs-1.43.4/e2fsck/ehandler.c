@@ -12,6 +12,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <termios.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "e2fsck.h"
 
@@ -19,6 +22,9 @@
 #include <sys/resource.h>
 
 static const char *operation;
+#ifdef HAVE_PTHREAD_H
+static pthread_t ehandler_thread;
+#endif
 
 static errcode_t e2fsck_handle_read_error(io_channel channel,
 					  unsigned long block,
@@ -36,6 +42,14 @@ static errcode_t e2fsck_handle_read_error(io_channel channel,
 	ctx = (e2fsck_t) fs->priv_data;
 	if (ctx->flags & E2F_FLAG_EXITING)
 		return 0;
+#ifdef HAVE_PTHREAD_H
+	/*
+	 * Worker threads only read ahead of the checker.  Let them fail
+	 * quietly; the main thread reads the block again and asks.
+	 */
+	if (!pthread_equal(pthread_self(), ehandler_thread))
+		return error;
+#endif
 	/*
 	 * If more than one block was read, try reading each block
 	 * separately.  We could use the actual bytes read to figure
@@ -128,6 +142,9 @@ const char *ehandler_operation(const char *op)
 
 void ehandler_init(io_channel channel)
 {
+#ifdef HAVE_PTHREAD_H
+	ehandler_thread = pthread_self();
+#endif
 	channel->read_error = e2fsck_handle_read_error;
 	channel->write_error = e2fsck_handle_write_error;
 }
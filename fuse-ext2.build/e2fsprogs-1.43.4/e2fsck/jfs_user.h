@@ -35,6 +35,7 @@ struct buffer_head {
 	ext2_filsys	b_fs;
 #else
 	e2fsck_t	b_ctx;
+	struct replay_cache *b_cache;	/* see journal.c */
 #endif
 	io_channel	b_io;
 	int		b_size;
@@ -60,6 +61,7 @@ struct kdev_s {
 	ext2_filsys	k_fs;
 #else
 	e2fsck_t	k_ctx;
+	struct replay_cache *k_cache;
 #endif
 	int		k_dev;
 };
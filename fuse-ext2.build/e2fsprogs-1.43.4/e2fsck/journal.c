@@ -90,6 +90,193 @@ static errcode_t e2fsck_journal_sb_csum_set(journal_t *j,
 	return 0;
 }
 
+/*
+ * Journal replay writes every logged block back to the file system,
+ * and the same metadata blocks (bitmaps, inode tables, group
+ * descriptors) are usually logged over and over again.  Rather than
+ * writing each one as recovery.c releases it, dirty buffers for the
+ * file system device are parked in a hash table keyed by block
+ * number, where a later version of a block simply replaces the
+ * earlier one.  When sync_blockdev() is called at the end of the
+ * replay (or the table gets too big) the buffers are sorted and
+ * written out in ascending block order, with runs of adjacent blocks
+ * merged into large writes, so that each block is written once.
+ */
+#define REPLAY_CACHE_BYTES	(256 * 1024 * 1024)
+#define REPLAY_IO_BYTES		(1024 * 1024)
+
+struct replay_cache {
+	struct buffer_head	**hash;
+	unsigned int		size;		/* slots; a power of 2 */
+	unsigned int		count;
+	unsigned int		max;		/* flush at this many blocks */
+	char			*buf;		/* for merged writes */
+	unsigned int		buf_blocks;
+};
+
+static errcode_t replay_cache_create(e2fsck_t ctx, struct replay_cache **ret)
+{
+	struct replay_cache *cache;
+	int blocksize = ctx->fs->blocksize;
+
+	cache = e2fsck_allocate_memory(ctx, sizeof(struct replay_cache),
+				       "journal replay cache");
+	if (!cache)
+		return EXT2_ET_NO_MEMORY;
+	cache->max = REPLAY_CACHE_BYTES / blocksize;
+	cache->buf_blocks = REPLAY_IO_BYTES / blocksize;
+	*ret = cache;
+	return 0;
+}
+
+static inline unsigned int replay_hash(struct replay_cache *cache,
+				       unsigned long long blocknr)
+{
+	return (unsigned int) (blocknr * 2654435761U) & (cache->size - 1);
+}
+
+static void replay_cache_place(struct replay_cache *cache,
+			       struct buffer_head *bh)
+{
+	unsigned int i = replay_hash(cache, bh->b_blocknr);
+
+	while (cache->hash[i]) {
+		if (cache->hash[i]->b_blocknr == bh->b_blocknr) {
+			/* A later version of the block; drop the old one */
+			jfs_debug(3, "replacing block %llu/%p\n",
+				  bh->b_blocknr, (void *) cache->hash[i]);
+			ext2fs_free_mem(&cache->hash[i]);
+			cache->hash[i] = bh;
+			return;
+		}
+		i = (i + 1) & (cache->size - 1);
+	}
+	cache->hash[i] = bh;
+	cache->count++;
+}
+
+static errcode_t replay_cache_grow(struct replay_cache *cache)
+{
+	struct buffer_head **old = cache->hash;
+	unsigned int i, old_size = cache->size;
+	errcode_t retval;
+
+	retval = ext2fs_get_arrayzero(old_size ? old_size * 2 : 1024,
+				      sizeof(struct buffer_head *),
+				      &cache->hash);
+	if (retval) {
+		cache->hash = old;
+		return retval;
+	}
+	cache->size = old_size ? old_size * 2 : 1024;
+	cache->count = 0;
+	for (i = 0; i < old_size; i++)
+		if (old[i])
+			replay_cache_place(cache, old[i]);
+	if (old)
+		ext2fs_free_mem(&old);
+	return 0;
+}
+
+static EXT2_QSORT_TYPE replay_cmp(const void *a, const void *b)
+{
+	const struct buffer_head *ba = *(const struct buffer_head **) a;
+	const struct buffer_head *bb = *(const struct buffer_head **) b;
+
+	if (ba->b_blocknr < bb->b_blocknr)
+		return -1;
+	return ba->b_blocknr > bb->b_blocknr;
+}
+
+/*
+ * Write out all of the parked buffers in block order and free them.
+ */
+static errcode_t replay_cache_flush(struct replay_cache *cache)
+{
+	struct buffer_head **list = cache->hash, *bh;
+	unsigned int i, j, n = 0, run;
+	errcode_t retval, err = 0;
+	char *data;
+
+	if (!cache->count)
+		return 0;
+
+	/* Pack the buffers at the front of the table and sort them */
+	for (i = 0; i < cache->size; i++)
+		if (list[i])
+			list[n++] = list[i];
+	qsort(list, n, sizeof(struct buffer_head *), replay_cmp);
+
+	if (!cache->buf &&
+	    ext2fs_get_array(cache->buf_blocks, list[0]->b_size, &cache->buf))
+		cache->buf = NULL;
+
+	for (i = 0; i < n; i += run) {
+		bh = list[i];
+		run = 1;
+		if (cache->buf) {
+			while (i + run < n && run < cache->buf_blocks &&
+			       list[i + run]->b_blocknr == bh->b_blocknr + run)
+				run++;
+		}
+		if (run == 1)
+			data = bh->b_data;
+		else {
+			data = cache->buf;
+			for (j = 0; j < run; j++)
+				memcpy(data + j * bh->b_size,
+				       list[i + j]->b_data, bh->b_size);
+		}
+		jfs_debug(3, "writing blocks %llu-%llu\n", bh->b_blocknr,
+			  bh->b_blocknr + run - 1);
+		retval = io_channel_write_blk64(bh->b_io, bh->b_blocknr,
+						run, data);
+		if (retval) {
+			com_err(bh->b_ctx->device_name, retval,
+				"while writing blocks %llu-%llu\n",
+				bh->b_blocknr, bh->b_blocknr + run - 1);
+			err = retval;
+		}
+		for (j = 0; j < run; j++) {
+			jfs_debug(3, "freeing block %llu/%p (total %d)\n",
+				  list[i + j]->b_blocknr,
+				  (void *) list[i + j], --bh_count);
+			ext2fs_free_mem(&list[i + j]);
+		}
+	}
+
+	memset(cache->hash, 0, cache->size * sizeof(struct buffer_head *));
+	cache->count = 0;
+	return err;
+}
+
+static void replay_cache_free(struct replay_cache *cache)
+{
+	if (!cache)
+		return;
+	replay_cache_flush(cache);
+	if (cache->hash)
+		ext2fs_free_mem(&cache->hash);
+	if (cache->buf)
+		ext2fs_free_mem(&cache->buf);
+	ext2fs_free_mem(&cache);
+}
+
+/*
+ * Park a dirty buffer in the cache.  Returns nonzero if it could not
+ * be added, in which case the caller should write it out itself.
+ */
+static int replay_cache_add(struct replay_cache *cache,
+			    struct buffer_head *bh)
+{
+	if (cache->count >= cache->max && replay_cache_flush(cache))
+		return 1;
+	if (cache->count + 1 > cache->size / 2 && replay_cache_grow(cache))
+		return 1;
+	replay_cache_place(cache, bh);
+	return 0;
+}
+
 /* Kernel compatibility functions for handling the journal.  These allow us
  * to use the recovery.c file virtually unchanged from the kernel, so we
  * don't have to do much to keep kernel and user recovery in sync.
@@ -134,9 +321,10 @@ struct buffer_head *getblk(kdev_t kdev, blk64_t blocknr, int blocksize)
 		  (unsigned long long) blocknr, blocksize, bh_count);
 
 	bh->b_ctx = kdev->k_ctx;
-	if (kdev->k_dev == K_DEV_FS)
+	if (kdev->k_dev == K_DEV_FS) {
 		bh->b_io = kdev->k_ctx->fs->io;
-	else
+		bh->b_cache = kdev->k_cache;
+	} else
 		bh->b_io = kdev->k_ctx->journal_io;
 	bh->b_size = blocksize;
 	bh->b_blocknr = blocknr;
@@ -147,13 +335,18 @@ struct buffer_head *getblk(kdev_t kdev, blk64_t blocknr, int blocksize)
 int sync_blockdev(kdev_t kdev)
 {
 	io_channel	io;
+	int		err = 0;
 
 	if (kdev->k_dev == K_DEV_FS)
 		io = kdev->k_ctx->fs->io;
 	else
 		io = kdev->k_ctx->journal_io;
 
-	return io_channel_flush(io) ? EIO : 0;
+	if (kdev->k_cache && replay_cache_flush(kdev->k_cache))
+		err = EIO;
+	if (io_channel_flush(io))
+		err = EIO;
+	return err;
 }
 
 void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
@@ -213,6 +406,8 @@ static void mark_buffer_clean(struct buffer_head * bh)
 
 void brelse(struct buffer_head *bh)
 {
+	if (bh->b_dirty && bh->b_cache && !replay_cache_add(bh->b_cache, bh))
+		return;
 	if (bh->b_dirty)
 		ll_rw_block(WRITE, 1, &bh);
 	jfs_debug(3, "freeing block %llu/%p (total %d)\n",
@@ -310,6 +505,10 @@ static errcode_t e2fsck_get_journal(e2fsck_t ctx, journal_t **ret_journal)
 	dev_fs->k_dev = K_DEV_FS;
 	dev_journal->k_dev = K_DEV_JOURNAL;
 
+	retval = replay_cache_create(ctx, &dev_fs->k_cache);
+	if (retval)
+		goto errout;
+
 	journal->j_dev = dev_journal;
 	journal->j_fs_dev = dev_fs;
 	journal->j_inode = NULL;
@@ -520,8 +719,10 @@ static errcode_t e2fsck_get_journal(e2fsck_t ctx, journal_t **ret_journal)
 
 errout:
 	e2fsck_use_inode_shortcuts(ctx, 0);
-	if (dev_fs)
+	if (dev_fs) {
+		replay_cache_free(dev_fs->k_cache);
 		ext2fs_free_mem(&dev_fs);
+	}
 	if (j_inode)
 		ext2fs_free_mem(&j_inode);
 	if (journal)
@@ -758,6 +959,12 @@ static void e2fsck_journal_release(e2fsck_t ctx, journal_t *journal,
 {
 	journal_superblock_t *jsb;
 
+	/* Replayed blocks must be on disk before the journal is reset */
+	if (journal->j_fs_dev) {
+		replay_cache_free(journal->j_fs_dev->k_cache);
+		journal->j_fs_dev->k_cache = NULL;
+	}
+
 	if (drop)
 		mark_buffer_clean(journal->j_sb_buffer);
 	else if (!(ctx->options & E2F_OPT_READONLY)) {
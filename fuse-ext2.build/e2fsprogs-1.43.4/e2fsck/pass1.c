@@ -734,7 +734,8 @@ extern errcode_t e2fsck_setup_icount(e2fsck_t ctx, const char *icount_name,
 	}
 	e2fsck_set_bitmap_type(ctx->fs, EXT2FS_BMAP64_RBTREE, icount_name,
 			       &save_type);
-	retval = ext2fs_create_icount2(ctx->fs, flags, 0, hint, ret);
+	retval = ext2fs_create_icount2(ctx->fs, flags | EXT2_ICOUNT_OPT_PAGED,
+				       0, hint, ret);
 	ctx->fs->default_bitmap_type = save_type;
 	return retval;
 }
@@ -1051,6 +1052,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 	ext2_ino_t	ino = 0;
 	struct ext2_inode *inode = NULL;
 	ext2_inode_scan	scan = NULL;
+	e2fsck_pscan_t	pscan = NULL;
 	char		*block_buf = NULL;
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
@@ -1139,7 +1141,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 		return;
 	}
 	pctx.errcode = e2fsck_allocate_subcluster_bitmap(fs,
-			_("in-use block map"), EXT2FS_BMAP64_RBTREE,
+			_("in-use block map"), EXT2FS_BMAP64_HYBRID,
 			"block_found_map", &ctx->block_found_map);
 	if (pctx.errcode) {
 		pctx.num = 1;
@@ -1225,6 +1227,19 @@ void e2fsck_pass1(e2fsck_t ctx)
 	scan_struct.ctx = ctx;
 	scan_struct.block_buf = block_buf;
 	ext2fs_set_inode_callback(scan, scan_callback, &scan_struct);
+
+	/*
+	 * With worker threads available, let them read and verify the
+	 * inode tables ahead of us; they also take over the readahead.
+	 * If that can't be set up we just use the plain scan.
+	 */
+	if (ctx->num_threads > 1 &&
+	    e2fsck_open_pscan(ctx, ctx->num_threads,
+			      EXT2_SF_SKIP_MISSING_ITABLE |
+			      EXT2_SF_WARN_GARBAGE_INODES, &pscan) == 0) {
+		e2fsck_pscan_set_callback(pscan, scan_callback, &scan_struct);
+		ino_threshold = fs->super->s_inodes_count;
+	}
 	if (ctx->progress && ((ctx->progress)(ctx, 1, 0,
 					      ctx->fs->group_desc_count)))
 		goto endit;
@@ -1249,7 +1264,11 @@ void e2fsck_pass1(e2fsck_t ctx)
 				fatal_error(ctx, 0);
 		}
 		old_op = ehandler_operation(_("getting next inode from scan"));
-		pctx.errcode = ext2fs_get_next_inode_full(scan, &ino,
+		if (pscan)
+			pctx.errcode = e2fsck_pscan_next(pscan, &ino,
+							 inode, inode_size);
+		else
+			pctx.errcode = ext2fs_get_next_inode_full(scan, &ino,
 							  inode, inode_size);
 		if (ino > ino_threshold)
 			pass1_readahead(ctx, &ra_group, &ino_threshold);
@@ -1842,6 +1861,8 @@ void e2fsck_pass1(e2fsck_t ctx)
 		}
 	}
 	process_inodes(ctx, block_buf);
+	e2fsck_close_pscan(pscan);
+	pscan = NULL;
 	ext2fs_close_inode_scan(scan);
 	scan = NULL;
 
@@ -1919,6 +1940,8 @@ void e2fsck_pass1(e2fsck_t ctx)
 endit:
 	e2fsck_use_inode_shortcuts(ctx, 0);
 
+	if (pscan)
+		e2fsck_close_pscan(pscan);
 	if (scan)
 		ext2fs_close_inode_scan(scan);
 	if (block_buf)
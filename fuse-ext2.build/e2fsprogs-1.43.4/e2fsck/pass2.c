@@ -83,6 +83,7 @@ struct check_dir_struct {
 	unsigned long long list_offset;
 	unsigned long long ra_entries;
 	unsigned long long next_ra_off;
+	e2fsck_dscan_t dscan;
 };
 
 void e2fsck_pass2(e2fsck_t ctx)
@@ -140,16 +141,27 @@ void e2fsck_pass2(e2fsck_t ctx)
 	cd.list_offset = 0;
 	cd.ra_entries = ctx->readahead_kb * 1024 / ctx->fs->blocksize;
 	cd.next_ra_off = 0;
+	cd.dscan = NULL;
 
 	if (ctx->progress)
 		(void) (ctx->progress)(ctx, 2, 0, cd.max);
 
 	if (ext2fs_has_feature_dir_index(fs->super))
 		ext2fs_dblist_sort2(fs->dblist, special_dir_block_cmp);
+	else if (ctx->num_threads > 1)
+		/* Settle the order before the read-ahead threads see it */
+		ext2fs_dblist_sort2(fs->dblist, 0);
 
-	check_dir_func = cd.ra_entries ? check_dir_block2 : check_dir_block;
+	if (ctx->num_threads > 1 &&
+	    e2fsck_open_dscan(ctx, ctx->num_threads, &cd.dscan) == 0)
+		cd.ra_entries = 0;
+
+	check_dir_func = (cd.ra_entries || cd.dscan) ? check_dir_block2 :
+						       check_dir_block;
 	cd.pctx.errcode = ext2fs_dblist_iterate2(fs->dblist, check_dir_func,
 						 &cd);
+	e2fsck_close_dscan(cd.dscan);
+	cd.dscan = NULL;
 	if (ctx->flags & E2F_FLAG_RESTART_LATER) {
 		ctx->flags |= E2F_FLAG_RESTART;
 		ctx->flags &= ~E2F_FLAG_RESTART_LATER;
@@ -869,6 +881,8 @@ static int check_dir_block2(ext2_filsys fs,
 			cd->ra_entries = 0;
 		cd->next_ra_off = cd->list_offset + (cd->ra_entries * 7 / 8);
 	}
+	if (cd->dscan)
+		e2fsck_dscan_seek(cd->dscan, cd->list_offset);
 
 	err = check_dir_block(fs, db, priv_data);
 	cd->list_offset++;
@@ -994,7 +1008,10 @@ skip_first_read_swab:
 				inline_data_size - EXT4_MIN_INLINE_DATA_SIZE,
 				0);
 #endif
-	} else
+	} else if (cd->dscan &&
+		   e2fsck_dscan_read(cd->dscan, ino, block_nr, buf) == 0)
+		cd->pctx.errcode = 0;
+	else
 		cd->pctx.errcode = ext2fs_read_dir_block4(fs, block_nr,
 							  buf, 0, ino);
 inline_read_fail:
@@ -308,6 +308,59 @@ static void print_bitmap_problem(e2fsck_t ctx, problem_t problem,
 #define LE_CLSTR(x, y) (B2C(x) <= B2C(y))
 #define GE_CLSTR(x, y) (B2C(x) >= B2C(y))
 
+/*
+ * Note a block whose bit in the on-disk bitmap disagrees with what
+ * we found, merging it into the range being collected in pctx.
+ */
+static void note_block_problem(e2fsck_t ctx, struct problem_context *pctx,
+			       problem_t *save_problem, dgrp_t group,
+			       blk64_t i, int actual)
+{
+	ext2_filsys fs = ctx->fs;
+	problem_t	problem;
+
+	if (!actual) {
+		/*
+		 * Block not used, but marked in use in the bitmap.
+		 */
+		problem = PR_5_BLOCK_UNUSED;
+	} else {
+		/*
+		 * Block used, but not marked in use in the bitmap.
+		 */
+		problem = PR_5_BLOCK_USED;
+
+		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT)) {
+			struct problem_context pctx2;
+			pctx2.blk = i;
+			pctx2.group = group;
+			if (fix_problem(ctx, PR_5_BLOCK_UNINIT, &pctx2))
+				ext2fs_bg_flags_clear(fs, group,
+						      EXT2_BG_BLOCK_UNINIT);
+		}
+	}
+	if (pctx->blk == NO_BLK) {
+		pctx->blk = pctx->blk2 = i;
+		*save_problem = problem;
+	} else {
+		if ((problem == *save_problem) &&
+		    (pctx->blk2 == i - EXT2FS_CLUSTER_RATIO(fs)))
+			pctx->blk2 += EXT2FS_CLUSTER_RATIO(fs);
+		else {
+			print_bitmap_problem(ctx, *save_problem, pctx);
+			pctx->blk = pctx->blk2 = i;
+			*save_problem = problem;
+		}
+	}
+	ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
+
+	/*
+	 * If there a problem we should turn off the discard so we
+	 * do not compromise the filesystem.
+	 */
+	ctx->options &= ~E2F_OPT_DISCARD;
+}
+
 static void check_block_bitmaps(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
@@ -320,11 +373,12 @@ static void check_block_bitmaps(e2fsck_t ctx)
 	unsigned int	group_free = 0;
 	int	actual, bitmap;
 	struct problem_context	pctx;
-	problem_t	problem, save_problem;
+	problem_t	save_problem;
 	int		fixit, had_problem;
 	errcode_t	retval;
 	int	redo_flag = 0;
 	char *actual_buf, *bitmap_buf;
+	unsigned int	bit;
 
 	actual_buf = (char *) e2fsck_allocate_memory(ctx, fs->blocksize,
 						     "actual bitmap buffer");
@@ -375,19 +429,21 @@ redo_counts:
 		int first_block_in_bg = (B2C(i) -
 					 B2C(fs->super->s_first_data_block)) %
 			fs->super->s_clusters_per_group == 0;
-		int n, nbytes = fs->super->s_clusters_per_group / 8;
+		int nbits = fs->super->s_clusters_per_group;
+		int nbytes = nbits / 8;
 
 		actual = ext2fs_fast_test_block_bitmap2(ctx->block_found_map, i);
 
 		/*
 		 * Try to optimize pass5 by extracting a bitmap block
 		 * as expected from what we have on disk, and then
-		 * comparing the two.  If they are identical, then
-		 * update the free block counts and go on to the next
-		 * block group.  This is much faster than doing the
-		 * individual bit-by-bit comparison.  The one downside
-		 * is that this doesn't work if we are asking e2fsck
-		 * to do a discard operation.
+		 * comparing the two a chunk at a time.  The free block
+		 * counts come from the on-disk copy in one go, and
+		 * only the bits that differ are looked at one by one.
+		 * This is much faster than doing the individual
+		 * bit-by-bit comparison.  The one downside is that
+		 * this doesn't work if we are asking e2fsck to do a
+		 * discard operation.
 		 */
 		if (!first_block_in_bg ||
 		    (group == fs->group_desc_count - 1) ||
@@ -404,10 +460,16 @@ redo_counts:
 				bitmap_buf);
 		if (retval)
 			goto no_optimize;
-		if (memcmp(actual_buf, bitmap_buf, nbytes) != 0)
-			goto no_optimize;
-		n = ext2fs_bitcount(actual_buf, nbytes);
-		group_free = fs->super->s_clusters_per_group - n;
+		for (bit = ext2fs_bitmap_diff(actual_buf, bitmap_buf, 0, nbits);
+		     bit < (unsigned int) nbits;
+		     bit = ext2fs_bitmap_diff(actual_buf, bitmap_buf, bit + 1,
+					      nbits)) {
+			note_block_problem(ctx, &pctx, &save_problem, group,
+					   i + EXT2FS_C2B(fs, bit),
+					   ext2fs_test_bit(bit, actual_buf));
+			had_problem++;
+		}
+		group_free = nbits - ext2fs_bitcount(bitmap_buf, nbytes);
 		free_blocks += group_free;
 		i += EXT2FS_C2B(fs, fs->super->s_clusters_per_group - 1);
 		goto next_group;
@@ -421,50 +483,10 @@ redo_counts:
 		if (!actual == !bitmap)
 			goto do_counts;
 
-		if (!actual && bitmap) {
-			/*
-			 * Block not used, but marked in use in the bitmap.
-			 */
-			problem = PR_5_BLOCK_UNUSED;
-		} else {
-			/*
-			 * Block used, but not marked in use in the bitmap.
-			 */
-			problem = PR_5_BLOCK_USED;
-
-			if (ext2fs_bg_flags_test(fs, group,
-						 EXT2_BG_BLOCK_UNINIT)) {
-				struct problem_context pctx2;
-				pctx2.blk = i;
-				pctx2.group = group;
-				if (fix_problem(ctx, PR_5_BLOCK_UNINIT,
-						&pctx2))
-					ext2fs_bg_flags_clear(fs, group,
-							EXT2_BG_BLOCK_UNINIT);
-			}
-		}
-		if (pctx.blk == NO_BLK) {
-			pctx.blk = pctx.blk2 = i;
-			save_problem = problem;
-		} else {
-			if ((problem == save_problem) &&
-			    (pctx.blk2 == i - EXT2FS_CLUSTER_RATIO(fs)))
-				pctx.blk2 += EXT2FS_CLUSTER_RATIO(fs);
-			else {
-				print_bitmap_problem(ctx, save_problem, &pctx);
-				pctx.blk = pctx.blk2 = i;
-				save_problem = problem;
-			}
-		}
-		ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
+		note_block_problem(ctx, &pctx, &save_problem, group, i,
+				   actual);
 		had_problem++;
 
-		/*
-		 * If there a problem we should turn off the discard so we
-		 * do not compromise the filesystem.
-		 */
-		ctx->options &= ~E2F_OPT_DISCARD;
-
 	do_counts:
 		if (!bitmap) {
 			group_free++;
@@ -560,6 +582,64 @@ errout:
 	ext2fs_free_mem(&bitmap_buf);
 }
 
+/*
+ * Note an inode whose bit in the on-disk bitmap disagrees with what
+ * we found, merging it into the range being collected in pctx.
+ */
+static void note_inode_problem(e2fsck_t ctx, struct problem_context *pctx,
+			       problem_t *save_problem, dgrp_t group,
+			       ext2_ino_t i, int actual, int *skip_group)
+{
+	ext2_filsys fs = ctx->fs;
+	problem_t	problem;
+
+	if (!actual) {
+		/*
+		 * Inode wasn't used, but marked in bitmap
+		 */
+		problem = PR_5_INODE_UNUSED;
+	} else /* if (actual && !bitmap) */ {
+		/*
+		 * Inode used, but not in bitmap
+		 */
+		problem = PR_5_INODE_USED;
+
+		/* We should never hit this, because it means that
+		 * inodes were marked in use that weren't noticed
+		 * in pass1 or pass 2. It is easier to fix the problem
+		 * than to kill e2fsck and leave the user stuck. */
+		if (*skip_group) {
+			struct problem_context pctx2;
+			pctx2.blk = i;
+			pctx2.group = group;
+			if (fix_problem(ctx, PR_5_INODE_UNINIT, &pctx2)) {
+				ext2fs_bg_flags_clear(fs, group,
+						      EXT2_BG_INODE_UNINIT);
+				*skip_group = 0;
+			}
+		}
+	}
+	if (pctx->ino == 0) {
+		pctx->ino = pctx->ino2 = i;
+		*save_problem = problem;
+	} else {
+		if ((problem == *save_problem) &&
+		    (pctx->ino2 == i-1))
+			pctx->ino2++;
+		else {
+			print_bitmap_problem(ctx, *save_problem, pctx);
+			pctx->ino = pctx->ino2 = i;
+			*save_problem = problem;
+		}
+	}
+	ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
+	/*
+	 * If there a problem we should turn off the discard so we
+	 * do not compromise the filesystem.
+	 */
+	ctx->options &= ~E2F_OPT_DISCARD;
+}
+
 static void check_inode_bitmaps(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
@@ -574,12 +654,23 @@ static void check_inode_bitmaps(e2fsck_t ctx)
 	int		actual, bitmap;
 	errcode_t	retval;
 	struct problem_context	pctx;
-	problem_t	problem, save_problem;
+	problem_t	save_problem;
 	int		fixit, had_problem;
 	int		csum_flag;
 	int		skip_group = 0;
 	int		redo_flag = 0;
 	ext2_ino_t		first_free = fs->super->s_inodes_per_group + 1;
+	int		nbytes = fs->super->s_inodes_per_group / 8;
+	char		*actual_buf, *bitmap_buf, *dir_buf;
+	unsigned int	bit;
+	int		n;
+
+	actual_buf = (char *) e2fsck_allocate_memory(ctx, nbytes,
+						     "actual bitmap buffer");
+	bitmap_buf = (char *) e2fsck_allocate_memory(ctx, nbytes,
+						     "bitmap block buffer");
+	dir_buf = (char *) e2fsck_allocate_memory(ctx, nbytes,
+						  "directory bitmap buffer");
 
 	clear_problem_context(&pctx);
 	free_array = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
@@ -651,6 +742,49 @@ redo_counts:
 			}
 		}
 
+		/*
+		 * As in check_block_bitmaps(), compare a whole group's
+		 * worth of bitmap at a time, and only look at the
+		 * inodes that differ one by one.
+		 */
+		if (skip_group ||
+		    i % fs->super->s_inodes_per_group != 1 ||
+		    (ctx->options & E2F_OPT_DISCARD))
+			goto no_optimize;
+
+		if (ext2fs_get_inode_bitmap_range2(ctx->inode_used_map, i,
+				fs->super->s_inodes_per_group, actual_buf) ||
+		    (!redo_flag &&
+		     ext2fs_get_inode_bitmap_range2(fs->inode_map, i,
+				fs->super->s_inodes_per_group, bitmap_buf)) ||
+		    ext2fs_get_inode_bitmap_range2(ctx->inode_dir_map, i,
+				fs->super->s_inodes_per_group, dir_buf))
+			goto no_optimize;
+		if (redo_flag)
+			memcpy(bitmap_buf, actual_buf, nbytes);
+
+		for (bit = ext2fs_bitmap_diff(actual_buf, bitmap_buf, 0,
+					      fs->super->s_inodes_per_group);
+		     bit < fs->super->s_inodes_per_group;
+		     bit = ext2fs_bitmap_diff(actual_buf, bitmap_buf, bit + 1,
+					      fs->super->s_inodes_per_group)) {
+			note_inode_problem(ctx, &pctx, &save_problem, group,
+					   i + bit,
+					   ext2fs_test_bit(bit, actual_buf),
+					   &skip_group);
+			had_problem++;
+		}
+		n = ext2fs_bitcount(bitmap_buf, nbytes);
+		group_free = fs->super->s_inodes_per_group - n;
+		free_inodes += group_free;
+		for (n = 0; n < nbytes; n++)
+			dir_buf[n] &= bitmap_buf[n];
+		dirs_count = ext2fs_bitcount(dir_buf, nbytes);
+		inodes = fs->super->s_inodes_per_group;
+		i += inodes - 1;
+		goto next_group;
+	no_optimize:
+
 		actual = ext2fs_fast_test_inode_bitmap2(ctx->inode_used_map, i);
 		if (redo_flag)
 			bitmap = actual;
@@ -659,51 +793,9 @@ redo_counts:
 		if (!actual == !bitmap)
 			goto do_counts;
 
-		if (!actual && bitmap) {
-			/*
-			 * Inode wasn't used, but marked in bitmap
-			 */
-			problem = PR_5_INODE_UNUSED;
-		} else /* if (actual && !bitmap) */ {
-			/*
-			 * Inode used, but not in bitmap
-			 */
-			problem = PR_5_INODE_USED;
-
-			/* We should never hit this, because it means that
-			 * inodes were marked in use that weren't noticed
-			 * in pass1 or pass 2. It is easier to fix the problem
-			 * than to kill e2fsck and leave the user stuck. */
-			if (skip_group) {
-				struct problem_context pctx2;
-				pctx2.blk = i;
-				pctx2.group = group;
-				if (fix_problem(ctx, PR_5_INODE_UNINIT,&pctx2)){
-					ext2fs_bg_flags_clear(fs, group, EXT2_BG_INODE_UNINIT);
-					skip_group = 0;
-				}
-			}
-		}
-		if (pctx.ino == 0) {
-			pctx.ino = pctx.ino2 = i;
-			save_problem = problem;
-		} else {
-			if ((problem == save_problem) &&
-			    (pctx.ino2 == i-1))
-				pctx.ino2++;
-			else {
-				print_bitmap_problem(ctx, save_problem, &pctx);
-				pctx.ino = pctx.ino2 = i;
-				save_problem = problem;
-			}
-		}
-		ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
+		note_inode_problem(ctx, &pctx, &save_problem, group, i,
+				   actual, &skip_group);
 		had_problem++;
-		/*
-		 * If there a problem we should turn off the discard so we
-		 * do not compromise the filesystem.
-		 */
-		ctx->options &= ~E2F_OPT_DISCARD;
 
 do_counts:
 		inodes++;
@@ -722,6 +814,7 @@ do_counts:
 				first_free = inodes;
 		}
 
+	next_group:
 		if ((inodes == fs->super->s_inodes_per_group) ||
 		    (i == fs->super->s_inodes_count)) {
 			/*
@@ -833,6 +926,9 @@ do_counts:
 errout:
 	ext2fs_free_mem(&free_array);
 	ext2fs_free_mem(&dir_array);
+	ext2fs_free_mem(&actual_buf);
+	ext2fs_free_mem(&bitmap_buf);
+	ext2fs_free_mem(&dir_buf);
 }
 
 static void check_inode_end(e2fsck_t ctx)
@@ -0,0 +1,460 @@
+/*
+ * pscan.c --- multi-threaded inode table scan for pass 1
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ *
+ * This is not a parallel pass 1: the checks themselves still run on
+ * the main thread.  What is done in parallel is the part of the scan
+ * which doesn't depend on them, pulling the inode tables in, verifying
+ * inode checksums and deciding which inode table blocks are garbage.
+ * A set of worker threads does that ahead of time, each with its own
+ * inode scan, one block group at a time.  The consumer side hands the inodes
+ * back in exactly the order ext2fs_get_next_inode_full() would, and
+ * calls the end-of-group callback at the same points, so everything
+ * pass 1 checks and every question it asks stays serialized and comes
+ * out the same no matter how many threads were used.
+ *
+ * The workers only read the inode tables; all fixes are still written
+ * by the main thread.  A worker can't ask about a read error, so when
+ * one stops short of the end of a group, the main thread scans the
+ * rest of that group itself and the I/O error handler runs there, as
+ * it would without workers.  Like the single-threaded scan, which buffers
+ * inode_buffer_blocks ahead, a worker may hand back an inode that pass
+ * 1 rewrote after the worker had read it; we keep the lookahead down to
+ * a couple of groups per thread for this reason.
+ */
+
+#include "config.h"
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "e2fsck.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/* How many groups each worker may be ahead of the consumer */
+#define PSCAN_GROUPS_PER_THREAD	2
+
+enum pscan_state { SLOT_FREE, SLOT_BUSY, SLOT_READY };
+
+struct pscan_slot {
+	enum pscan_state state;
+	dgrp_t		group;
+	int		done;		/* scan reached the end of the group */
+	ext2_ino_t	first_ino;	/* inode number of inodes[0] */
+	ext2_ino_t	count;		/* inodes read from the group */
+	errcode_t	end_err;	/* error that stopped the group early */
+	char		*inodes;	/* count inodes, inode_size apart */
+	errcode_t	*errs;		/* per-inode scan result */
+};
+
+struct pscan_worker {
+	struct e2fsck_pscan_struct *pscan;
+	ext2_inode_scan	scan;
+	struct pscan_slot *slot;	/* slot being filled */
+	pthread_t	thread;
+	int		started;
+};
+
+struct e2fsck_pscan_struct {
+	ext2_filsys	fs;
+	int		inode_size;
+	int		nr_workers;
+	struct pscan_worker *workers;
+	dgrp_t		nr_slots;
+	struct pscan_slot *slots;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	ready;		/* a slot was filled */
+	pthread_cond_t	space;		/* a slot was freed */
+	dgrp_t		next_group;	/* next group to hand to a worker */
+	dgrp_t		cur_group;	/* group the consumer is reading */
+	int		cur_ready;	/* cur_group's slot has been filled */
+	ext2_ino_t	cur_index;	/* next inode within cur_group */
+	int		stop;
+
+	ext2_inode_scan	scan;		/* for groups a worker gave up on */
+	int		fallback;	/* scan is positioned in cur_group */
+	int		fallback_done;	/* scan reached the end of cur_group */
+
+	errcode_t	(*done_group)(ext2_filsys fs, ext2_inode_scan scan,
+				      dgrp_t group, void *priv_data);
+	void		*done_group_data;
+};
+
+/*
+ * Stop the worker's scan at the end of the group it was pointed at
+ * rather than letting it read on into the next one.
+ */
+static errcode_t worker_done_group(ext2_filsys fs EXT2FS_ATTR((unused)),
+				   ext2_inode_scan scan EXT2FS_ATTR((unused)),
+				   dgrp_t group EXT2FS_ATTR((unused)),
+				   void *priv_data)
+{
+	struct pscan_worker *w = (struct pscan_worker *) priv_data;
+
+	w->slot->done = 1;
+	return EXT2_ET_CANCEL_REQUESTED;
+}
+
+static errcode_t fallback_done_group(ext2_filsys fs EXT2FS_ATTR((unused)),
+				     ext2_inode_scan scan EXT2FS_ATTR((unused)),
+				     dgrp_t group EXT2FS_ATTR((unused)),
+				     void *priv_data)
+{
+	e2fsck_pscan_t	pscan = (e2fsck_pscan_t) priv_data;
+
+	pscan->fallback_done = 1;
+	return EXT2_ET_CANCEL_REQUESTED;
+}
+
+static void scan_group(struct pscan_worker *w, struct pscan_slot *slot)
+{
+	e2fsck_pscan_t	pscan = w->pscan;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+
+	slot->done = 0;
+	slot->count = 0;
+	slot->first_ino = 0;
+	slot->end_err = 0;
+	w->slot = slot;
+
+	retval = ext2fs_inode_scan_goto_blockgroup(w->scan, slot->group);
+	while (!retval) {
+		retval = ext2fs_get_next_inode_full(w->scan, &ino,
+				(struct ext2_inode *) (slot->inodes +
+				 slot->count * pscan->inode_size),
+				pscan->inode_size);
+		if (slot->done)
+			return;
+		if (retval &&
+		    retval != EXT2_ET_INODE_CSUM_INVALID &&
+		    retval != EXT2_ET_INODE_IS_GARBAGE &&
+		    retval != EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+			break;
+		if (!ino)
+			return;
+		if (!slot->count)
+			slot->first_ino = ino;
+		slot->errs[slot->count++] = retval;
+		retval = 0;
+	}
+	slot->end_err = retval;
+}
+
+static void *pscan_worker_thread(void *arg)
+{
+	struct pscan_worker *w = (struct pscan_worker *) arg;
+	e2fsck_pscan_t	pscan = w->pscan;
+	struct pscan_slot *slot;
+	dgrp_t		group;
+
+	pthread_mutex_lock(&pscan->lock);
+	while (1) {
+		while (!pscan->stop &&
+		       pscan->next_group < pscan->fs->group_desc_count &&
+		       pscan->next_group >= pscan->cur_group + pscan->nr_slots)
+			pthread_cond_wait(&pscan->space, &pscan->lock);
+		if (pscan->stop ||
+		    pscan->next_group >= pscan->fs->group_desc_count)
+			break;
+		group = pscan->next_group++;
+		slot = &pscan->slots[group % pscan->nr_slots];
+		slot->group = group;
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&pscan->lock);
+
+		scan_group(w, slot);
+
+		pthread_mutex_lock(&pscan->lock);
+		slot->state = SLOT_READY;
+		pthread_cond_broadcast(&pscan->ready);
+	}
+	pthread_mutex_unlock(&pscan->lock);
+	return NULL;
+}
+
+void e2fsck_close_pscan(e2fsck_pscan_t pscan)
+{
+	int	i;
+
+	if (!pscan)
+		return;
+
+	pthread_mutex_lock(&pscan->lock);
+	pscan->stop = 1;
+	pthread_cond_broadcast(&pscan->space);
+	pthread_mutex_unlock(&pscan->lock);
+
+	for (i = 0; pscan->workers && i < pscan->nr_workers; i++) {
+		if (pscan->workers[i].started)
+			pthread_join(pscan->workers[i].thread, NULL);
+		if (pscan->workers[i].scan)
+			ext2fs_close_inode_scan(pscan->workers[i].scan);
+	}
+	if (pscan->scan)
+		ext2fs_close_inode_scan(pscan->scan);
+	for (i = 0; pscan->slots && i < (int) pscan->nr_slots; i++) {
+		if (pscan->slots[i].inodes)
+			ext2fs_free_mem(&pscan->slots[i].inodes);
+		if (pscan->slots[i].errs)
+			ext2fs_free_mem(&pscan->slots[i].errs);
+	}
+	pthread_cond_destroy(&pscan->space);
+	pthread_cond_destroy(&pscan->ready);
+	pthread_mutex_destroy(&pscan->lock);
+	if (pscan->slots)
+		ext2fs_free_mem(&pscan->slots);
+	if (pscan->workers)
+		ext2fs_free_mem(&pscan->workers);
+	ext2fs_free_mem(&pscan);
+}
+
+errcode_t e2fsck_open_pscan(e2fsck_t ctx, int threads, int scan_flags,
+			    e2fsck_pscan_t *ret)
+{
+	ext2_filsys	fs = ctx->fs;
+	e2fsck_pscan_t	pscan;
+	ext2_ino_t	ipg = fs->super->s_inodes_per_group;
+	errcode_t	retval;
+	int		i;
+
+	/*
+	 * The workers share the I/O channel, so the filesystem has to
+	 * have been opened for threaded use.  Bad blocks in the inode
+	 * tables make pass 1 restart the scan, which only the plain
+	 * scan supports.
+	 */
+	if (threads < 2 || !(fs->flags & EXT2_FLAG_THREADS))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+
+	retval = ext2fs_get_memzero(sizeof(struct e2fsck_pscan_struct),
+				    &pscan);
+	if (retval)
+		return retval;
+	pscan->fs = fs;
+	pscan->inode_size = EXT2_INODE_SIZE(fs->super);
+	pscan->nr_workers = threads;
+	pscan->nr_slots = threads * PSCAN_GROUPS_PER_THREAD;
+	pthread_mutex_init(&pscan->lock, NULL);
+	pthread_cond_init(&pscan->ready, NULL);
+	pthread_cond_init(&pscan->space, NULL);
+
+	retval = ext2fs_get_arrayzero(threads, sizeof(struct pscan_worker),
+				      &pscan->workers);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_arrayzero(pscan->nr_slots,
+				      sizeof(struct pscan_slot),
+				      &pscan->slots);
+	if (retval)
+		goto errout;
+	for (i = 0; i < (int) pscan->nr_slots; i++) {
+		retval = ext2fs_get_array(ipg, pscan->inode_size,
+					  &pscan->slots[i].inodes);
+		if (retval)
+			goto errout;
+		retval = ext2fs_get_array(ipg, sizeof(errcode_t),
+					  &pscan->slots[i].errs);
+		if (retval)
+			goto errout;
+	}
+
+	/* Open the scans here; the first one may read the bad blocks list */
+	retval = ext2fs_open_inode_scan(fs, ctx->inode_buffer_blocks,
+					&pscan->scan);
+	if (retval)
+		goto errout;
+	ext2fs_inode_scan_flags(pscan->scan, scan_flags, 0);
+	ext2fs_set_inode_callback(pscan->scan, fallback_done_group, pscan);
+	for (i = 0; i < threads; i++) {
+		struct pscan_worker *w = &pscan->workers[i];
+
+		w->pscan = pscan;
+		retval = ext2fs_open_inode_scan(fs, ctx->inode_buffer_blocks,
+						&w->scan);
+		if (retval)
+			goto errout;
+		if (fs->badblocks && ext2fs_u32_list_count(fs->badblocks)) {
+			retval = EXT2_ET_OP_NOT_SUPPORTED;
+			goto errout;
+		}
+		/*
+		 * Pass 1 flips EXT2_FLAG_IGNORE_CSUM_ERRORS while the
+		 * workers run, so always verify and let
+		 * e2fsck_pscan_next() apply the flag instead.
+		 */
+		ext2fs_inode_scan_flags(w->scan, scan_flags |
+					EXT2_SF_VERIFY_CSUMS, 0);
+		ext2fs_set_inode_callback(w->scan, worker_done_group, w);
+	}
+
+	for (i = 0; i < threads; i++) {
+		struct pscan_worker *w = &pscan->workers[i];
+
+		if (pthread_create(&w->thread, NULL, pscan_worker_thread, w)) {
+			retval = EXT2_ET_OP_NOT_SUPPORTED;
+			if (i)
+				break;
+			goto errout;
+		}
+		w->started = 1;
+	}
+
+	*ret = pscan;
+	return 0;
+
+errout:
+	e2fsck_close_pscan(pscan);
+	return retval;
+}
+
+void e2fsck_pscan_set_callback(e2fsck_pscan_t pscan,
+			       errcode_t (*done_group)(ext2_filsys fs,
+						       ext2_inode_scan scan,
+						       dgrp_t group,
+						       void *priv_data),
+			       void *done_group_data)
+{
+	pscan->done_group = done_group;
+	pscan->done_group_data = done_group_data;
+}
+
+/*
+ * Return the next inode of cur_group from the main thread's own scan,
+ * starting right after the ones the worker handed back.  *ino is set
+ * to zero at the end of the group.
+ */
+static errcode_t fallback_next(e2fsck_pscan_t pscan, ext2_ino_t *ino,
+			       struct ext2_inode *inode, int bufsize)
+{
+	ext2_ino_t	i;
+	errcode_t	retval;
+
+	if (!pscan->fallback) {
+		pscan->fallback_done = 0;
+		retval = ext2fs_inode_scan_goto_blockgroup(pscan->scan,
+							   pscan->cur_group);
+		if (retval)
+			return retval;
+		pscan->fallback = 1;
+		for (i = 0; i < pscan->cur_index; i++) {
+			retval = ext2fs_get_next_inode_full(pscan->scan, ino,
+							    inode, bufsize);
+			if (pscan->fallback_done)
+				break;
+			if (retval &&
+			    retval != EXT2_ET_INODE_CSUM_INVALID &&
+			    retval != EXT2_ET_INODE_IS_GARBAGE)
+				return retval;
+		}
+	}
+	if (!pscan->fallback_done) {
+		retval = ext2fs_get_next_inode_full(pscan->scan, ino, inode,
+						    bufsize);
+		if (!pscan->fallback_done)
+			return retval;
+	}
+	*ino = 0;
+	return 0;
+}
+
+/*
+ * This function returns the next inode, like ext2fs_get_next_inode_full().
+ */
+errcode_t e2fsck_pscan_next(e2fsck_pscan_t pscan, ext2_ino_t *ino,
+			    struct ext2_inode *inode, int bufsize)
+{
+	ext2_filsys	fs = pscan->fs;
+	struct pscan_slot *slot;
+	errcode_t	retval;
+
+	while (pscan->cur_group < fs->group_desc_count) {
+		slot = &pscan->slots[pscan->cur_group % pscan->nr_slots];
+		if (!pscan->cur_ready) {
+			pthread_mutex_lock(&pscan->lock);
+			while (slot->state != SLOT_READY ||
+			       slot->group != pscan->cur_group)
+				pthread_cond_wait(&pscan->ready, &pscan->lock);
+			pthread_mutex_unlock(&pscan->lock);
+			pscan->cur_ready = 1;
+		}
+
+		if (pscan->cur_index < slot->count) {
+			if (bufsize > pscan->inode_size)
+				bufsize = pscan->inode_size;
+			memcpy(inode, slot->inodes +
+			       pscan->cur_index * pscan->inode_size, bufsize);
+			retval = slot->errs[pscan->cur_index];
+			if (retval == EXT2_ET_INODE_CSUM_INVALID &&
+			    (fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS))
+				retval = 0;
+			*ino = slot->first_ino + pscan->cur_index++;
+			return retval;
+		}
+		if (slot->end_err) {
+			retval = fallback_next(pscan, ino, inode, bufsize);
+			if (retval || *ino)
+				return retval;
+			pscan->fallback = 0;
+		}
+
+		if (pscan->done_group) {
+			retval = (pscan->done_group)(fs, NULL,
+						     pscan->cur_group,
+						     pscan->done_group_data);
+			if (retval)
+				return retval;
+		}
+
+		pthread_mutex_lock(&pscan->lock);
+		slot->state = SLOT_FREE;
+		pscan->cur_group++;
+		pscan->cur_ready = 0;
+		pscan->cur_index = 0;
+		pthread_cond_broadcast(&pscan->space);
+		pthread_mutex_unlock(&pscan->lock);
+	}
+	*ino = 0;
+	return 0;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+errcode_t e2fsck_open_pscan(e2fsck_t ctx EXT2FS_ATTR((unused)),
+			    int threads EXT2FS_ATTR((unused)),
+			    int scan_flags EXT2FS_ATTR((unused)),
+			    e2fsck_pscan_t *ret EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+void e2fsck_pscan_set_callback(e2fsck_pscan_t pscan EXT2FS_ATTR((unused)),
+			       errcode_t (*done_group)(ext2_filsys fs,
+						       ext2_inode_scan scan,
+						       dgrp_t group,
+						       void *priv_data)
+						EXT2FS_ATTR((unused)),
+			       void *done_group_data EXT2FS_ATTR((unused)))
+{
+}
+
+errcode_t e2fsck_pscan_next(e2fsck_pscan_t pscan EXT2FS_ATTR((unused)),
+			    ext2_ino_t *ino EXT2FS_ATTR((unused)),
+			    struct ext2_inode *inode EXT2FS_ATTR((unused)),
+			    int bufsize EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+void e2fsck_close_pscan(e2fsck_pscan_t pscan EXT2FS_ATTR((unused)))
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
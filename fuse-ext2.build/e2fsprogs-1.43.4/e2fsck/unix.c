@@ -651,6 +651,7 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 {
 	char	*buf, *token, *next, *p, *arg;
 	int	ea_ver;
+	int	threads;
 	int	extended_usage = 0;
 	unsigned long long reada_kb;
 
@@ -694,6 +695,19 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 				continue;
 			}
 			ctx->readahead_kb = reada_kb;
+		} else if (strcmp(token, "threads") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			threads = strtoul(arg, &p, 0);
+			if (*p || threads < 1 || threads > 64) {
+				fprintf(stderr, "%s",
+					_("Invalid number of threads.\n"));
+				extended_usage++;
+				continue;
+			}
+			ctx->num_threads = threads;
 		} else if (strcmp(token, "fragcheck") == 0) {
 			ctx->options |= E2F_OPT_FRAGCHECK;
 			continue;
@@ -740,6 +754,7 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 		fputs(("\tdiscard\n"), stderr);
 		fputs(("\tnodiscard\n"), stderr);
 		fputs(("\treadahead_kb=<buffer size>\n"), stderr);
+		fputs(("\tthreads=<number of threads>\n"), stderr);
 		fputs(("\tbmap2extent\n"), stderr);
 		fputc('\n', stderr);
 		exit(1);
@@ -1435,6 +1450,10 @@ restart:
 			exit(FSCK_ERROR);
 	}
 
+	/* Only the unix I/O manager can be shared between threads */
+	if (ctx->num_threads > 1 && io_ptr == unix_io_manager)
+		flags |= EXT2_FLAG_THREADS;
+
 	ctx->openfs_flags = flags;
 	retval = try_open_fs(ctx, flags, io_ptr, &fs);
 
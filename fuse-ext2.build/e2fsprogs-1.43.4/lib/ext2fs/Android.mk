@@ -13,6 +13,7 @@ libext2fs_src_files := \
 	bitops.c \
 	blkmap64_ba.c \
 	blkmap64_rb.c \
+	blkmap64_hy.c \
 	blknum.c \
 	block.c \
 	bmap.c \
@@ -70,6 +71,7 @@ libext2fs_src_files := \
 	read_bb_file.c \
 	res_gdt.c \
 	rw_bitmaps.c \
+	scratch.c \
 	sha256.c \
 	sha512.c \
 	swapfs.c \
@@ -12,6 +12,7 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <string.h>
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -156,3 +157,86 @@ unsigned int ext2fs_bitcount(const void *addr, unsigned int nbytes)
 	}
 	return res;
 }
+
+/*
+ * Two bitmaps are compared 256 bits at a time.  Where the compiler
+ * knows about vector types, a chunk is loaded and XORed as a single
+ * vector.
+ */
+#define BITMAP_CHUNK_BYTES	32
+
+#ifdef __GNUC__
+typedef __u64 bitmap_chunk_t __attribute__((vector_size(BITMAP_CHUNK_BYTES)));
+
+static inline int chunk_differs(const unsigned char *a,
+				const unsigned char *b)
+{
+	bitmap_chunk_t	x, y;
+
+	memcpy(&x, a, BITMAP_CHUNK_BYTES);
+	memcpy(&y, b, BITMAP_CHUNK_BYTES);
+	x ^= y;
+	return (x[0] | x[1] | x[2] | x[3]) != 0;
+}
+#else
+static inline int chunk_differs(const unsigned char *a,
+				const unsigned char *b)
+{
+	__u64	x[4], y[4];
+
+	memcpy(x, a, BITMAP_CHUNK_BYTES);
+	memcpy(y, b, BITMAP_CHUNK_BYTES);
+	return ((x[0] ^ y[0]) | (x[1] ^ y[1]) |
+		(x[2] ^ y[2]) | (x[3] ^ y[3])) != 0;
+}
+#endif
+
+/*
+ * Return the first bit number in [start, nbits) at which the bitmaps
+ * a and b differ, or nbits if they are the same over that range.
+ */
+unsigned int ext2fs_bitmap_diff(const void *a, const void *b,
+				unsigned int start, unsigned int nbits)
+{
+	const unsigned char *ap = a, *bp = b;
+	unsigned int	byte, end_byte, bit;
+	unsigned char	d;
+
+	if (start >= nbits)
+		return nbits;
+
+	/* The byte holding start, then whole bytes up to a chunk boundary */
+	end_byte = nbits >> 3;
+	byte = start >> 3;
+	d = (ap[byte] ^ bp[byte]) & (0xff << (start & 7));
+	if (d)
+		goto found;
+	for (byte++; byte < end_byte && (byte % BITMAP_CHUNK_BYTES); byte++)
+		if (ap[byte] != bp[byte])
+			goto found_byte;
+
+	for (; byte + BITMAP_CHUNK_BYTES <= end_byte;
+	     byte += BITMAP_CHUNK_BYTES)
+		if (chunk_differs(ap + byte, bp + byte))
+			break;
+
+	for (; byte < end_byte; byte++)
+		if (ap[byte] != bp[byte])
+			goto found_byte;
+
+	/* Bits after the last whole byte */
+	if (byte > end_byte || !(nbits & 7))
+		return nbits;
+	d = (ap[byte] ^ bp[byte]) & ((1 << (nbits & 7)) - 1);
+	if (!d)
+		return nbits;
+	goto found;
+
+found_byte:
+	d = ap[byte] ^ bp[byte];
+found:
+	for (bit = 0; !(d & (1 << bit)); bit++)
+		;
+	bit += byte << 3;
+	return bit < nbits ? bit : nbits;
+}
@@ -701,3 +701,5 @@ extern int ext2fs_set_bit64(__u64 nr,void * addr);
 extern int ext2fs_clear_bit64(__u64 nr, void * addr);
 extern int ext2fs_test_bit64(__u64 nr, const void * addr);
 extern unsigned int ext2fs_bitcount(const void *addr, unsigned int nbytes);
+extern unsigned int ext2fs_bitmap_diff(const void *a, const void *b,
+				       unsigned int start, unsigned int nbits);
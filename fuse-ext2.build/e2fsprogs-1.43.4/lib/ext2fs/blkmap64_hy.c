@@ -0,0 +1,944 @@
+/*
+ * blkmap64_hy.c --- Hybrid chunked implementation for bitmaps
+ *
+ * The bitmap is split into fixed-size chunks, and each chunk is kept
+ * in whichever encoding is cheapest for its contents: nothing at all
+ * for chunks which are entirely clear or entirely set, a short sorted
+ * list of runs for sparse or well-clustered chunks, and a plain bit
+ * array once a chunk becomes too fragmented for the run list to pay
+ * off.  Chunks convert between encodings automatically as bits are
+ * set and cleared, so the memory used is bounded by that of a plain
+ * bit array (plus a small per-chunk header) while mostly-empty and
+ * mostly-full regions of a large file system cost almost nothing.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
+
+#define HY_CHUNK_SHIFT	15
+#define HY_CHUNK_BITS	(1U << HY_CHUNK_SHIFT)
+#define HY_CHUNK_MASK	(HY_CHUNK_BITS - 1)
+#define HY_CHUNK_BYTES	(HY_CHUNK_BITS >> 3)
+
+/* Chunk encodings; a zeroed chunk header is an empty chunk */
+#define HY_EMPTY	0
+#define HY_FULL		1
+#define HY_RUNS		2
+#define HY_BITS		3
+
+/* An inclusive range of set bits, relative to the start of the chunk */
+struct hy_run {
+	__u16	start;
+	__u16	last;
+};
+
+/*
+ * A run list is converted to a bit array once it would grow past half
+ * the size of the bit array, and a bit array is only converted back
+ * once it would fit in a quarter, so that a chunk hovering around the
+ * limit does not flip back and forth on every update.
+ */
+#define HY_MAX_RUNS	(HY_CHUNK_BYTES / sizeof(struct hy_run) / 2)
+#define HY_COMPACT_RUNS	(HY_MAX_RUNS / 2)
+
+/*
+ * Bulk updates covering at least this many bits in a bit array chunk
+ * are followed by an attempt to re-encode it as a run list.
+ */
+#define HY_COMPACT_MIN	256
+
+struct hy_chunk {
+	__u32	count;		/* number of bits set */
+	__u16	nruns;		/* HY_RUNS only */
+	__u16	type;
+	void	*data;		/* struct hy_run[] or bit array */
+};
+
+struct ext2fs_hy_private {
+	struct hy_chunk	*chunks;
+	__u64		nchunks;
+};
+
+static __u64 hy_nbits(ext2fs_generic_bitmap bitmap, __u64 real_end)
+{
+	return real_end - bitmap->start + 1;
+}
+
+static __u64 hy_nchunks(__u64 nbits)
+{
+	return (nbits + HY_CHUNK_MASK) >> HY_CHUNK_SHIFT;
+}
+
+/* Number of bits covered by chunk c; only the last one can be short */
+static unsigned int hy_chunk_len(__u64 nbits, __u64 c)
+{
+	__u64 left = nbits - (c << HY_CHUNK_SHIFT);
+
+	return left < HY_CHUNK_BITS ? (unsigned int) left : HY_CHUNK_BITS;
+}
+
+/*
+ * Helpers for plain little-endian bit arrays at arbitrary bit offsets
+ */
+static void hy_fill_bits(unsigned char *bits, unsigned int off,
+			 unsigned int n, int set)
+{
+	unsigned int nbytes;
+
+	for (; n && (off & 7); off++, n--) {
+		if (set)
+			bits[off >> 3] |= 1 << (off & 7);
+		else
+			bits[off >> 3] &= ~(1 << (off & 7));
+	}
+	nbytes = n >> 3;
+	if (nbytes) {
+		memset(bits + (off >> 3), set ? 0xff : 0, nbytes);
+		off += nbytes << 3;
+		n -= nbytes << 3;
+	}
+	for (; n; off++, n--) {
+		if (set)
+			bits[off >> 3] |= 1 << (off & 7);
+		else
+			bits[off >> 3] &= ~(1 << (off & 7));
+	}
+}
+
+static unsigned int hy_count_bits(const unsigned char *bits, unsigned int off,
+				  unsigned int n)
+{
+	unsigned int count = 0, nbytes;
+
+	for (; n && (off & 7); off++, n--)
+		count += (bits[off >> 3] >> (off & 7)) & 1;
+	nbytes = n >> 3;
+	if (nbytes) {
+		count += ext2fs_bitcount(bits + (off >> 3), nbytes);
+		off += nbytes << 3;
+		n -= nbytes << 3;
+	}
+	for (; n; off++, n--)
+		count += (bits[off >> 3] >> (off & 7)) & 1;
+	return count;
+}
+
+/* Return the first bit in [off, off + n) equal to set, or off + n */
+static unsigned int hy_scan_bits(const unsigned char *bits, unsigned int off,
+				 unsigned int n, int set)
+{
+	unsigned int end = off + n;
+	unsigned char skip = set ? 0 : 0xff;
+
+	while (off < end) {
+		if (!(off & 7) && end - off >= 8 && bits[off >> 3] == skip) {
+			off += 8;
+			continue;
+		}
+		if (!((bits[off >> 3] >> (off & 7)) & 1) == !set)
+			return off;
+		off++;
+	}
+	return end;
+}
+
+static void hy_copy_bits(unsigned char *dst, unsigned int doff,
+			 const unsigned char *src, unsigned int soff,
+			 unsigned int n)
+{
+	unsigned int nbytes;
+
+	if (!(doff & 7) && !(soff & 7)) {
+		nbytes = n >> 3;
+		memcpy(dst + (doff >> 3), src + (soff >> 3), nbytes);
+		doff += nbytes << 3;
+		soff += nbytes << 3;
+		n -= nbytes << 3;
+	}
+	for (; n; doff++, soff++, n--) {
+		if ((src[soff >> 3] >> (soff & 7)) & 1)
+			dst[doff >> 3] |= 1 << (doff & 7);
+		else
+			dst[doff >> 3] &= ~(1 << (doff & 7));
+	}
+}
+
+/*
+ * Run list helpers
+ */
+static unsigned int hy_runs_cap(unsigned int nruns)
+{
+	unsigned int cap = 4;
+
+	while (cap < nruns)
+		cap <<= 1;
+	return cap;
+}
+
+/* Index of the first run with last + slop >= off */
+static unsigned int hy_runs_find(const struct hy_chunk *ch, unsigned int off,
+				 unsigned int slop)
+{
+	const struct hy_run *runs = ch->data;
+	unsigned int low = 0, high = ch->nruns, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if ((unsigned int) runs[mid].last + slop >= off)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return low;
+}
+
+/*
+ * Replace runs [i, j) with the npieces runs in pieces.  Returns
+ * non-zero, leaving the chunk untouched, if the result would have too
+ * many runs; the caller is then expected to switch to a bit array.
+ */
+static int hy_runs_replace(struct hy_chunk *ch, unsigned int i,
+			   unsigned int j, const struct hy_run *pieces,
+			   unsigned int npieces)
+{
+	unsigned int	nruns = ch->nruns - (j - i) + npieces;
+	unsigned int	old_cap = hy_runs_cap(ch->nruns);
+	unsigned int	new_cap = hy_runs_cap(nruns);
+	struct hy_run	*runs;
+
+	if (nruns > HY_MAX_RUNS)
+		return 1;
+
+	if (!ch->data) {
+		if (ext2fs_get_array(new_cap, sizeof(struct hy_run),
+				     &ch->data))
+			abort();
+	} else if (new_cap > old_cap) {
+		if (ext2fs_resize_mem(old_cap * sizeof(struct hy_run),
+				      new_cap * sizeof(struct hy_run),
+				      &ch->data))
+			abort();
+	}
+	runs = ch->data;
+	memmove(runs + i + npieces, runs + j,
+		(ch->nruns - j) * sizeof(struct hy_run));
+	memcpy(runs + i, pieces, npieces * sizeof(struct hy_run));
+	ch->nruns = nruns;
+	if (new_cap < old_cap &&
+	    ext2fs_resize_mem(old_cap * sizeof(struct hy_run),
+			      new_cap * sizeof(struct hy_run), &ch->data))
+		abort();
+	return 0;
+}
+
+/*
+ * Chunk encoding conversions
+ */
+static void hy_chunk_release(struct hy_chunk *ch)
+{
+	if (ch->data)
+		ext2fs_free_mem(&ch->data);
+	ch->nruns = 0;
+}
+
+static void hy_chunk_to_bits(struct hy_chunk *ch, unsigned int clen)
+{
+	struct hy_run	*runs;
+	unsigned char	*bits;
+	unsigned int	i;
+
+	if (ch->type == HY_BITS)
+		return;
+
+	if (ext2fs_get_memzero(HY_CHUNK_BYTES, &bits))
+		abort();
+	if (ch->type == HY_FULL)
+		hy_fill_bits(bits, 0, clen, 1);
+	else if (ch->type == HY_RUNS) {
+		runs = ch->data;
+		for (i = 0; i < ch->nruns; i++)
+			hy_fill_bits(bits, runs[i].start,
+				     runs[i].last - runs[i].start + 1, 1);
+	}
+	hy_chunk_release(ch);
+	ch->data = bits;
+	ch->type = HY_BITS;
+}
+
+/* Drop the payload of chunks which have become entirely clear or set */
+static void hy_chunk_normalize(struct hy_chunk *ch, unsigned int clen)
+{
+	if (ch->type != HY_RUNS && ch->type != HY_BITS)
+		return;
+	if (ch->count == 0) {
+		hy_chunk_release(ch);
+		ch->type = HY_EMPTY;
+	} else if (ch->count == clen) {
+		hy_chunk_release(ch);
+		ch->type = HY_FULL;
+	}
+}
+
+/* Re-encode a bit array chunk as a run list if it has become cheap enough */
+static void hy_chunk_compact(struct hy_chunk *ch, unsigned int clen)
+{
+	unsigned char	*bits;
+	struct hy_run	*runs;
+	unsigned int	off, last, nruns = 0;
+
+	hy_chunk_normalize(ch, clen);
+	if (ch->type != HY_BITS)
+		return;
+
+	bits = ch->data;
+	off = hy_scan_bits(bits, 0, clen, 1);
+	while (off < clen) {
+		if (++nruns > HY_COMPACT_RUNS)
+			return;
+		off = hy_scan_bits(bits, off, clen - off, 0);
+		if (off < clen)
+			off = hy_scan_bits(bits, off, clen - off, 1);
+	}
+
+	if (ext2fs_get_array(hy_runs_cap(nruns), sizeof(struct hy_run), &runs))
+		abort();
+	nruns = 0;
+	off = hy_scan_bits(bits, 0, clen, 1);
+	while (off < clen) {
+		last = hy_scan_bits(bits, off, clen - off, 0);
+		runs[nruns].start = off;
+		runs[nruns].last = last - 1;
+		nruns++;
+		off = last < clen ? hy_scan_bits(bits, last, clen - last, 1) :
+			clen;
+	}
+	ext2fs_free_mem(&ch->data);
+	ch->data = runs;
+	ch->nruns = nruns;
+	ch->type = HY_RUNS;
+}
+
+/*
+ * Per-chunk bit operations; off and n are relative to the chunk and
+ * never cross its end.
+ */
+static int hy_chunk_test(const struct hy_chunk *ch, unsigned int off)
+{
+	const struct hy_run *runs;
+	unsigned int i;
+
+	switch (ch->type) {
+	case HY_FULL:
+		return 1;
+	case HY_RUNS:
+		runs = ch->data;
+		i = hy_runs_find(ch, off, 0);
+		return i < ch->nruns && runs[i].start <= off;
+	case HY_BITS:
+		return (((unsigned char *) ch->data)[off >> 3] >> (off & 7)) & 1;
+	}
+	return 0;
+}
+
+static unsigned int hy_overlap(const struct hy_run *run, unsigned int off,
+			       unsigned int last)
+{
+	unsigned int s = run->start > off ? run->start : off;
+	unsigned int e = run->last < last ? run->last : last;
+
+	return e >= s ? e - s + 1 : 0;
+}
+
+static void hy_chunk_set(struct hy_chunk *ch, unsigned int clen,
+			 unsigned int off, unsigned int n)
+{
+	unsigned int	last = off + n - 1, covered = 0, i, j;
+	struct hy_run	*runs, piece;
+
+	switch (ch->type) {
+	case HY_FULL:
+		return;
+	case HY_EMPTY:
+		if (n == clen) {
+			ch->type = HY_FULL;
+			ch->count = clen;
+			return;
+		}
+		piece.start = off;
+		piece.last = last;
+		ch->type = HY_RUNS;
+		hy_runs_replace(ch, 0, 0, &piece, 1);
+		ch->count = n;
+		return;
+	case HY_RUNS:
+		/* Merge with every run overlapping or adjacent to the range */
+		runs = ch->data;
+		piece.start = off;
+		piece.last = last;
+		i = hy_runs_find(ch, off, 1);
+		for (j = i; j < ch->nruns && runs[j].start <= last + 1; j++) {
+			covered += hy_overlap(&runs[j], off, last);
+			if (runs[j].start < piece.start)
+				piece.start = runs[j].start;
+			if (runs[j].last > piece.last)
+				piece.last = runs[j].last;
+		}
+		if (hy_runs_replace(ch, i, j, &piece, 1) == 0) {
+			ch->count += n - covered;
+			break;
+		}
+		hy_chunk_to_bits(ch, clen);
+		/* fall through */
+	case HY_BITS:
+		ch->count += n - hy_count_bits(ch->data, off, n);
+		hy_fill_bits(ch->data, off, n, 1);
+		break;
+	}
+	hy_chunk_normalize(ch, clen);
+}
+
+static void hy_chunk_clear(struct hy_chunk *ch, unsigned int clen,
+			   unsigned int off, unsigned int n)
+{
+	unsigned int	last = off + n - 1, removed = 0, npieces = 0, i, j;
+	struct hy_run	*runs, pieces[2];
+
+	switch (ch->type) {
+	case HY_EMPTY:
+		return;
+	case HY_FULL:
+		if (n == clen) {
+			ch->type = HY_EMPTY;
+			ch->count = 0;
+			return;
+		}
+		if (off) {
+			pieces[npieces].start = 0;
+			pieces[npieces++].last = off - 1;
+		}
+		if (last < clen - 1) {
+			pieces[npieces].start = last + 1;
+			pieces[npieces++].last = clen - 1;
+		}
+		ch->type = HY_RUNS;
+		hy_runs_replace(ch, 0, 0, pieces, npieces);
+		ch->count = clen - n;
+		return;
+	case HY_RUNS:
+		/* Trim the runs at either end and drop everything between */
+		runs = ch->data;
+		i = hy_runs_find(ch, off, 0);
+		for (j = i; j < ch->nruns && runs[j].start <= last; j++)
+			removed += hy_overlap(&runs[j], off, last);
+		if (j == i)
+			return;
+		if (runs[i].start < off) {
+			pieces[npieces].start = runs[i].start;
+			pieces[npieces++].last = off - 1;
+		}
+		if (runs[j - 1].last > last) {
+			pieces[npieces].start = last + 1;
+			pieces[npieces++].last = runs[j - 1].last;
+		}
+		if (hy_runs_replace(ch, i, j, pieces, npieces) == 0) {
+			ch->count -= removed;
+			break;
+		}
+		hy_chunk_to_bits(ch, clen);
+		/* fall through */
+	case HY_BITS:
+		ch->count -= hy_count_bits(ch->data, off, n);
+		hy_fill_bits(ch->data, off, n, 0);
+		break;
+	}
+	hy_chunk_normalize(ch, clen);
+}
+
+/* Set or clear num bits starting at pos, relative to bitmap->start */
+static void hy_update(ext2fs_generic_bitmap bitmap, __u64 pos, __u64 num,
+		      int set)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64		nbits = hy_nbits(bitmap, bitmap->real_end);
+	struct hy_chunk	*ch;
+	unsigned int	off, n, clen;
+
+	while (num) {
+		ch = &bp->chunks[pos >> HY_CHUNK_SHIFT];
+		clen = hy_chunk_len(nbits, pos >> HY_CHUNK_SHIFT);
+		off = pos & HY_CHUNK_MASK;
+		n = clen - off;
+		if (n > num)
+			n = num;
+		if (set)
+			hy_chunk_set(ch, clen, off, n);
+		else
+			hy_chunk_clear(ch, clen, off, n);
+		if (ch->type == HY_BITS && n >= HY_COMPACT_MIN)
+			hy_chunk_compact(ch, clen);
+		pos += n;
+		num -= n;
+	}
+}
+
+static errcode_t hy_alloc_private_data(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_hy_private *bp;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_hy_private), &bp);
+	if (retval)
+		return retval;
+
+	bp->nchunks = hy_nchunks(hy_nbits(bitmap, bitmap->real_end));
+	retval = ext2fs_get_arrayzero(bp->nchunks, sizeof(struct hy_chunk),
+				      &bp->chunks);
+	if (retval) {
+		ext2fs_free_mem(&bp);
+		return retval;
+	}
+	bitmap->private = (void *) bp;
+	return 0;
+}
+
+static errcode_t hy_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     ext2fs_generic_bitmap bitmap)
+{
+	return hy_alloc_private_data(bitmap);
+}
+
+static void hy_free_chunks(struct ext2fs_hy_private *bp, __u64 from)
+{
+	__u64 c;
+
+	for (c = from; c < bp->nchunks; c++)
+		hy_chunk_release(&bp->chunks[c]);
+}
+
+static void hy_free_bmap(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+
+	if (!bp)
+		return;
+
+	hy_free_chunks(bp, 0);
+	ext2fs_free_mem(&bp->chunks);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t hy_copy_bmap(ext2fs_generic_bitmap src,
+			      ext2fs_generic_bitmap dest)
+{
+	struct ext2fs_hy_private *src_bp = src->private;
+	struct ext2fs_hy_private *dest_bp;
+	struct hy_chunk	*from, *to;
+	errcode_t	retval;
+	size_t		size;
+	__u64		c;
+
+	retval = hy_alloc_private_data(dest);
+	if (retval)
+		return retval;
+	dest_bp = dest->private;
+
+	for (c = 0; c < src_bp->nchunks; c++) {
+		from = &src_bp->chunks[c];
+		to = &dest_bp->chunks[c];
+		*to = *from;
+		to->data = NULL;
+		if (from->type == HY_RUNS)
+			size = hy_runs_cap(from->nruns) *
+				sizeof(struct hy_run);
+		else if (from->type == HY_BITS)
+			size = HY_CHUNK_BYTES;
+		else
+			continue;
+		retval = ext2fs_get_mem(size, &to->data);
+		if (retval) {
+			to->type = HY_EMPTY;
+			hy_free_bmap(dest);
+			return retval;
+		}
+		memcpy(to->data, from->data, size);
+	}
+	return 0;
+}
+
+static errcode_t hy_resize_bmap(ext2fs_generic_bitmap bmap,
+				__u64 new_end, __u64 new_real_end)
+{
+	struct ext2fs_hy_private *bp = bmap->private;
+	__u64		nbits, new_nbits, new_nchunks, bitno, c;
+	unsigned int	clen, new_clen;
+	struct hy_chunk	*ch;
+	struct hy_run	piece;
+	errcode_t	retval;
+
+	/*
+	 * If we're expanding the bitmap, make sure all of the new
+	 * parts of the bitmap are zero.
+	 */
+	if (new_end > bmap->end) {
+		bitno = bmap->real_end;
+		if (bitno > new_end)
+			bitno = new_end;
+		if (bitno > bmap->end)
+			hy_update(bmap, bmap->end + 1 - bmap->start,
+				  bitno - bmap->end, 0);
+	}
+	if (new_real_end == bmap->real_end) {
+		bmap->end = new_end;
+		return 0;
+	}
+
+	nbits = hy_nbits(bmap, bmap->real_end);
+	new_nbits = hy_nbits(bmap, new_real_end);
+	new_nchunks = hy_nchunks(new_nbits);
+
+	/* Fix up the chunk which becomes or stops being the last one */
+	if (new_nbits < nbits) {
+		c = (new_nbits - 1) >> HY_CHUNK_SHIFT;
+		ch = &bp->chunks[c];
+		clen = hy_chunk_len(nbits, c);
+		new_clen = hy_chunk_len(new_nbits, c);
+		if (new_clen < clen)
+			hy_chunk_clear(ch, clen, new_clen, clen - new_clen);
+		hy_chunk_normalize(ch, new_clen);
+		hy_free_chunks(bp, new_nchunks);
+	} else {
+		c = (nbits - 1) >> HY_CHUNK_SHIFT;
+		ch = &bp->chunks[c];
+		clen = hy_chunk_len(nbits, c);
+		if (ch->type == HY_FULL && hy_chunk_len(new_nbits, c) > clen) {
+			piece.start = 0;
+			piece.last = clen - 1;
+			ch->type = HY_RUNS;
+			hy_runs_replace(ch, 0, 0, &piece, 1);
+		}
+	}
+
+	if (new_nchunks != bp->nchunks) {
+		retval = ext2fs_resize_mem(bp->nchunks *
+					   sizeof(struct hy_chunk),
+					   new_nchunks *
+					   sizeof(struct hy_chunk),
+					   &bp->chunks);
+		if (retval)
+			return retval;
+		if (new_nchunks > bp->nchunks)
+			memset(bp->chunks + bp->nchunks, 0,
+			       (new_nchunks - bp->nchunks) *
+			       sizeof(struct hy_chunk));
+		bp->nchunks = new_nchunks;
+	}
+
+	bmap->end = new_end;
+	bmap->real_end = new_real_end;
+	return 0;
+}
+
+static int hy_mark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64		pos = arg - bitmap->start;
+	struct hy_chunk	*ch = &bp->chunks[pos >> HY_CHUNK_SHIFT];
+
+	if (hy_chunk_test(ch, pos & HY_CHUNK_MASK))
+		return 1;
+	hy_chunk_set(ch, hy_chunk_len(hy_nbits(bitmap, bitmap->real_end),
+				      pos >> HY_CHUNK_SHIFT),
+		     pos & HY_CHUNK_MASK, 1);
+	return 0;
+}
+
+static int hy_unmark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64		pos = arg - bitmap->start;
+	struct hy_chunk	*ch = &bp->chunks[pos >> HY_CHUNK_SHIFT];
+
+	if (!hy_chunk_test(ch, pos & HY_CHUNK_MASK))
+		return 0;
+	hy_chunk_clear(ch, hy_chunk_len(hy_nbits(bitmap, bitmap->real_end),
+					pos >> HY_CHUNK_SHIFT),
+		       pos & HY_CHUNK_MASK, 1);
+	return 1;
+}
+
+static int hy_test_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64 pos = arg - bitmap->start;
+
+	return hy_chunk_test(&bp->chunks[pos >> HY_CHUNK_SHIFT],
+			     pos & HY_CHUNK_MASK);
+}
+
+static void hy_mark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				unsigned int num)
+{
+	hy_update(bitmap, arg - bitmap->start, num, 1);
+}
+
+static void hy_unmark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				  unsigned int num)
+{
+	hy_update(bitmap, arg - bitmap->start, num, 0);
+}
+
+static errcode_t hy_set_bmap_range(ext2fs_generic_bitmap bitmap,
+				   __u64 start, size_t num, void *in)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64		nbits = hy_nbits(bitmap, bitmap->real_end);
+	__u64		pos = start - bitmap->start;
+	size_t		done = 0;
+	struct hy_chunk	*ch;
+	unsigned int	off, n, clen, count;
+
+	while (done < num) {
+		ch = &bp->chunks[pos >> HY_CHUNK_SHIFT];
+		clen = hy_chunk_len(nbits, pos >> HY_CHUNK_SHIFT);
+		off = pos & HY_CHUNK_MASK;
+		n = clen - off;
+		if (n > num - done)
+			n = num - done;
+
+		if (n == clen) {
+			/* The whole chunk is replaced */
+			count = hy_count_bits(in, done, n);
+			hy_chunk_release(ch);
+			ch->type = HY_EMPTY;
+			ch->count = count;
+			if (count == clen)
+				ch->type = HY_FULL;
+			else if (count) {
+				hy_chunk_to_bits(ch, clen);
+				hy_copy_bits(ch->data, 0, in, done, n);
+			}
+		} else {
+			hy_chunk_to_bits(ch, clen);
+			ch->count -= hy_count_bits(ch->data, off, n);
+			hy_copy_bits(ch->data, off, in, done, n);
+			ch->count += hy_count_bits(ch->data, off, n);
+		}
+		hy_chunk_compact(ch, clen);
+		pos += n;
+		done += n;
+	}
+	return 0;
+}
+
+static errcode_t hy_get_bmap_range(ext2fs_generic_bitmap bitmap,
+				   __u64 start, size_t num, void *out)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64		nbits = hy_nbits(bitmap, bitmap->real_end);
+	__u64		pos = start - bitmap->start;
+	size_t		done = 0;
+	struct hy_chunk	*ch;
+	struct hy_run	*runs;
+	unsigned int	off, last, n, clen, i, s, e;
+
+	memset(out, 0, (num + 7) >> 3);
+	while (done < num) {
+		ch = &bp->chunks[pos >> HY_CHUNK_SHIFT];
+		clen = hy_chunk_len(nbits, pos >> HY_CHUNK_SHIFT);
+		off = pos & HY_CHUNK_MASK;
+		n = clen - off;
+		if (n > num - done)
+			n = num - done;
+		last = off + n - 1;
+
+		switch (ch->type) {
+		case HY_FULL:
+			hy_fill_bits(out, done, n, 1);
+			break;
+		case HY_RUNS:
+			runs = ch->data;
+			for (i = hy_runs_find(ch, off, 0);
+			     i < ch->nruns && runs[i].start <= last; i++) {
+				s = runs[i].start > off ? runs[i].start : off;
+				e = runs[i].last < last ? runs[i].last : last;
+				hy_fill_bits(out, done + s - off, e - s + 1, 1);
+			}
+			break;
+		case HY_BITS:
+			hy_copy_bits(out, done, ch->data, off, n);
+			break;
+		}
+		pos += n;
+		done += n;
+	}
+	return 0;
+}
+
+static void hy_clear_bmap(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+
+	hy_free_chunks(bp, 0);
+	memset(bp->chunks, 0, bp->nchunks * sizeof(struct hy_chunk));
+}
+
+/*
+ * Find the first bit equal to set between start and end, inclusive.
+ * Chunks which are entirely clear or entirely set are skipped without
+ * looking at their contents.
+ */
+static errcode_t hy_find_first(ext2fs_generic_bitmap bitmap, int set,
+			       __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64		pos = start - bitmap->start;
+	__u64		lastpos = end - bitmap->start;
+	struct hy_chunk	*ch;
+	struct hy_run	*runs;
+	unsigned int	off, n, i, found;
+
+	while (pos <= lastpos) {
+		ch = &bp->chunks[pos >> HY_CHUNK_SHIFT];
+		off = pos & HY_CHUNK_MASK;
+		n = HY_CHUNK_BITS - off;
+		if (n > lastpos - pos + 1)
+			n = lastpos - pos + 1;
+		found = off + n;
+
+		switch (ch->type) {
+		case HY_EMPTY:
+			if (!set)
+				found = off;
+			break;
+		case HY_FULL:
+			if (set)
+				found = off;
+			break;
+		case HY_RUNS:
+			runs = ch->data;
+			i = hy_runs_find(ch, off, 0);
+			if (set) {
+				if (i < ch->nruns)
+					found = runs[i].start > off ?
+						runs[i].start : off;
+			} else if (i < ch->nruns && runs[i].start <= off)
+				found = runs[i].last + 1;
+			else
+				found = off;
+			break;
+		case HY_BITS:
+			found = hy_scan_bits(ch->data, off, n, set);
+			break;
+		}
+		if (found < off + n) {
+			*out = bitmap->start + pos - off + found;
+			return 0;
+		}
+		pos += n;
+	}
+	return ENOENT;
+}
+
+static errcode_t hy_find_first_zero(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	return hy_find_first(bitmap, 0, start, end, out);
+}
+
+static errcode_t hy_find_first_set(ext2fs_generic_bitmap bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	return hy_find_first(bitmap, 1, start, end, out);
+}
+
+static int hy_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
+				     __u64 start, unsigned int len)
+{
+	__u64 out;
+
+	return hy_find_first(bitmap, 1, start, start + len - 1, &out) ==
+		ENOENT;
+}
+
+#ifdef ENABLE_BMAP_STATS
+static void hy_print_stats(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_hy_private *bp = bitmap->private;
+	__u64	nchunks[4] = { 0, 0, 0, 0 };
+	__u64	nruns = 0, bits = 0, size;
+	__u64	c;
+
+	size = sizeof(struct ext2fs_hy_private) +
+		bp->nchunks * sizeof(struct hy_chunk);
+	for (c = 0; c < bp->nchunks; c++) {
+		struct hy_chunk *ch = &bp->chunks[c];
+
+		nchunks[ch->type]++;
+		bits += ch->count;
+		if (ch->type == HY_RUNS) {
+			nruns += ch->nruns;
+			size += hy_runs_cap(ch->nruns) * sizeof(struct hy_run);
+		} else if (ch->type == HY_BITS)
+			size += HY_CHUNK_BYTES;
+	}
+
+	fprintf(stderr, "%16llu empty chunks\n"
+		"%16llu full chunks\n"
+		"%16llu run list chunks (%llu runs)\n"
+		"%16llu bit array chunks\n",
+		nchunks[HY_EMPTY], nchunks[HY_FULL], nchunks[HY_RUNS], nruns,
+		nchunks[HY_BITS]);
+	fprintf(stderr, "%16llu bits set in bitmap (out of %llu)\n", bits,
+		bitmap->real_end - bitmap->start + 1);
+	fprintf(stderr, "%16llu bytes used\n", size);
+	fprintf(stderr,
+		"%16.4lf memory / bitmap bit memory ratio (bitarray = 1)\n",
+		(double) (size << 3) / (bitmap->real_end - bitmap->start + 1));
+}
+#else
+static void hy_print_stats(ext2fs_generic_bitmap bitmap EXT2FS_ATTR((unused)))
+{
+}
+#endif
+
+struct ext2_bitmap_ops ext2fs_blkmap64_hybrid = {
+	.type = EXT2FS_BMAP64_HYBRID,
+	.new_bmap = hy_new_bmap,
+	.free_bmap = hy_free_bmap,
+	.copy_bmap = hy_copy_bmap,
+	.resize_bmap = hy_resize_bmap,
+	.mark_bmap = hy_mark_bmap,
+	.unmark_bmap = hy_unmark_bmap,
+	.test_bmap = hy_test_bmap,
+	.test_clear_bmap_extent = hy_test_clear_bmap_extent,
+	.mark_bmap_extent = hy_mark_bmap_extent,
+	.unmark_bmap_extent = hy_unmark_bmap_extent,
+	.set_bmap_range = hy_set_bmap_range,
+	.get_bmap_range = hy_get_bmap_range,
+	.clear_bmap = hy_clear_bmap,
+	.print_stats = hy_print_stats,
+	.find_first_zero = hy_find_first_zero,
+	.find_first_set = hy_find_first_set,
+};
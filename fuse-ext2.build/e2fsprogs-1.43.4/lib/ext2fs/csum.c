@@ -292,21 +292,43 @@ int ext2fs_dirent_has_tail(ext2_filsys fs, struct ext2_dir_entry *dirent)
 	return __get_dirent_tail(fs, dirent, NULL, 0) == 0;
 }
 
+/*
+ * The directory block checksums are seeded with the directory's
+ * i_generation.  If the caller already knows it, igen points at it;
+ * otherwise it is read from the inode.
+ */
+static errcode_t dir_inode_generation(ext2_filsys fs, ext2_ino_t inum,
+				      const __u32 *igen, __u32 *gen)
+{
+	errcode_t retval;
+	struct ext2_inode inode;
+
+	if (igen) {
+		*gen = *igen;
+		return 0;
+	}
+	retval = ext2fs_read_inode(fs, inum, &inode);
+	if (retval)
+		return retval;
+	*gen = inode.i_generation;
+	return 0;
+}
+
 static errcode_t ext2fs_dirent_csum(ext2_filsys fs, ext2_ino_t inum,
+				    const __u32 *igen,
 				    struct ext2_dir_entry *dirent, __u32 *crc,
 				    int size)
 {
 	errcode_t retval;
 	char *buf = (char *)dirent;
 	__u32 gen;
-	struct ext2_inode inode;
 
-	retval = ext2fs_read_inode(fs, inum, &inode);
+	retval = dir_inode_generation(fs, inum, igen, &gen);
 	if (retval)
 		return retval;
 
 	inum = ext2fs_cpu_to_le32(inum);
-	gen = ext2fs_cpu_to_le32(inode.i_generation);
+	gen = ext2fs_cpu_to_le32(gen);
 	*crc = ext2fs_crc32c_le(fs->csum_seed, (unsigned char *)&inum,
 				sizeof(inum));
 	*crc = ext2fs_crc32c_le(*crc, (unsigned char *)&gen, sizeof(gen));
@@ -315,8 +337,9 @@ static errcode_t ext2fs_dirent_csum(ext2_filsys fs, ext2_ino_t inum,
 	return 0;
 }
 
-int ext2fs_dirent_csum_verify(ext2_filsys fs, ext2_ino_t inum,
-			      struct ext2_dir_entry *dirent)
+static int __dirent_csum_verify(ext2_filsys fs, ext2_ino_t inum,
+				const __u32 *igen,
+				struct ext2_dir_entry *dirent)
 {
 	errcode_t retval;
 	__u32 calculated;
@@ -330,13 +353,19 @@ int ext2fs_dirent_csum_verify(ext2_filsys fs, ext2_ino_t inum,
 	 * The checksum field is overlaid with the dirent->name field
 	 * so the swapfs.c functions won't change the endianness.
 	 */
-	retval = ext2fs_dirent_csum(fs, inum, dirent, &calculated,
+	retval = ext2fs_dirent_csum(fs, inum, igen, dirent, &calculated,
 				    (char *)t - (char *)dirent);
 	if (retval)
 		return 0;
 	return ext2fs_le32_to_cpu(t->det_checksum) == calculated;
 }
 
+int ext2fs_dirent_csum_verify(ext2_filsys fs, ext2_ino_t inum,
+			      struct ext2_dir_entry *dirent)
+{
+	return __dirent_csum_verify(fs, inum, NULL, dirent);
+}
+
 static errcode_t ext2fs_dirent_csum_set(ext2_filsys fs, ext2_ino_t inum,
 					struct ext2_dir_entry *dirent)
 {
@@ -349,7 +378,7 @@ static errcode_t ext2fs_dirent_csum_set(ext2_filsys fs, ext2_ino_t inum,
 		return retval;
 
 	/* swapfs.c functions don't change the checksum endianness */
-	retval = ext2fs_dirent_csum(fs, inum, dirent, &crc,
+	retval = ext2fs_dirent_csum(fs, inum, NULL, dirent, &crc,
 				    (char *)t - (char *)dirent);
 	if (retval)
 		return retval;
@@ -358,6 +387,7 @@ static errcode_t ext2fs_dirent_csum_set(ext2_filsys fs, ext2_ino_t inum,
 }
 
 static errcode_t ext2fs_dx_csum(ext2_filsys fs, ext2_ino_t inum,
+				const __u32 *igen,
 				struct ext2_dir_entry *dirent,
 				__u32 *crc, int count_offset, int count,
 				struct ext2_dx_tail *t)
@@ -366,18 +396,17 @@ static errcode_t ext2fs_dx_csum(ext2_filsys fs, ext2_ino_t inum,
 	char *buf = (char *)dirent;
 	int size;
 	__u32 old_csum, gen;
-	struct ext2_inode inode;
 
 	size = count_offset + (count * sizeof(struct ext2_dx_entry));
 	old_csum = t->dt_checksum;
 	t->dt_checksum = 0;
 
-	retval = ext2fs_read_inode(fs, inum, &inode);
+	retval = dir_inode_generation(fs, inum, igen, &gen);
 	if (retval)
 		return retval;
 
 	inum = ext2fs_cpu_to_le32(inum);
-	gen = ext2fs_cpu_to_le32(inode.i_generation);
+	gen = ext2fs_cpu_to_le32(gen);
 	*crc = ext2fs_crc32c_le(fs->csum_seed, (unsigned char *)&inum,
 				sizeof(inum));
 	*crc = ext2fs_crc32c_le(*crc, (unsigned char *)&gen, sizeof(gen));
@@ -390,6 +419,7 @@ static errcode_t ext2fs_dx_csum(ext2_filsys fs, ext2_ino_t inum,
 }
 
 static int ext2fs_dx_csum_verify(ext2_filsys fs, ext2_ino_t inum,
+				 const __u32 *igen,
 				 struct ext2_dir_entry *dirent)
 {
 	__u32 calculated;
@@ -408,8 +438,8 @@ static int ext2fs_dx_csum_verify(ext2_filsys fs, ext2_ino_t inum,
 		return 0;
 	/* htree structs are accessed in LE order */
 	t = (struct ext2_dx_tail *)(((struct ext2_dx_entry *)c) + limit);
-	retval = ext2fs_dx_csum(fs, inum, dirent, &calculated, count_offset,
-				count, t);
+	retval = ext2fs_dx_csum(fs, inum, igen, dirent, &calculated,
+				count_offset, count, t);
 	if (retval)
 		return 0;
 
@@ -436,27 +466,47 @@ static errcode_t ext2fs_dx_csum_set(ext2_filsys fs, ext2_ino_t inum,
 	t = (struct ext2_dx_tail *)(((struct ext2_dx_entry *)c) + limit);
 
 	/* htree structs are accessed in LE order */
-	retval = ext2fs_dx_csum(fs, inum, dirent, &crc, count_offset, count, t);
+	retval = ext2fs_dx_csum(fs, inum, NULL, dirent, &crc, count_offset,
+				count, t);
 	if (retval)
 		return retval;
 	t->dt_checksum = ext2fs_cpu_to_le32(crc);
 	return retval;
 }
 
-int ext2fs_dir_block_csum_verify(ext2_filsys fs, ext2_ino_t inum,
-				 struct ext2_dir_entry *dirent)
+static int __dir_block_csum_verify(ext2_filsys fs, ext2_ino_t inum,
+				   const __u32 *igen,
+				   struct ext2_dir_entry *dirent)
 {
 	if (!ext2fs_has_feature_metadata_csum(fs->super))
 		return 1;
 
 	if (__get_dirent_tail(fs, dirent, NULL, 1) == 0)
-		return ext2fs_dirent_csum_verify(fs, inum, dirent);
+		return __dirent_csum_verify(fs, inum, igen, dirent);
 	if (__get_dx_countlimit(fs, dirent, NULL, NULL, 1) == 0)
-		return ext2fs_dx_csum_verify(fs, inum, dirent);
+		return ext2fs_dx_csum_verify(fs, inum, igen, dirent);
 
 	return 0;
 }
 
+int ext2fs_dir_block_csum_verify(ext2_filsys fs, ext2_ino_t inum,
+				 struct ext2_dir_entry *dirent)
+{
+	return __dir_block_csum_verify(fs, inum, NULL, dirent);
+}
+
+/*
+ * Like ext2fs_dir_block_csum_verify(), but with the directory's
+ * i_generation supplied by the caller, so that the inode (and the
+ * inode cache) is never touched.
+ */
+int ext2fs_dir_block_csum_verify2(ext2_filsys fs, ext2_ino_t inum,
+				  __u32 generation,
+				  struct ext2_dir_entry *dirent)
+{
+	return __dir_block_csum_verify(fs, inum, &generation, dirent);
+}
+
 errcode_t ext2fs_dir_block_csum_set(ext2_filsys fs, ext2_ino_t inum,
 				    struct ext2_dir_entry *dirent)
 {
@@ -195,6 +195,7 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_DIRECT_IO		0x80000
 #define EXT2_FLAG_SKIP_MMP		0x100000
 #define EXT2_FLAG_IGNORE_CSUM_ERRORS	0x200000
+#define EXT2_FLAG_THREADS		0x400000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -306,6 +307,7 @@ struct struct_ext2_filsys {
 #define EXT2FS_BMAP64_BITARRAY	1
 #define EXT2FS_BMAP64_RBTREE	2
 #define EXT2FS_BMAP64_AUTODIR	3
+#define EXT2FS_BMAP64_HYBRID	4
 
 /*
  * Return flags for the block iterator functions
@@ -473,6 +475,7 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
 #define EXT2_SF_SKIP_MISSING_ITABLE	0x0008
 #define EXT2_SF_DO_LAZY		0x0010
 #define EXT2_SF_WARN_GARBAGE_INODES	0x0020
+#define EXT2_SF_VERIFY_CSUMS	0x0040
 
 /*
  * ext2fs_check_if_mounted flags
@@ -532,9 +535,15 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
  * ext2_icount_t abstraction
  */
 #define EXT2_ICOUNT_OPT_INCREMENT	0x01
+#define EXT2_ICOUNT_OPT_PAGED		0x02
 
 typedef struct ext2_icount *ext2_icount_t;
 
+/*
+ * ext2_scratch_t abstraction
+ */
+typedef struct ext2_scratch *ext2_scratch_t;
+
 /*
  * Flags for ext2fs_bmap
  */
@@ -1021,6 +1030,9 @@ extern int ext2fs_dirent_csum_verify(ext2_filsys fs, ext2_ino_t inum,
 				     struct ext2_dir_entry *dirent);
 extern int ext2fs_dir_block_csum_verify(ext2_filsys fs, ext2_ino_t inum,
 					struct ext2_dir_entry *dirent);
+extern int ext2fs_dir_block_csum_verify2(ext2_filsys fs, ext2_ino_t inum,
+					 __u32 generation,
+					 struct ext2_dir_entry *dirent);
 extern errcode_t ext2fs_dir_block_csum_set(ext2_filsys fs, ext2_ino_t inum,
 					   struct ext2_dir_entry *dirent);
 extern errcode_t ext2fs_get_dx_countlimit(ext2_filsys fs,
@@ -1280,6 +1292,7 @@ extern errcode_t ext2fs_file_llseek(ext2_file_t file, __u64 offset,
 extern errcode_t ext2fs_file_lseek(ext2_file_t file, ext2_off_t offset,
 				   int whence, ext2_off_t *ret_pos);
 errcode_t ext2fs_file_get_lsize(ext2_file_t file, __u64 *ret_size);
+extern errcode_t ext2fs_file_set_window(ext2_file_t file, unsigned int blocks);
 extern ext2_off_t ext2fs_file_get_size(ext2_file_t file);
 extern errcode_t ext2fs_file_set_size(ext2_file_t file, ext2_off_t size);
 extern errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size);
@@ -1620,6 +1633,14 @@ extern void ext2fs_sha256(const unsigned char *in, unsigned long in_size,
 		   unsigned char out[EXT2FS_SHA256_LENGTH]);
 #endif
 
+/* scratch.c */
+extern errcode_t ext2fs_scratch_open(const char *dir, const char *name,
+				     size_t size, ext2_scratch_t *ret);
+extern errcode_t ext2fs_scratch_resize(ext2_scratch_t scratch, size_t size);
+extern void *ext2fs_scratch_base(ext2_scratch_t scratch);
+extern size_t ext2fs_scratch_size(ext2_scratch_t scratch);
+extern void ext2fs_scratch_close(ext2_scratch_t scratch);
+
 /* sha512.c */
 #define EXT2FS_SHA512_LENGTH 64
 extern void ext2fs_sha512(const unsigned char *in, unsigned long in_size,
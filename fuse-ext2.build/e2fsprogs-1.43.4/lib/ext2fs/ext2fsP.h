@@ -10,6 +10,9 @@
  */
 
 #include "ext2fs.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #define EXT2FS_MAX_NESTED_LINKS  8
 
@@ -72,6 +75,10 @@ struct ext2_inode_cache {
 	unsigned int			cache_size;
 	int				refcount;
 	struct ext2_inode_cache_ent	*cache;
+#ifdef HAVE_PTHREAD_H
+	int				threads;
+	pthread_mutex_t			mutex;
+#endif
 };
 
 struct ext2_inode_cache_ent {
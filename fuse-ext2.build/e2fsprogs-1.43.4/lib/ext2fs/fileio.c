@@ -30,10 +30,28 @@ struct ext2_file {
 	blk64_t			blockno;
 	blk64_t			physblock;
 	char 			*buf;
+	/*
+	 * Multi-block window.  Reads fill it with one contiguous
+	 * extent run; writes use it to coalesce full blocks that land
+	 * on consecutive physical blocks.
+	 */
+	char			*window;
+	unsigned int		window_size;	/* allocated, in blocks */
+	unsigned int		window_max;	/* configured, in blocks */
+	blk64_t			win_start;	/* first logical block held */
+	unsigned int		win_len;	/* valid blocks in window */
+	unsigned int		ra_blocks;	/* current read-ahead size */
+	blk64_t			ra_next;	/* next block if sequential */
+	blk64_t			wb_phys;	/* first pending physical block */
+	unsigned int		wb_len;		/* pending blocks to write */
 };
 
 #define BMAP_BUFFER (file->buf + fs->blocksize)
 
+/* Default window size and the read-ahead size we start out with */
+#define FILE_WINDOW_DEFAULT	64
+#define FILE_READAHEAD_MIN	4
+
 errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 			    struct ext2_inode *inode,
 			    int flags, ext2_file_t *ret)
@@ -58,6 +76,8 @@ errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 	file->fs = fs;
 	file->ino = ino;
 	file->flags = flags & EXT2_FILE_MASK;
+	file->window_max = FILE_WINDOW_DEFAULT;
+	file->ra_blocks = FILE_READAHEAD_MIN;
 
 	if (inode) {
 		memcpy(&file->inode, inode, sizeof(struct ext2_inode));
@@ -166,6 +186,7 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 		return retval;
 
 	file->flags &= ~EXT2_FILE_BUF_DIRTY;
+	file->win_len = 0;
 
 	return retval;
 }
@@ -227,6 +248,222 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 	return 0;
 }
 
+/*
+ * Make sure the window can hold at least blocks blocks.  The contents
+ * are not preserved.
+ */
+static errcode_t grow_window(ext2_file_t file, unsigned int blocks)
+{
+	errcode_t	retval;
+
+	if (file->window_size >= blocks)
+		return 0;
+	if (file->window)
+		ext2fs_free_mem(&file->window);
+	file->window_size = 0;
+	file->win_len = 0;
+	retval = io_channel_alloc_buf(file->fs->io, blocks, &file->window);
+	if (retval)
+		return retval;
+	file->window_size = blocks;
+	return 0;
+}
+
+static int window_holds(ext2_file_t file, blk64_t blk)
+{
+	return (file->win_len && blk >= file->win_start &&
+		blk < file->win_start + file->win_len);
+}
+
+/*
+ * This function finds the physically contiguous run backing logical
+ * block lblk.  On return *len is the number of blocks (at most max)
+ * that can be read with a single request, and *avail is how much
+ * further the run goes past that.  Holes and uninitialized extents
+ * come back with *pblk set to zero; those are left to load_buffer().
+ */
+static errcode_t map_run(ext2_file_t file, blk64_t lblk, unsigned int max,
+			 blk64_t *pblk, unsigned int *len, blk64_t *avail)
+{
+	ext2_filsys		fs = file->fs;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	blk64_t			b;
+	unsigned int		i;
+	int			ret_flags;
+	errcode_t		retval;
+
+	*pblk = 0;
+	*len = 0;
+	*avail = 0;
+
+	if (file->inode.i_flags & EXT4_EXTENTS_FL) {
+		/*
+		 * Look the whole extent up at once rather than going
+		 * through ext2fs_bmap2() for every block.  Any trouble
+		 * here is reported by the single-block path instead.
+		 */
+		if (ext2fs_extent_open2(fs, file->ino, &file->inode, &handle))
+			return 0;
+		retval = ext2fs_extent_goto(handle, lblk);
+		if (!retval)
+			retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+						   &extent);
+		ext2fs_extent_free(handle);
+		if (retval || (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) ||
+		    lblk < extent.e_lblk ||
+		    lblk >= extent.e_lblk + extent.e_len)
+			return 0;
+		*pblk = extent.e_pblk + (lblk - extent.e_lblk);
+		*avail = extent.e_lblk + extent.e_len - lblk;
+		*len = *avail < max ? *avail : max;
+		*avail -= *len;
+		return 0;
+	}
+
+	for (i = 0; i < max; i++) {
+		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+				      BMAP_BUFFER, 0, lblk + i, &ret_flags, &b);
+		if (retval)
+			return retval;
+		if (!b || (ret_flags & BMAP_RET_UNINIT) ||
+		    (i && b != *pblk + i))
+			break;
+		if (i == 0)
+			*pblk = b;
+	}
+	*len = i;
+	return 0;
+}
+
+/*
+ * This function fills the window with the run starting at
+ * file->blockno, using a single read.  want is the number of blocks
+ * the caller is about to consume; readers that keep coming back for
+ * the block right after the window get a window that doubles on each
+ * refill, up to window_max.  If the block can't be served this way
+ * win_len is left at zero.
+ */
+static errcode_t load_window(ext2_file_t file, blk64_t want)
+{
+	ext2_filsys	fs = file->fs;
+	blk64_t		pblk, avail, left;
+	unsigned int	count, len;
+	errcode_t	retval;
+
+	file->win_len = 0;
+	if (file->window_max <= 1)
+		return 0;
+
+	if (file->blockno == file->ra_next) {
+		file->ra_blocks *= 2;
+		if (file->ra_blocks > file->window_max)
+			file->ra_blocks = file->window_max;
+	} else
+		file->ra_blocks = FILE_READAHEAD_MIN;
+
+	count = file->window_max;
+	if (want < count)
+		count = want > file->ra_blocks ? want : file->ra_blocks;
+	if (count > file->window_max)
+		count = file->window_max;
+	left = (EXT2_I_SIZE(&file->inode) + fs->blocksize - 1) /
+		fs->blocksize - file->blockno;
+	if (count > left)
+		count = left;
+	if (!count)
+		return 0;
+
+	retval = map_run(file, file->blockno, count, &pblk, &len, &avail);
+	if (retval || !pblk)
+		return retval;
+
+	retval = grow_window(file, count);
+	if (retval)
+		return retval;
+	retval = io_channel_read_blk64(fs->io, pblk, len, file->window);
+	if (retval)
+		return retval;
+	file->win_start = file->blockno;
+	file->win_len = len;
+	file->ra_next = file->blockno + len;
+
+	/* Let the device get started on the rest of the extent */
+	if (avail)
+		io_channel_cache_readahead(fs->io, pblk + len,
+					   avail < file->ra_blocks ?
+					   avail : file->ra_blocks);
+	return 0;
+}
+
+/*
+ * This function writes out the full blocks queued up by
+ * ext2fs_file_write().
+ */
+static errcode_t flush_window(ext2_file_t file)
+{
+	errcode_t	retval;
+
+	if (!file->wb_len)
+		return 0;
+	retval = io_channel_write_blk64(file->fs->io, file->wb_phys,
+					file->wb_len, file->window);
+	file->wb_len = 0;
+	return retval;
+}
+
+/*
+ * This function queues a full block of data for file->blockno,
+ * allocating it if necessary.  Blocks that land right after the
+ * previous one are gathered into the window and written together.
+ */
+static errcode_t queue_block(ext2_file_t file, const char *data)
+{
+	ext2_filsys	fs = file->fs;
+	blk64_t		pblk;
+	int		ret_flags;
+	errcode_t	retval;
+
+	/* The whole block is being replaced; drop any buffered copy */
+	file->flags &= ~(EXT2_FILE_BUF_VALID | EXT2_FILE_BUF_DIRTY);
+
+	retval = ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER, 0,
+			      file->blockno, &ret_flags, &pblk);
+	if (retval)
+		return retval;
+	if (pblk && (ret_flags & BMAP_RET_UNINIT)) {
+		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+				      BMAP_BUFFER, BMAP_SET, file->blockno,
+				      0, &pblk);
+		if (retval)
+			return retval;
+	}
+	if (!pblk) {
+		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+				      BMAP_BUFFER, file->ino ? BMAP_ALLOC : 0,
+				      file->blockno, 0, &pblk);
+		if (retval)
+			return retval;
+	}
+
+	if (file->wb_len && (pblk != file->wb_phys + file->wb_len ||
+			     file->wb_len >= file->window_size)) {
+		retval = flush_window(file);
+		if (retval)
+			return retval;
+	}
+	if (!file->wb_len) {
+		retval = grow_window(file, file->window_max);
+		if (retval)
+			return retval;
+		file->wb_phys = pblk;
+	}
+	memcpy(file->window + file->wb_len * fs->blocksize, data,
+	       fs->blocksize);
+	file->wb_len++;
+	return 0;
+}
+
 
 errcode_t ext2fs_file_close(ext2_file_t file)
 {
@@ -238,6 +475,8 @@ errcode_t ext2fs_file_close(ext2_file_t file)
 
 	if (file->buf)
 		ext2fs_free_mem(&file->buf);
+	if (file->window)
+		ext2fs_free_mem(&file->window);
 	ext2fs_free_mem(&file);
 
 	return retval;
@@ -284,6 +523,7 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 	unsigned int	start, c, count = 0;
 	__u64		left;
 	char		*ptr = (char *) buf;
+	char		*src;
 
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 	fs = file->fs;
@@ -294,9 +534,6 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 
 	while ((file->pos < EXT2_I_SIZE(&file->inode)) && (wanted > 0)) {
 		retval = sync_buffer_position(file);
-		if (retval)
-			goto fail;
-		retval = load_buffer(file, 0);
 		if (retval)
 			goto fail;
 
@@ -308,7 +545,30 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 		if (c > left)
 			c = left;
 
-		memcpy(ptr, file->buf+start, c);
+		/*
+		 * A buffered (possibly dirty) block wins; otherwise
+		 * serve the block from the window, refilling it with
+		 * everything this read still needs.
+		 */
+		if (!(file->flags & EXT2_FILE_BUF_VALID) &&
+		    !window_holds(file, file->blockno)) {
+			retval = load_window(file, ((__u64) start + wanted +
+					     fs->blocksize - 1) / fs->blocksize);
+			if (retval)
+				goto fail;
+		}
+		if (!(file->flags & EXT2_FILE_BUF_VALID) &&
+		    window_holds(file, file->blockno)) {
+			src = file->window + (file->blockno - file->win_start) *
+				fs->blocksize;
+		} else {
+			retval = load_buffer(file, 0);
+			if (retval)
+				goto fail;
+			src = file->buf;
+		}
+
+		memcpy(ptr, src+start, c);
 		file->pos += c;
 		ptr += c;
 		count += c;
@@ -386,7 +646,7 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 			    unsigned int nbytes, unsigned int *written)
 {
 	ext2_filsys	fs;
-	errcode_t	retval = 0;
+	errcode_t	retval = 0, rc;
 	unsigned int	start, c, count = 0;
 	const char	*ptr = (const char *) buf;
 
@@ -406,6 +666,9 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 		retval = 0;
 	}
 
+	/* Whatever the read window holds may be about to change */
+	file->win_len = 0;
+
 	while (nbytes > 0) {
 		retval = sync_buffer_position(file);
 		if (retval)
@@ -416,6 +679,17 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 		if (c > nbytes)
 			c = nbytes;
 
+		/*
+		 * Full blocks bypass the block buffer and are written
+		 * out in physically contiguous batches.
+		 */
+		if (c == fs->blocksize && file->window_max > 1) {
+			retval = queue_block(file, ptr);
+			if (retval)
+				goto fail;
+			goto next;
+		}
+
 		/*
 		 * We only need to do a read-modify-update cycle if
 		 * we're doing a partial write.
@@ -440,6 +714,7 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 
 		file->flags |= EXT2_FILE_BUF_DIRTY;
 		memcpy(file->buf+start, ptr, c);
+	next:
 		file->pos += c;
 		ptr += c;
 		count += c;
@@ -447,10 +722,12 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 	}
 
 fail:
+	rc = flush_window(file);
+	if (retval == 0)
+		retval = rc;
+
 	/* Update inode size */
 	if (count != 0 && EXT2_I_SIZE(&file->inode) < file->pos) {
-		errcode_t	rc;
-
 		rc = ext2fs_file_set_size2(file, file->pos);
 		if (retval == 0)
 			retval = rc;
@@ -495,6 +772,26 @@ errcode_t ext2fs_file_lseek(ext2_file_t file, ext2_off_t offset,
 }
 
 
+/*
+ * This function sets the size, in blocks, of the window used to batch
+ * up reads and writes.  A size of 0 or 1 turns batching off.
+ */
+errcode_t ext2fs_file_set_window(ext2_file_t file, unsigned int blocks)
+{
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	if (blocks > 65536)
+		return EXT2_ET_INVALID_ARGUMENT;
+	file->window_max = blocks;
+	file->ra_blocks = FILE_READAHEAD_MIN;
+	file->win_len = 0;
+	if (file->window && file->window_size > blocks) {
+		ext2fs_free_mem(&file->window);
+		file->window_size = 0;
+	}
+	return 0;
+}
+
 /*
  * This function returns the size of the file, according to the inode
  */
@@ -538,6 +835,18 @@ static errcode_t ext2fs_file_zero_past_offset(ext2_file_t file,
 	if (retval)
 		return retval;
 
+	/*
+	 * The block buffer may hold the block being zeroed; write it out
+	 * first and drop it, so that neither a later read nor a later
+	 * flush brings the old tail back.
+	 */
+	if (file->blockno == offset / fs->blocksize) {
+		retval = ext2fs_file_flush(file);
+		if (retval)
+			return retval;
+		file->flags &= ~EXT2_FILE_BUF_VALID;
+	}
+
 	/* Is there an initialized block at the end? */
 	retval = ext2fs_bmap2(fs, file->ino, NULL, NULL, 0,
 			      offset / fs->blocksize, &ret_flags, &blk);
@@ -579,6 +888,7 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 
+	file->win_len = 0;
 	if (size && ext2fs_file_block_offset_too_big(file->fs, &file->inode,
 					(size - 1) / file->fs->blocksize))
 		return EXT2_ET_FILE_TOO_BIG;
@@ -605,6 +915,14 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 	if (truncate_block >= old_truncate)
 		return 0;
 
+	/*
+	 * The blocks past the new end are about to be freed; a buffered
+	 * copy of one of them must not be written back, nor its physical
+	 * block number reused.
+	 */
+	if (file->blockno >= truncate_block)
+		file->flags &= ~(EXT2_FILE_BUF_VALID | EXT2_FILE_BUF_DIRTY);
+
 	return ext2fs_punch(file->fs, file->ino, &file->inode, 0,
 			    truncate_block, ~0ULL);
 }
@@ -59,6 +59,27 @@ struct ext2_struct_inode_scan {
 	int			reserved[6];
 };
 
+/*
+ * The inode cache (including its block buffer) is shared by every
+ * reader of the filesystem; serialize it if the caller asked for
+ * EXT2_FLAG_THREADS.
+ */
+static inline void icache_lock(struct ext2_inode_cache *icache)
+{
+#ifdef HAVE_PTHREAD_H
+	if (icache->threads)
+		pthread_mutex_lock(&icache->mutex);
+#endif
+}
+
+static inline void icache_unlock(struct ext2_inode_cache *icache)
+{
+#ifdef HAVE_PTHREAD_H
+	if (icache->threads)
+		pthread_mutex_unlock(&icache->mutex);
+#endif
+}
+
 /*
  * This routine flushes the icache, if it exists.
  */
@@ -92,6 +113,10 @@ void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
 	if (icache->cache)
 		ext2fs_free_mem(&icache->cache);
 	icache->buffer_blk = 0;
+#ifdef HAVE_PTHREAD_H
+	if (icache->threads)
+		pthread_mutex_destroy(&icache->mutex);
+#endif
 	ext2fs_free_mem(&icache);
 }
 
@@ -128,6 +153,12 @@ errcode_t ext2fs_create_inode_cache(ext2_filsys fs, unsigned int cache_size)
 			goto errout;
 	}
 
+#ifdef HAVE_PTHREAD_H
+	if (fs->flags & EXT2_FLAG_THREADS) {
+		pthread_mutex_init(&fs->icache->mutex, NULL);
+		fs->icache->threads = 1;
+	}
+#endif
 	ext2fs_flush_icache(fs);
 	return 0;
 errout:
@@ -664,7 +695,8 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 
 		/* Verify the inode checksum. */
 		if (!(iblock_status[iblk] & IBLOCK_STATUS_CSUMS_OK) &&
-		    !(scan->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+		    ((scan->scan_flags & EXT2_SF_VERIFY_CSUMS) ||
+		     !(scan->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)) &&
 		    !ext2fs_inode_csum_verify(scan->fs, scan->current_inode + 1,
 				(struct ext2_inode_large *)scan->temp_buffer))
 			retval = EXT2_ET_INODE_CSUM_INVALID;
@@ -684,7 +716,8 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 	} else {
 		/* Verify the inode checksum. */
 		if (!(iblock_status[iblk] & IBLOCK_STATUS_CSUMS_OK) &&
-		    !(scan->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+		    ((scan->scan_flags & EXT2_SF_VERIFY_CSUMS) ||
+		     !(scan->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)) &&
 		    !ext2fs_inode_csum_verify(scan->fs, scan->current_inode + 1,
 				(struct ext2_inode_large *)scan->ptr))
 			retval = EXT2_ET_INODE_CSUM_INVALID;
@@ -760,10 +793,12 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 			return retval;
 	}
 	/* Check to see if it's in the inode cache */
+	icache_lock(fs->icache);
 	for (i = 0; i < fs->icache->cache_size; i++) {
 		if (fs->icache->cache[i].ino == ino) {
 			memcpy(inode, fs->icache->cache[i].inode,
 			       (bufsize > length) ? length : bufsize);
+			icache_unlock(fs->icache);
 			return 0;
 		}
 	}
@@ -776,13 +811,17 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		io = fs->image_io;
 	} else {
 		group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
-		if (group > fs->group_desc_count)
-			return EXT2_ET_BAD_INODE_NUM;
+		if (group > fs->group_desc_count) {
+			retval = EXT2_ET_BAD_INODE_NUM;
+			goto out;
+		}
 		offset = ((ino - 1) % EXT2_INODES_PER_GROUP(fs->super)) *
 			EXT2_INODE_SIZE(fs->super);
 		block = offset >> EXT2_BLOCK_SIZE_BITS(fs->super);
-		if (!ext2fs_inode_table_loc(fs, (unsigned) group))
-			return EXT2_ET_MISSING_INODE_TABLE;
+		if (!ext2fs_inode_table_loc(fs, (unsigned) group)) {
+			retval = EXT2_ET_MISSING_INODE_TABLE;
+			goto out;
+		}
 		block_nr = ext2fs_inode_table_loc(fs, group) +
 			block;
 		io = fs->io;
@@ -802,7 +841,7 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 			retval = io_channel_read_blk64(io, block_nr, 1,
 						     fs->icache->buffer);
 			if (retval)
-				return retval;
+				goto out;
 			fs->icache->buffer_blk = block_nr;
 		}
 
@@ -832,10 +871,12 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	}
 	memcpy(inode, iptr, (bufsize > length) ? length : bufsize);
 
+	retval = 0;
 	if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) && fail_csum)
-		return EXT2_ET_INODE_CSUM_INVALID;
-
-	return 0;
+		retval = EXT2_ET_INODE_CSUM_INVALID;
+out:
+	icache_unlock(fs->icache);
+	return retval;
 }
 
 errcode_t ext2fs_read_inode(ext2_filsys fs, ext2_ino_t ino,
@@ -888,6 +929,7 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 
 	/* Check to see if the inode cache needs to be updated */
 	if (fs->icache) {
+		icache_lock(fs->icache);
 		for (i=0; i < fs->icache->cache_size; i++) {
 			if (fs->icache->cache[i].ino == ino) {
 				memcpy(fs->icache->cache[i].inode, inode,
@@ -899,12 +941,13 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		retval = ext2fs_create_inode_cache(fs, 4);
 		if (retval)
 			goto errout;
+		icache_lock(fs->icache);
 	}
 	memcpy(w_inode, inode, (bufsize > length) ? length : bufsize);
 
 	if (!(fs->flags & EXT2_FLAG_RW)) {
 		retval = EXT2_ET_RO_FILSYS;
-		goto errout;
+		goto unlock;
 	}
 
 #ifdef WORDS_BIGENDIAN
@@ -913,7 +956,7 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 
 	retval = ext2fs_inode_csum_set(fs, ino, w_inode);
 	if (retval)
-		goto errout;
+		goto unlock;
 
 	group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
 	offset = ((ino - 1) % EXT2_INODES_PER_GROUP(fs->super)) *
@@ -921,7 +964,7 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	block = offset >> EXT2_BLOCK_SIZE_BITS(fs->super);
 	if (!ext2fs_inode_table_loc(fs, (unsigned) group)) {
 		retval = EXT2_ET_MISSING_INODE_TABLE;
-		goto errout;
+		goto unlock;
 	}
 	block_nr = ext2fs_inode_table_loc(fs, (unsigned) group) + block;
 
@@ -938,7 +981,7 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 			retval = io_channel_read_blk64(fs->io, block_nr, 1,
 						     fs->icache->buffer);
 			if (retval)
-				goto errout;
+				goto unlock;
 			fs->icache->buffer_blk = block_nr;
 		}
 
@@ -949,7 +992,7 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		retval = io_channel_write_blk64(fs->io, block_nr, 1,
 					      fs->icache->buffer);
 		if (retval)
-			goto errout;
+			goto unlock;
 
 		offset = 0;
 		ptr += clen;
@@ -958,6 +1001,8 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	}
 
 	fs->flags |= EXT2_FLAG_CHANGED;
+unlock:
+	icache_unlock(fs->icache);
 errout:
 	ext2fs_free_mem(&w_inode);
 	return retval;
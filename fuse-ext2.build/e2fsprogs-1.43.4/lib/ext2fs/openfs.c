@@ -156,6 +156,8 @@ errcode_t ext2fs_open2(const char *name, const char *io_options,
 		io_flags |= IO_FLAG_EXCLUSIVE;
 	if (flags & EXT2_FLAG_DIRECT_IO)
 		io_flags |= IO_FLAG_DIRECT_IO;
+	if (flags & EXT2_FLAG_THREADS)
+		io_flags |= IO_FLAG_THREADS;
 	retval = manager->open(fs->device_name, io_flags, &fs->io);
 	if (retval)
 		goto cleanup;
@@ -468,6 +470,16 @@ errcode_t ext2fs_open2(const char *name, const char *io_options,
 		}
 	}
 
+	/*
+	 * Concurrent readers share the inode cache, so it has to exist
+	 * (with its lock) before the first of them looks for it.
+	 */
+	if (flags & EXT2_FLAG_THREADS) {
+		retval = ext2fs_create_inode_cache(fs, 4);
+		if (retval)
+			goto cleanup;
+	}
+
 	fs->flags &= ~EXT2_FLAG_NOFREE_ON_ERROR;
 	*ret_fs = fs;
 
@@ -0,0 +1,176 @@
+/*
+ * scratch.c --- file-backed scratch arenas for out-of-core tables
+ *
+ * A scratch arena is a flat region of memory which is backed by an
+ * unlinked temporary file instead of anonymous memory, so that the
+ * kernel can write it back and drop it under memory pressure.  It is
+ * used by e2fsck to hold its per-inode tables on systems where they
+ * would not fit in core (see the [scratch_files] stanza in
+ * e2fsck.conf).
+ *
+ * The callers keep fixed-size records in the arena and index them
+ * directly, so there is no per-record overhead and no hashing; and
+ * because e2fsck mostly walks inodes in order, accesses to the arena
+ * are largely sequential, which is what the page cache handles best.
+ * The file is created sparse, so only the parts which have actually
+ * been written consume disk space.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define HAVE_SCRATCH
+#endif
+
+struct ext2_scratch {
+	int		fd;
+	void		*base;
+	size_t		size;
+};
+
+#ifdef HAVE_SCRATCH
+static errcode_t scratch_map(ext2_scratch_t scratch, size_t size)
+{
+	void		*base;
+
+	if (ftruncate(scratch->fd, size) < 0)
+		return errno;
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    scratch->fd, 0);
+	if (base == MAP_FAILED)
+		return errno;
+	scratch->base = base;
+	scratch->size = size;
+	return 0;
+}
+#endif
+
+/*
+ * Create a zero-filled arena of size bytes in a temporary file in
+ * the directory dir.  The name is only used to tell the files of
+ * different tables apart; the file is unlinked right away, so that
+ * nothing is left behind if the program is killed.
+ */
+errcode_t ext2fs_scratch_open(const char *dir EXT2FS_ATTR((unused)),
+			      const char *name EXT2FS_ATTR((unused)),
+			      size_t size EXT2FS_ATTR((unused)),
+			      ext2_scratch_t *ret)
+{
+#ifdef HAVE_SCRATCH
+	ext2_scratch_t	scratch;
+	errcode_t	retval;
+	mode_t		save_umask;
+	char		*fn;
+
+	*ret = 0;
+	if (size == 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_scratch), &scratch);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_get_mem(strlen(dir) + strlen(name) + 16, &fn);
+	if (retval)
+		goto errout;
+	sprintf(fn, "%s/%s-XXXXXX", dir, name);
+	save_umask = umask(077);
+	scratch->fd = mkstemp(fn);
+	umask(save_umask);
+	if (scratch->fd < 0) {
+		retval = errno;
+		ext2fs_free_mem(&fn);
+		goto errout;
+	}
+	unlink(fn);
+	ext2fs_free_mem(&fn);
+
+	retval = scratch_map(scratch, size);
+	if (retval) {
+		close(scratch->fd);
+		goto errout;
+	}
+	*ret = scratch;
+	return 0;
+
+errout:
+	ext2fs_free_mem(&scratch);
+	return retval;
+#else
+	*ret = 0;
+	return EXT2_ET_UNIMPLEMENTED;
+#endif
+}
+
+/*
+ * Grow the arena.  The old contents are preserved and the new space
+ * reads as zeros; but the arena may move, so pointers into it must be
+ * recomputed from ext2fs_scratch_base() afterwards.  Shrinking is not
+ * supported, since the tail would be gone before we knew whether the
+ * new mapping could be made.
+ */
+errcode_t ext2fs_scratch_resize(ext2_scratch_t scratch, size_t size)
+{
+#ifdef HAVE_SCRATCH
+	void		*old_base = scratch->base;
+	size_t		old_size = scratch->size;
+	errcode_t	retval;
+
+	if (size < old_size)
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (size == old_size)
+		return 0;
+
+	/* The old mapping stays valid until the new one is in place */
+	retval = scratch_map(scratch, size);
+	if (retval) {
+		if (ftruncate(scratch->fd, old_size) < 0)
+			return errno;
+		return retval;
+	}
+	munmap(old_base, old_size);
+	return 0;
+#else
+	return EXT2_ET_UNIMPLEMENTED;
+#endif
+}
+
+void *ext2fs_scratch_base(ext2_scratch_t scratch)
+{
+	return scratch->base;
+}
+
+size_t ext2fs_scratch_size(ext2_scratch_t scratch)
+{
+	return scratch->size;
+}
+
+void ext2fs_scratch_close(ext2_scratch_t scratch)
+{
+	if (!scratch)
+		return;
+#ifdef HAVE_SCRATCH
+	munmap(scratch->base, scratch->size);
+	close(scratch->fd);
+#endif
+	ext2fs_free_mem(&scratch);
+}
@@ -0,0 +1,397 @@
+/*
+ * tst_fileio.c --- test the read and write window of fileio.c
+ *
+ * Builds a small filesystem in a scratch file and runs a random mix of
+ * reads, writes, sequential scans and truncates against one file,
+ * checking every read against a shadow copy kept in memory.  The
+ * window size is changed every so often, and the file is closed and
+ * reopened, so that batched reads and writes are mixed with the
+ * single-block path.  This is done for an extent-mapped and for a
+ * block-mapped file.
+ *
+ * If the path of an e2fsck binary is given, the filesystem is then
+ * checked with "e2fsck -fn".
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define BLOCK_SIZE	1024
+#define FS_BLOCKS	16384
+#define MAX_FILE	(3 * 1024 * 1024)
+#define MAX_IO		(80 * BLOCK_SIZE)
+#define HOT_SIZE	(128 * BLOCK_SIZE)
+#define NUM_OPS		3000
+
+static const unsigned int windows[] = { 0, 1, 4, 64, 7 };
+
+static unsigned char	shadow[MAX_FILE];
+static unsigned char	buf[MAX_FILE];
+static __u64		shadow_size;
+static char		fn[] = "/tmp/tst_fileio.XXXXXX";
+static unsigned int	seed;
+
+static void fail(const char *what, errcode_t retval)
+{
+	if (retval)
+		com_err("tst_fileio", retval, "%s", what);
+	else
+		fprintf(stderr, "tst_fileio: %s\n", what);
+	unlink(fn);
+	exit(1);
+}
+
+static void fill(unsigned char *p, size_t size)
+{
+	while (size--)
+		*p++ = rand_r(&seed);
+}
+
+static ext2_filsys make_fs(int extents)
+{
+	struct ext2_super_block param;
+	ext2_filsys	fs;
+	errcode_t	retval;
+	ext2_ino_t	ino;
+	int		fd;
+
+	fd = open(fn, O_RDWR | O_TRUNC);
+	if (fd < 0 || ftruncate(fd, (off_t) FS_BLOCKS * BLOCK_SIZE) < 0)
+		fail("cannot size the scratch file", errno);
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, FS_BLOCKS);
+	param.s_log_block_size = 0;	/* 1k blocks */
+	param.s_rev_level = EXT2_DYNAMIC_REV;
+	param.s_inode_size = 256;
+	if (extents)
+		param.s_feature_incompat |= EXT3_FEATURE_INCOMPAT_EXTENTS;
+
+	retval = ext2fs_initialize(fn, EXT2_FLAG_64BITS, &param,
+				   unix_io_manager, &fs);
+	if (retval)
+		fail("while initializing the filesystem", retval);
+	retval = ext2fs_allocate_tables(fs);
+	if (retval)
+		fail("while allocating the inode tables", retval);
+
+	/* What mke2fs does: bad block inode, reserved inodes, root, l+f */
+	ext2fs_inode_alloc_stats2(fs, EXT2_BAD_INO, +1, 0);
+	retval = ext2fs_update_bb_inode(fs, NULL);
+	if (retval)
+		fail("while writing the bad block inode", retval);
+	for (ino = EXT2_ROOT_INO + 1; ino < EXT2_FIRST_INODE(fs->super); ino++)
+		ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	retval = ext2fs_mkdir(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0);
+	if (retval)
+		fail("while creating the root directory", retval);
+	retval = ext2fs_mkdir(fs, EXT2_ROOT_INO, 0, "lost+found");
+	if (retval)
+		fail("while creating lost+found", retval);
+	return fs;
+}
+
+static ext2_ino_t make_file(ext2_filsys fs)
+{
+	struct ext2_inode inode;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+
+	retval = ext2fs_new_inode(fs, EXT2_ROOT_INO, LINUX_S_IFREG | 0644,
+				  0, &ino);
+	if (retval)
+		fail("while allocating an inode", retval);
+	retval = ext2fs_link(fs, EXT2_ROOT_INO, "file", ino,
+			     EXT2_FT_REG_FILE);
+	if (retval)
+		fail("while linking the file", retval);
+	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+
+	memset(&inode, 0, sizeof(inode));
+	inode.i_mode = LINUX_S_IFREG | 0644;
+	inode.i_links_count = 1;
+	inode.i_atime = inode.i_ctime = inode.i_mtime = fs->now ? fs->now :
+		time(0);
+	if (ext2fs_has_feature_extents(fs->super))
+		inode.i_flags |= EXT4_EXTENTS_FL;
+	retval = ext2fs_write_new_inode(fs, ino, &inode);
+	if (retval)
+		fail("while writing the new inode", retval);
+	if (inode.i_flags & EXT4_EXTENTS_FL) {
+		ext2_extent_handle_t handle;
+
+		retval = ext2fs_extent_open2(fs, ino, &inode, &handle);
+		if (retval)
+			fail("while setting up the extent tree", retval);
+		ext2fs_extent_free(handle);
+	}
+	shadow_size = 0;
+	memset(shadow, 0, sizeof(shadow));
+	return ino;
+}
+
+static ext2_file_t open_file(ext2_filsys fs, ext2_ino_t ino,
+			     unsigned int window)
+{
+	ext2_file_t	file;
+	errcode_t	retval;
+
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	if (retval)
+		fail("file_open", retval);
+	retval = ext2fs_file_set_window(file, window);
+	if (retval)
+		fail("file_set_window", retval);
+	return file;
+}
+
+static void check_read(ext2_file_t file, __u64 pos, unsigned int len)
+{
+	unsigned int	got, want;
+	errcode_t	retval;
+
+	retval = ext2fs_file_llseek(file, pos, EXT2_SEEK_SET, NULL);
+	if (retval)
+		fail("file_llseek", retval);
+	retval = ext2fs_file_read(file, buf, len, &got);
+	if (retval)
+		fail("file_read", retval);
+	want = pos >= shadow_size ? 0 :
+		(pos + len > shadow_size ? shadow_size - pos : len);
+	if (got != want)
+		fail("file_read returned the wrong length", 0);
+	if (memcmp(buf, shadow + pos, got))
+		fail("file_read returned stale data", 0);
+}
+
+static void do_write(ext2_file_t file, __u64 pos, unsigned int len)
+{
+	unsigned int	got;
+	errcode_t	retval;
+
+	fill(buf, len);
+	retval = ext2fs_file_llseek(file, pos, EXT2_SEEK_SET, NULL);
+	if (retval)
+		fail("file_llseek", retval);
+	retval = ext2fs_file_write(file, buf, len, &got);
+	if (retval)
+		fail("file_write", retval);
+	if (got != len)
+		fail("short file_write", 0);
+	memcpy(shadow + pos, buf, len);
+	if (pos + len > shadow_size)
+		shadow_size = pos + len;
+}
+
+static void set_size(ext2_file_t file, __u64 size)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_file_set_size2(file, size);
+	if (retval)
+		fail("file_set_size2", retval);
+	if (size < shadow_size)
+		memset(shadow + size, 0, shadow_size - size);
+	shadow_size = size;
+}
+
+/* Read the whole file front to back, the way read-ahead likes it */
+static void check_scan(ext2_file_t file)
+{
+	unsigned int	got, len;
+	__u64		pos = 0;
+	errcode_t	retval;
+
+	retval = ext2fs_file_llseek(file, 0, EXT2_SEEK_SET, NULL);
+	if (retval)
+		fail("file_llseek", retval);
+	do {
+		len = 1 + rand_r(&seed) % ((rand_r(&seed) % 2) ? BLOCK_SIZE :
+					   MAX_IO);
+		retval = ext2fs_file_read(file, buf + pos, len, &got);
+		if (retval)
+			fail("file_read", retval);
+		pos += got;
+	} while (got);
+	if (pos != shadow_size || memcmp(buf, shadow, pos))
+		fail("sequential file_read returned bad data", 0);
+}
+
+static void run(int extents, char *fsck)
+{
+	ext2_filsys	fs;
+	ext2_file_t	file;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+	unsigned int	got, len, window;
+	__u64		pos, size, hot = 0;
+	char		cmd[256];
+	int		i, op;
+
+	fs = make_fs(extents);
+	ino = make_file(fs);
+	window = windows[0];
+	file = open_file(fs, ino, window);
+
+	for (i = 0; i < NUM_OPS; i++) {
+		op = rand_r(&seed) % 16;
+		/*
+		 * Mostly in a small part of the file which moves now and
+		 * then, so that reads find what is left in the window and
+		 * writes replace it.
+		 */
+		if (i % 200 == 0)
+			hot = rand_r(&seed) % (MAX_FILE - HOT_SIZE);
+		switch (rand_r(&seed) % 4) {
+		case 0: case 1:
+			pos = hot + rand_r(&seed) % HOT_SIZE;
+			break;
+		case 2:
+			pos = shadow_size;
+			break;
+		default:
+			pos = rand_r(&seed) % MAX_FILE;
+		}
+		/* Mostly block sized and aligned, sometimes not */
+		if (rand_r(&seed) % 2) {
+			pos -= pos % BLOCK_SIZE;
+			len = BLOCK_SIZE * (1 + rand_r(&seed) %
+					    (MAX_IO / BLOCK_SIZE));
+		} else
+			len = 1 + rand_r(&seed) % MAX_IO;
+		if (pos + len > MAX_FILE) {
+			pos = MAX_FILE - len;
+			pos -= pos % BLOCK_SIZE;
+		}
+
+		switch (op) {
+		case 0: case 1: case 2: case 3:
+			do_write(file, pos, len);
+			break;
+		case 4: case 5:
+			/* Change part of what the window was just filled with */
+			check_read(file, pos, len);
+			size = pos + rand_r(&seed) % len;
+			len = 1 + rand_r(&seed) % (pos + len - size);
+			if (rand_r(&seed) % 2 && len >= 2 * BLOCK_SIZE) {
+				size += BLOCK_SIZE - size % BLOCK_SIZE;
+				len -= BLOCK_SIZE + len % BLOCK_SIZE;
+			}
+			do_write(file, size, len);
+			check_read(file, pos, size + len - pos);
+			break;
+		case 6: case 7: case 8: case 9:
+			check_read(file, pos, len);
+			break;
+		case 10:
+			check_scan(file);
+			break;
+		case 11:
+			/* Shrink more often than grow */
+			size = (rand_r(&seed) % 3) ? shadow_size -
+				rand_r(&seed) % (shadow_size / 2 + 1) : pos;
+			if (rand_r(&seed) % 2)
+				size -= size % BLOCK_SIZE;
+			if (size >= shadow_size || rand_r(&seed) % 2) {
+				set_size(file, size);
+				break;
+			}
+			/*
+			 * Cut the file short and grow it back, with the
+			 * old tail in the window; it must read back as zeros.
+			 */
+			pos = size - size % BLOCK_SIZE;
+			len = shadow_size - pos < MAX_IO ? shadow_size - pos :
+				MAX_IO;
+			check_read(file, pos, len);
+			size = shadow_size;
+			set_size(file, pos + rand_r(&seed) % len);
+			set_size(file, size);
+			check_read(file, pos, len);
+			break;
+		case 12:
+			retval = ext2fs_file_flush(file);
+			if (retval)
+				fail("file_flush", retval);
+			break;
+		case 13:
+			window = windows[rand_r(&seed) %
+					  (sizeof(windows) / sizeof(windows[0]))];
+			retval = ext2fs_file_set_window(file, window);
+			if (retval)
+				fail("file_set_window", retval);
+			break;
+		case 14: case 15:
+			/* Everything must have made it to the inode */
+			retval = ext2fs_file_close(file);
+			if (retval)
+				fail("file_close", retval);
+			file = open_file(fs, ino, window);
+			if (ext2fs_file_get_size(file) != shadow_size)
+				fail("the inode has the wrong size", 0);
+			break;
+		}
+	}
+	check_scan(file);
+
+	if (ext2fs_file_set_window(file, 65537) != EXT2_ET_INVALID_ARGUMENT)
+		fail("file_set_window took a window that is too big", 0);
+	retval = ext2fs_file_close(file);
+	if (retval)
+		fail("file_close", retval);
+	retval = ext2fs_close_free(&fs);
+	if (retval)
+		fail("while closing the filesystem", retval);
+
+	if (!fsck)
+		return;
+	snprintf(cmd, sizeof(cmd), "E2FSCK_CONFIG=/dev/null %s -fn %s",
+		 fsck, fn);
+	if (system(cmd))
+		fail("e2fsck found problems", 0);
+}
+
+int main(int argc, char **argv)
+{
+	char	*fsck = NULL;
+	int	fd;
+
+	initialize_ext2_error_table();
+
+	if (argc > 1 && access(argv[1], X_OK) == 0)
+		fsck = argv[1];
+	else if (argc > 1)
+		printf("tst_fileio: %s not found, not checking with e2fsck\n",
+		       argv[1]);
+	seed = argc > 2 ? atoi(argv[2]) : 42;
+
+	fd = mkstemp(fn);
+	if (fd < 0)
+		fail("cannot create a scratch file", errno);
+	close(fd);
+
+	run(1, fsck);
+	run(0, fsck);
+
+	unlink(fn);
+	printf("tst_fileio: OK\n");
+	return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * tst_unix_io.c --- test the block cache of the unix I/O manager
+ *
+ * Runs a random mix of cached and direct reads and writes, byte
+ * writes, discards and zeroouts against a scratch file, and checks
+ * every read (and, after each flush, the file itself) against a
+ * shadow copy kept in memory.  The cache is kept small compared to
+ * the file so that dirty blocks are evicted all the time.
+ *
+ * With IO_FLAG_THREADS the same mix is also run by several threads at
+ * once, each in its own part of the file, while all of them read a
+ * shared part; and a read error handler which calls back into the
+ * channel is checked for deadlocks.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define BLOCK_SIZE	1024
+#define NUM_BLOCKS	256
+#define MAX_COUNT	40
+#define NUM_OPS		20000
+#define HOT_BLOCKS	16
+#define NUM_THREADS	4
+#define SHARED_BLOCKS	16	/* read by every thread */
+
+struct worker {
+	io_channel	io;
+	unsigned int	seed;
+	unsigned long long first, blocks;	/* the part it may change */
+	unsigned long long hot;
+	int		ops;
+	int		byte_writes;
+	unsigned char	buf[MAX_COUNT * BLOCK_SIZE];
+};
+
+static unsigned char	shadow[NUM_BLOCKS * BLOCK_SIZE];
+static unsigned char	check[NUM_BLOCKS * BLOCK_SIZE];
+static char		fn[] = "/tmp/tst_unix_io.XXXXXX";
+static int		fd;
+
+static void fail(const char *what, errcode_t retval)
+{
+	if (retval)
+		com_err("tst_unix_io", retval, "%s", what);
+	else
+		fprintf(stderr, "tst_unix_io: %s\n", what);
+	unlink(fn);
+	exit(1);
+}
+
+static void fill(unsigned int *seed, unsigned char *p, size_t size)
+{
+	while (size--)
+		*p++ = rand_r(seed);
+}
+
+/*
+ * Most operations land in a small window which moves now and then, so
+ * that blocks are still cached when they are read back or overwritten.
+ */
+static unsigned long long pick(struct worker *w, int i, int *count)
+{
+	unsigned long long block;
+
+	if (i % 500 == 0)
+		w->hot = rand_r(&w->seed) % (w->blocks - HOT_BLOCKS);
+	if (rand_r(&w->seed) % 4)
+		block = w->hot + rand_r(&w->seed) % HOT_BLOCKS;
+	else
+		block = rand_r(&w->seed) % w->blocks;
+	if (block + *count > w->blocks)
+		*count = w->blocks - block;
+	return w->first + block;
+}
+
+/* Check that what made it to the file matches the shadow copy */
+static void check_file(const char *when)
+{
+	if (pread(fd, check, sizeof(check), 0) != sizeof(check))
+		fail("short read of the scratch file", 0);
+	if (memcmp(check, shadow, sizeof(check)))
+		fail(when, 0);
+}
+
+static void *do_ops(void *arg)
+{
+	struct worker	*w = arg;
+	io_channel	io = w->io;
+	errcode_t	retval;
+	unsigned long long block;
+	int		i, count, op, size;
+
+	for (i = 0; i < w->ops; i++) {
+		op = rand_r(&w->seed) % 16;
+		/* Mostly cached sizes, sometimes past WRITE_DIRECT_SIZE */
+		count = 1 + rand_r(&w->seed) %
+			((rand_r(&w->seed) % 4) ? 4 : MAX_COUNT);
+		block = pick(w, i, &count);
+		size = count * BLOCK_SIZE;
+
+		switch (op) {
+		case 0: case 1: case 2: case 3: case 4: case 5:
+			fill(&w->seed, w->buf, size);
+			retval = io_channel_write_blk64(io, block, count,
+							w->buf);
+			if (retval)
+				fail("write_blk64", retval);
+			memcpy(shadow + block * BLOCK_SIZE, w->buf, size);
+			break;
+		case 6: case 7: case 8:
+			retval = io_channel_read_blk64(io, block, count,
+						       w->buf);
+			if (retval)
+				fail("read_blk64", retval);
+			if (memcmp(w->buf, shadow + block * BLOCK_SIZE, size))
+				fail("read_blk64 returned stale data", 0);
+			break;
+		case 9: case 10:
+			/* The shared blocks, which nobody changes */
+			count = 1 + rand_r(&w->seed) % 4;
+			block = rand_r(&w->seed) % (SHARED_BLOCKS - count + 1);
+			retval = io_channel_read_blk64(io, block, count,
+						       w->buf);
+			if (retval)
+				fail("read_blk64", retval);
+			if (memcmp(w->buf, shadow + block * BLOCK_SIZE,
+				   count * BLOCK_SIZE))
+				fail("read_blk64 returned bad shared data", 0);
+			break;
+		case 11:
+			/* A byte-counted write that ends mid-block */
+			size -= rand_r(&w->seed) % BLOCK_SIZE;
+			fill(&w->seed, w->buf, size);
+			retval = io_channel_write_blk64(io, block, -size,
+							w->buf);
+			if (retval)
+				fail("write_blk64 (byte count)", retval);
+			memcpy(shadow + block * BLOCK_SIZE, w->buf, size);
+			break;
+		case 12:
+			/* write_byte throws away the whole cache */
+			if (!w->byte_writes)
+				break;
+			size = 1 + rand_r(&w->seed) % 100;
+			fill(&w->seed, w->buf, size);
+			retval = io_channel_write_byte(io, block * BLOCK_SIZE,
+						       size, w->buf);
+			if (retval)
+				fail("write_byte", retval);
+			memcpy(shadow + block * BLOCK_SIZE, w->buf, size);
+			break;
+		case 13:
+			retval = io_channel_discard(io, block, count);
+			if (retval == EXT2_ET_UNIMPLEMENTED)
+				break;
+			if (retval)
+				fail("discard", retval);
+			memset(shadow + block * BLOCK_SIZE, 0, size);
+			break;
+		case 14:
+			retval = io_channel_zeroout(io, block, count);
+			if (retval == EXT2_ET_UNIMPLEMENTED)
+				break;
+			if (retval)
+				fail("zeroout", retval);
+			memset(shadow + block * BLOCK_SIZE, 0, size);
+			break;
+		case 15:
+			retval = io_channel_flush(io);
+			if (retval)
+				fail("flush", retval);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static io_channel open_channel(int flags, const char *options)
+{
+	io_channel	io;
+	errcode_t	retval;
+	unsigned int	seed = 1;
+
+	memset(shadow, 0, sizeof(shadow));
+	if (ftruncate(fd, 0) || ftruncate(fd, sizeof(shadow)))
+		fail("cannot size the scratch file", errno);
+
+	retval = unix_io_manager->open(fn, IO_FLAG_RW | flags, &io);
+	if (retval)
+		fail("open", retval);
+	retval = io_channel_set_blksize(io, BLOCK_SIZE);
+	if (retval)
+		fail("set_blksize", retval);
+	retval = io_channel_set_options(io, options);
+	if (retval)
+		fail(options, retval);
+
+	/* The shared blocks get their contents up front */
+	fill(&seed, shadow, SHARED_BLOCKS * BLOCK_SIZE);
+	retval = io_channel_write_blk64(io, 0, SHARED_BLOCKS, shadow);
+	if (retval)
+		fail("write_blk64", retval);
+	return io;
+}
+
+static void close_channel(io_channel io, const char *what,
+			  const char *options)
+{
+	io_stats	stats;
+	errcode_t	retval;
+
+	retval = io_channel_flush(io);
+	if (retval)
+		fail("flush", retval);
+	check_file("flush left the file out of date");
+	io->manager->get_stats(io, &stats);
+	if (stats->cache_evictions == 0)
+		fail("the cache never evicted a block", 0);
+	printf("%-8s %-18s hits %llu misses %llu evictions %llu\n", what,
+	       options ? options : "(default)", stats->cache_hits,
+	       stats->cache_misses, stats->cache_evictions);
+	retval = io_channel_close(io);
+	if (retval)
+		fail("close", retval);
+	check_file("close left the file out of date");
+}
+
+static void run(int flags, const char *options, unsigned int seed)
+{
+	static struct worker w;
+
+	memset(&w, 0, sizeof(w));
+	w.io = open_channel(flags, options);
+	w.seed = seed;
+	w.first = SHARED_BLOCKS;
+	w.blocks = NUM_BLOCKS - SHARED_BLOCKS;
+	w.ops = NUM_OPS;
+	w.byte_writes = 1;
+	do_ops(&w);
+	close_channel(w.io, (flags & IO_FLAG_THREADS) ? "threads" : "serial",
+		      options);
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Several threads at once, each changing only its own part of the
+ * file, so that the shadow copy stays exact.  write_byte is left out,
+ * since it would drop the blocks the other threads are reading.
+ */
+static void run_threads(const char *options, unsigned int seed)
+{
+	static struct worker w[NUM_THREADS];
+	pthread_t	thread[NUM_THREADS];
+	io_channel	io;
+	int		i, per_thread;
+
+	io = open_channel(IO_FLAG_THREADS, options);
+	per_thread = (NUM_BLOCKS - SHARED_BLOCKS) / NUM_THREADS;
+	for (i = 0; i < NUM_THREADS; i++) {
+		memset(&w[i], 0, sizeof(w[i]));
+		w[i].io = io;
+		w[i].seed = seed + i;
+		w[i].first = SHARED_BLOCKS + i * per_thread;
+		w[i].blocks = per_thread;
+		w[i].ops = NUM_OPS / NUM_THREADS;
+		if (pthread_create(&thread[i], NULL, do_ops, &w[i]))
+			fail("cannot start a thread", 0);
+	}
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(thread[i], NULL);
+	close_channel(io, "parallel", options);
+}
+#endif
+
+/*
+ * An error handler that does what e2fsck's does: it retries a failed
+ * multi-block read one block at a time, and rewrites a block that
+ * cannot be read.
+ */
+static errcode_t reread_error(io_channel io, unsigned long block,
+			      int count, void *data,
+			      size_t size EXT2FS_ATTR((unused)),
+			      int actual EXT2FS_ATTR((unused)),
+			      errcode_t error EXT2FS_ATTR((unused)))
+{
+	char		*p = data;
+	errcode_t	retval;
+	int		i;
+
+	if (count > 1) {
+		for (i = 0; i < count; i++, block++, p += io->block_size) {
+			retval = io_channel_read_blk64(io, block, 1, p);
+			if (retval)
+				return retval;
+		}
+		return 0;
+	}
+	return io_channel_write_blk64(io, block, 1, data);
+}
+
+/* Reads past the end of the file fail, and the handler fixes them up */
+static void check_read_error(int flags)
+{
+	static unsigned char buf[4 * BLOCK_SIZE];
+	io_channel	io;
+	errcode_t	retval;
+	int		count;
+
+	io = open_channel(flags, "cache_blocks=8");
+	io->read_error = reread_error;
+	for (count = 1; count <= 4; count++) {
+		memset(buf, 0xff, sizeof(buf));
+		retval = io_channel_read_blk64(io, NUM_BLOCKS + 8 * count,
+					       count, buf);
+		if (retval)
+			fail("the read error handler failed", retval);
+		if (buf[0] || memcmp(buf, buf + 1, count * BLOCK_SIZE - 1))
+			fail("a failed read was not zeroed", 0);
+	}
+	retval = io_channel_close(io);
+	if (retval)
+		fail("close", retval);
+}
+
+static void check_options(void)
+{
+	static const char *bad[] = { "cache_blocks", "cache_blocks=4",
+				     "cache_blocks=2000000", "cache_blocks=8x",
+				     0 };
+	io_channel	io;
+	errcode_t	retval;
+	int		i;
+
+	retval = unix_io_manager->open(fn, IO_FLAG_RW, &io);
+	if (retval)
+		fail("open", retval);
+	for (i = 0; bad[i]; i++)
+		if (io_channel_set_options(io, bad[i]) !=
+		    EXT2_ET_INVALID_ARGUMENT)
+			fail("a bad cache_blocks value was accepted", 0);
+	io_channel_close(io);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *options[] = { "cache_blocks=8", 0,
+					 "cache_blocks=64" };
+	unsigned int	seed = argc > 1 ? atoi(argv[1]) : 42;
+	int		i;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(fn);
+	if (fd < 0)
+		fail("cannot create a scratch file", errno);
+
+	/* A deadlock shows up as a failure rather than a hung make check */
+	alarm(300);
+
+	check_options();
+	check_read_error(0);
+	check_read_error(IO_FLAG_THREADS);
+	for (i = 0; i < 3; i++) {
+		run(0, options[i], seed);
+		run(IO_FLAG_THREADS, options[i], seed);
+#ifdef HAVE_PTHREAD_H
+		run_threads(options[i], seed);
+#endif
+	}
+
+	close(fd);
+	unlink(fn);
+	printf("tst_unix_io: OK\n");
+	return 0;
+}
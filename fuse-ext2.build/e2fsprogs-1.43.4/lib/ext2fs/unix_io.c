@@ -2,7 +2,8 @@
  * unix_io.c --- This is the Unix (well, really POSIX) implementation
  *	of the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements a hashed block cache with CLOCK replacement and sorted,
+ * coalesced write-back of dirty blocks.
  *
  * Includes support for Windows NT support under Cygwin.
  *
@@ -67,6 +68,9 @@
 #if HAVE_LINUX_FALLOC_H
 #include <linux/falloc.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #if defined(__linux__) && defined(_IO) && !defined(BLKROGET)
 #define BLKROGET   _IO(0x12, 94) /* Get read-only status (0 = read_write).  */
@@ -87,27 +91,122 @@
 struct unix_cache {
 	char			*buf;
 	unsigned long long	block;
-	int			access_time;
+	struct unix_cache	*next;		/* hash chain */
 	unsigned		dirty:1;
 	unsigned		in_use:1;
+	unsigned		referenced:1;
+	unsigned		in_flight:1;	/* being read, lock dropped */
 };
 
-#define CACHE_SIZE 8
-#define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_SIZE */
-#define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_SIZE */
+#define CACHE_SIZE 32		/* Default; tunable with "cache_blocks=" */
+#define MIN_CACHE_SIZE 8
+#define MAX_CACHE_SIZE (1 << 20)
+#define WRITE_DIRECT_SIZE 4	/* Must be smaller than MIN_CACHE_SIZE */
+#define WRITEBACK_RUN 32	/* Most dirty blocks coalesced per write */
 
 struct unix_private_data {
 	int	magic;
 	int	dev;
 	int	flags;
 	int	align;
-	int	access_time;
 	ext2_loff_t offset;
-	struct unix_cache cache[CACHE_SIZE];
+	int	cache_size;
+	int	hash_mask;
+	int	clock_hand;
+	struct unix_cache *cache;
+	struct unix_cache **hash;
+	struct unix_cache **sorted;	/* scratch space for write-back */
+	void	*writeback;
 	void	*bounce;
+	int	reads_in_flight;
+	int	writes_in_flight;
+	unsigned long write_gen;
+	unsigned long long read_error_block;	/* for testing; 0 if none */
 	struct struct_io_stats io_stats;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t cache_mutex;
+	pthread_cond_t	cache_cond;
+	pthread_mutex_t bounce_mutex;
+	pthread_mutex_t stats_mutex;
+#endif
 };
 
+/*
+ * With IO_FLAG_THREADS the channel may be used by several threads at
+ * once: the cache, the bounce buffer (and the file offset used with
+ * it) and the statistics each get their own lock.
+ *
+ * The cache lock is not held while reading from or writing to the
+ * device, so that cache misses in different threads overlap, and so
+ * that the read and write error handlers may call back into the
+ * channel.  A block being read into the cache is marked in flight;
+ * anyone else who wants it waits on cache_cond until it is done.
+ * Writes bump write_gen, and a read which raced with a write does not
+ * leave what it read in the cache.
+ */
+typedef enum lock_kind {
+	CACHE_MTX, BOUNCE_MTX, STATS_MTX
+} kind_t;
+
+#ifdef HAVE_PTHREAD_H
+static inline pthread_mutex_t *get_mutex(struct unix_private_data *data,
+					 kind_t kind)
+{
+	if (!(data->flags & IO_FLAG_THREADS))
+		return NULL;
+	switch (kind) {
+	case CACHE_MTX:
+		return &data->cache_mutex;
+	case BOUNCE_MTX:
+		return &data->bounce_mutex;
+	case STATS_MTX:
+		return &data->stats_mutex;
+	}
+	return NULL;
+}
+#endif
+
+static inline void mutex_lock(struct unix_private_data *data, kind_t kind)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t *mtx = get_mutex(data, kind);
+
+	if (mtx)
+		pthread_mutex_lock(mtx);
+#endif
+}
+
+static inline void mutex_unlock(struct unix_private_data *data, kind_t kind)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t *mtx = get_mutex(data, kind);
+
+	if (mtx)
+		pthread_mutex_unlock(mtx);
+#endif
+}
+
+/*
+ * Wait for a read in flight to finish; called with the cache lock
+ * held.  Without IO_FLAG_THREADS nothing is ever in flight while the
+ * cache is being looked at, so there is nothing to wait for.
+ */
+static inline void cache_wait(struct unix_private_data *data)
+{
+#ifdef HAVE_PTHREAD_H
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_cond_wait(&data->cache_cond, &data->cache_mutex);
+#endif
+}
+
+static inline void cache_wake(struct unix_private_data *data)
+{
+#ifdef HAVE_PTHREAD_H
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_cond_broadcast(&data->cache_cond);
+#endif
+}
+
 #define IS_ALIGNED(n, align) ((((uintptr_t) n) & \
 			       ((uintptr_t) ((align)-1))) == 0)
 
@@ -151,12 +250,31 @@ static char *safe_getenv(const char *arg)
 }
 
 /*
- * Here are the raw I/O functions
+ * For testing the error handlers, UNIX_IO_READ_ERROR_BLOCK makes reads
+ * of one block fail until the block is written, as a disk which remaps
+ * a bad sector on write would.  Called with STATS_MTX held.
+ */
+static int hits_read_error_block(io_channel channel,
+				 struct unix_private_data *data,
+				 unsigned long long block, ssize_t size)
+{
+	return (data->read_error_block && block <= data->read_error_block &&
+		data->read_error_block < block + (size + channel->block_size -
+						  1) / channel->block_size);
+}
+
+/*
+ * Here are the raw I/O functions.  They do not call the channel's
+ * error handlers, since they may be called with the cache lock held;
+ * the callers do that through read_error() and write_error() once it
+ * is safe for the handler to use the channel.  On a failed read the
+ * part of the buffer which could not be read is zeroed, and *actualp
+ * is set to the number of bytes which were.
  */
 static errcode_t raw_read_blk(io_channel channel,
 			      struct unix_private_data *data,
 			      unsigned long long block,
-			      int count, void *bufv)
+			      int count, void *bufv, int *actualp)
 {
 	errcode_t	retval;
 	ssize_t		size;
@@ -166,10 +284,20 @@ static errcode_t raw_read_blk(io_channel channel,
 	ssize_t		really_read = 0;
 
 	size = (count < 0) ? -count : count * channel->block_size;
+	mutex_lock(data, STATS_MTX);
 	data->io_stats.bytes_read += size;
+	retval = hits_read_error_block(channel, data, block, size) ? EIO : 0;
+	mutex_unlock(data, STATS_MTX);
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
 
+	if (retval) {
+		memset(buf, 0, size);
+		*actualp = 0;
+		return retval;
+	}
+
 	if (data->flags & IO_FLAG_FORCE_BOUNCE) {
+		mutex_lock(data, BOUNCE_MTX);
 		if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 			retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 			goto error_out;
@@ -198,6 +326,8 @@ static errcode_t raw_read_blk(io_channel channel,
 	}
 #endif /* HAVE_PREAD */
 
+	/* The rest shares the file offset and the bounce buffer */
+	mutex_lock(data, BOUNCE_MTX);
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -215,6 +345,7 @@ static errcode_t raw_read_blk(io_channel channel,
 				retval = EXT2_ET_SHORT_READ;
 			goto error_out;
 		}
+		mutex_unlock(data, BOUNCE_MTX);
 		return 0;
 	}
 
@@ -244,20 +375,31 @@ bounce_read:
 		size -= actual;
 		buf += actual;
 	}
+	mutex_unlock(data, BOUNCE_MTX);
 	return 0;
 
 error_out:
+	mutex_unlock(data, BOUNCE_MTX);
 	memset((char *) buf+actual, 0, size-actual);
-	if (channel->read_error)
-		retval = (channel->read_error)(channel, block, count, buf,
-					       size, actual, retval);
+	*actualp = actual;
 	return retval;
 }
 
+static errcode_t read_error(io_channel channel, unsigned long long block,
+			    int count, void *buf, int actual, errcode_t error)
+{
+	size_t	size = (count < 0) ? -count : count * channel->block_size;
+
+	if (!channel->read_error)
+		return error;
+	return (channel->read_error)(channel, block, count, buf, size,
+				     actual, error);
+}
+
 static errcode_t raw_write_blk(io_channel channel,
 			       struct unix_private_data *data,
 			       unsigned long long block,
-			       int count, const void *bufv)
+			       int count, const void *bufv, int *actualp)
 {
 	ssize_t		size;
 	ext2_loff_t	location;
@@ -273,11 +415,16 @@ static errcode_t raw_write_blk(io_channel channel,
 		else
 			size = count * channel->block_size;
 	}
+	mutex_lock(data, STATS_MTX);
 	data->io_stats.bytes_written += size;
+	if (hits_read_error_block(channel, data, block, size))
+		data->read_error_block = 0;
+	mutex_unlock(data, STATS_MTX);
 
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
 
 	if (data->flags & IO_FLAG_FORCE_BOUNCE) {
+		mutex_lock(data, BOUNCE_MTX);
 		if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 			retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 			goto error_out;
@@ -306,6 +453,8 @@ static errcode_t raw_write_blk(io_channel channel,
 	}
 #endif /* HAVE_PWRITE */
 
+	/* The rest shares the file offset and the bounce buffer */
+	mutex_lock(data, BOUNCE_MTX);
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -324,6 +473,7 @@ static errcode_t raw_write_blk(io_channel channel,
 			retval = EXT2_ET_SHORT_WRITE;
 			goto error_out;
 		}
+		mutex_unlock(data, BOUNCE_MTX);
 		return 0;
 	}
 
@@ -368,15 +518,27 @@ bounce_write:
 		buf += actual;
 		location += actual;
 	}
+	mutex_unlock(data, BOUNCE_MTX);
 	return 0;
 
 error_out:
-	if (channel->write_error)
-		retval = (channel->write_error)(channel, block, count, buf,
-						size, actual, retval);
+	mutex_unlock(data, BOUNCE_MTX);
+	*actualp = actual;
 	return retval;
 }
 
+static errcode_t write_error(io_channel channel, unsigned long long block,
+			     int count, const void *buf, int actual,
+			     errcode_t error)
+{
+	size_t	size = (count < 0) ? -count : count * channel->block_size;
+
+	if (!channel->write_error)
+		return error;
+	return (channel->write_error)(channel, block, count, buf, size,
+				      actual, error);
+}
+
 
 /*
  * Here we implement the cache functions
@@ -388,20 +550,33 @@ static errcode_t alloc_cache(io_channel channel,
 {
 	errcode_t		retval;
 	struct unix_cache	*cache;
-	int			i;
+	int			i, hash_size;
+
+	for (hash_size = 1; hash_size < data->cache_size; hash_size <<= 1)
+		;
+	retval = ext2fs_get_arrayzero(data->cache_size,
+				      sizeof(struct unix_cache), &data->cache);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_arrayzero(hash_size, sizeof(struct unix_cache *),
+				      &data->hash);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(data->cache_size,
+				  sizeof(struct unix_cache *), &data->sorted);
+	if (retval)
+		return retval;
+	data->hash_mask = hash_size - 1;
+	data->clock_hand = 0;
 
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
 		retval = io_channel_alloc_buf(channel, 0, &cache->buf);
 		if (retval)
 			return retval;
 	}
+	retval = io_channel_alloc_buf(channel, WRITEBACK_RUN, &data->writeback);
+	if (retval)
+		return retval;
 	if (channel->align || data->flags & IO_FLAG_FORCE_BOUNCE) {
 		if (data->bounce)
 			ext2fs_free_mem(&data->bounce);
@@ -416,69 +591,98 @@ static void free_cache(struct unix_private_data *data)
 	struct unix_cache	*cache;
 	int			i;
 
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
+	if (data->cache) {
+		for (i=0, cache = data->cache; i < data->cache_size;
+		     i++, cache++)
+			if (cache->buf)
+				ext2fs_free_mem(&cache->buf);
+		ext2fs_free_mem(&data->cache);
 	}
+	if (data->hash)
+		ext2fs_free_mem(&data->hash);
+	if (data->sorted)
+		ext2fs_free_mem(&data->sorted);
+	if (data->writeback)
+		ext2fs_free_mem(&data->writeback);
 	if (data->bounce)
 		ext2fs_free_mem(&data->bounce);
 }
 
 #ifndef NO_IO_CACHE
+static inline struct unix_cache **cache_bucket(struct unix_private_data *data,
+					       unsigned long long block)
+{
+	return &data->hash[(unsigned) ((block * 0x9E3779B97F4A7C15ULL) >> 32) &
+			   data->hash_mask];
+}
+
+static void unhash_cache(struct unix_private_data *data,
+			 struct unix_cache *cache)
+{
+	struct unix_cache	**p;
+
+	for (p = cache_bucket(data, cache->block); *p; p = &(*p)->next) {
+		if (*p == cache) {
+			*p = cache->next;
+			break;
+		}
+	}
+	cache->next = 0;
+	cache->in_use = 0;
+	cache->referenced = 0;
+}
+
 /*
- * Try to find a block in the cache.  If the block is not found, and
- * eldest is a non-zero pointer, then fill in eldest with the cache
- * entry to that should be reused.
+ * Try to find a block in the cache.
  */
 static struct unix_cache *find_cached_block(struct unix_private_data *data,
-					    unsigned long long block,
-					    struct unix_cache **eldest)
+					    unsigned long long block)
 {
-	struct unix_cache	*cache, *unused_cache, *oldest_cache;
-	int			i;
+	struct unix_cache	*cache;
 
-	unused_cache = oldest_cache = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use) {
-			if (!unused_cache)
-				unused_cache = cache;
-			continue;
-		}
+	for (cache = *cache_bucket(data, block); cache; cache = cache->next) {
 		if (cache->block == block) {
-			cache->access_time = ++data->access_time;
+			cache->referenced = 1;
 			return cache;
 		}
-		if (!oldest_cache ||
-		    (cache->access_time < oldest_cache->access_time))
-			oldest_cache = cache;
 	}
-	if (eldest)
-		*eldest = (unused_cache) ? unused_cache : oldest_cache;
 	return 0;
 }
 
 /*
- * Reuse a particular cache entry for another block.
+ * Like find_cached_block(), but waits for a block which is still
+ * being read, so that the entry returned can be used.
  */
-static void reuse_cache(io_channel channel, struct unix_private_data *data,
-		 struct unix_cache *cache, unsigned long long block)
+static struct unix_cache *lookup_cached_block(struct unix_private_data *data,
+					      unsigned long long block)
 {
-	if (cache->dirty && cache->in_use)
-		raw_write_blk(channel, data, cache->block, 1, cache->buf);
+	struct unix_cache	*cache;
 
-	cache->in_use = 1;
-	cache->dirty = 0;
-	cache->block = block;
-	cache->access_time = ++data->access_time;
+	while ((cache = find_cached_block(data, block)) && cache->in_flight)
+		cache_wait(data);
+	return cache;
+}
+
+/* Wait until no reads are in flight, before the cache is freed */
+static void wait_for_reads(struct unix_private_data *data)
+{
+	while (data->reads_in_flight)
+		cache_wait(data);
+}
+
+static int compare_cache_block(const void *a, const void *b)
+{
+	const struct unix_cache *ca = *(const struct unix_cache * const *) a;
+	const struct unix_cache *cb = *(const struct unix_cache * const *) b;
+
+	if (ca->block < cb->block)
+		return -1;
+	return ca->block > cb->block;
 }
 
 /*
- * Flush all of the blocks in the cache
+ * Flush all of the blocks in the cache.  Dirty blocks are written in
+ * block order, and runs of consecutive blocks go out as a single write.
  */
 static errcode_t flush_cached_blocks(io_channel channel,
 				     struct unix_private_data *data,
@@ -487,28 +691,167 @@ static errcode_t flush_cached_blocks(io_channel channel,
 {
 	struct unix_cache	*cache;
 	errcode_t		retval, retval2;
-	int			i;
+	char			*cp;
+	int			i, j, n, run, actual;
 
 	retval2 = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use)
-			continue;
-
-		if (invalidate)
-			cache->in_use = 0;
-
-		if (!cache->dirty)
+	for (i=0, n=0, cache = data->cache; i < data->cache_size;
+	     i++, cache++)
+		if (cache->in_use && cache->dirty)
+			data->sorted[n++] = cache;
+	if (n > 1)
+		qsort(data->sorted, n, sizeof(struct unix_cache *),
+		      compare_cache_block);
+
+	for (i=0; i < n; i += run) {
+		for (run = 1; i + run < n && run < WRITEBACK_RUN; run++)
+			if (data->sorted[i+run]->block !=
+			    data->sorted[i]->block + run)
+				break;
+		if (run == 1)
+			cp = data->sorted[i]->buf;
+		else {
+			cp = data->writeback;
+			for (j=0; j < run; j++)
+				memcpy(cp + j * channel->block_size,
+				       data->sorted[i+j]->buf,
+				       channel->block_size);
+		}
+		retval = raw_write_blk(channel, data, data->sorted[i]->block,
+				       run, cp, &actual);
+		if (retval && run > 1) {
+			/*
+			 * Find out which blocks of the run failed, so
+			 * that the error handler is only ever asked about
+			 * a single block.  It runs with the cache lock
+			 * held, so it must not use the channel.
+			 */
+			for (j=0; j < run; j++) {
+				cache = data->sorted[i+j];
+				retval = raw_write_blk(channel, data,
+						       cache->block, 1,
+						       cache->buf, &actual);
+				if (retval)
+					retval = write_error(channel,
+							     cache->block, 1,
+							     cache->buf,
+							     actual, retval);
+				if (retval)
+					retval2 = retval;
+				else
+					cache->dirty = 0;
+			}
 			continue;
-
-		retval = raw_write_blk(channel, data,
-				       cache->block, 1, cache->buf);
+		}
 		if (retval)
+			retval = write_error(channel, data->sorted[i]->block,
+					     1, cp, actual, retval);
+		if (retval) {
 			retval2 = retval;
-		else
-			cache->dirty = 0;
+			continue;
+		}
+		for (j=0; j < run; j++)
+			data->sorted[i+j]->dirty = 0;
+	}
+
+	/* Blocks still being read are dropped when the read finishes */
+	if (invalidate) {
+		data->write_gen++;
+		for (i=0, cache = data->cache; i < data->cache_size;
+		     i++, cache++)
+			if (cache->in_use && !cache->in_flight)
+				unhash_cache(data, cache);
 	}
 	return retval2;
 }
+
+/*
+ * Drop any cached copies of blocks which are about to be overwritten
+ * behind the cache's back.  The caller must have flushed them first.
+ * Blocks still being read are left alone; since this bumps write_gen,
+ * their readers drop them when they are done.
+ */
+static void invalidate_cached_range(struct unix_private_data *data,
+				    unsigned long long block,
+				    unsigned long long blocks)
+{
+	struct unix_cache	*cache;
+	int			i;
+
+	data->write_gen++;
+	if (blocks < (unsigned long long) data->cache_size) {
+		for (; blocks > 0; blocks--, block++)
+			if ((cache = find_cached_block(data, block)) &&
+			    !cache->in_flight)
+				unhash_cache(data, cache);
+		return;
+	}
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++)
+		if (cache->in_use && !cache->in_flight &&
+		    cache->block >= block && cache->block - block < blocks)
+			unhash_cache(data, cache);
+}
+
+/*
+ * Writes to the device made without the cache lock are bracketed by
+ * these, so that a cache miss read at the same time is not kept.
+ */
+static void begin_write(struct unix_private_data *data)
+{
+	data->write_gen++;
+	data->writes_in_flight++;
+}
+
+static void end_write(struct unix_private_data *data)
+{
+	data->write_gen++;
+	data->writes_in_flight--;
+}
+
+/*
+ * Pick a cache entry for a new block using the CLOCK algorithm: the
+ * hand skips (and clears) recently referenced entries and stops at the
+ * first one that has not been used since the last sweep.  Evicting a
+ * dirty block writes back every dirty block in one sorted batch.
+ * Entries being read are skipped; if every entry is being read, this
+ * returns NULL and the caller has to do without the cache.
+ */
+static struct unix_cache *reuse_cache(io_channel channel,
+				      struct unix_private_data *data,
+				      unsigned long long block)
+{
+	struct unix_cache	*cache;
+	int			tries;
+
+	for (tries = 0; ; tries++) {
+		if (tries >= 2 * data->cache_size)
+			return NULL;
+		cache = &data->cache[data->clock_hand];
+		if (++data->clock_hand >= data->cache_size)
+			data->clock_hand = 0;
+		if (!cache->in_use)
+			break;
+		if (cache->in_flight)
+			continue;
+		if (cache->referenced) {
+			cache->referenced = 0;
+			continue;
+		}
+		if (cache->dirty)
+			flush_cached_blocks(channel, data, 0);
+		unhash_cache(data, cache);
+		data->io_stats.cache_evictions++;
+		break;
+	}
+
+	cache->in_use = 1;
+	cache->dirty = 0;
+	cache->referenced = 0;
+	cache->block = block;
+	cache->next = *cache_bucket(data, block);
+	*cache_bucket(data, block) = cache;
+	return cache;
+}
 #endif /* NO_IO_CACHE */
 
 #ifdef __linux__
@@ -558,6 +901,7 @@ static errcode_t unix_open_channel(const char *name, int fd,
 	struct unix_private_data *data = NULL;
 	errcode_t	retval;
 	ext2fs_struct_stat st;
+	char		*value;
 #ifdef __linux__
 	struct		utsname ut;
 #endif
@@ -588,10 +932,22 @@ static errcode_t unix_open_channel(const char *name, int fd,
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
-	data->io_stats.num_fields = 2;
+	data->io_stats.num_fields = 5;
+	data->cache_size = CACHE_SIZE;
 	data->flags = flags;
 	data->dev = fd;
 
+	if ((value = safe_getenv("UNIX_IO_READ_ERROR_BLOCK")) != NULL)
+		data->read_error_block = strtoull(value, NULL, 0);
+#ifdef HAVE_PTHREAD_H
+	if (flags & IO_FLAG_THREADS) {
+		pthread_mutex_init(&data->cache_mutex, NULL);
+		pthread_cond_init(&data->cache_cond, NULL);
+		pthread_mutex_init(&data->bounce_mutex, NULL);
+		pthread_mutex_init(&data->stats_mutex, NULL);
+	}
+#endif
+
 #if defined(O_DIRECT)
 	if (flags & IO_FLAG_DIRECT_IO)
 		io->align = ext2fs_get_dio_alignment(data->dev);
@@ -782,6 +1138,14 @@ static errcode_t unix_close(io_channel channel)
 	if (close(data->dev) < 0)
 		retval = errno;
 	free_cache(data);
+#ifdef HAVE_PTHREAD_H
+	if (data->flags & IO_FLAG_THREADS) {
+		pthread_mutex_destroy(&data->cache_mutex);
+		pthread_cond_destroy(&data->cache_cond);
+		pthread_mutex_destroy(&data->bounce_mutex);
+		pthread_mutex_destroy(&data->stats_mutex);
+	}
+#endif
 
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
@@ -793,56 +1157,73 @@ static errcode_t unix_close(io_channel channel)
 static errcode_t unix_set_blksize(io_channel channel, int blksize)
 {
 	struct unix_private_data *data;
-	errcode_t		retval;
+	errcode_t		retval = 0;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	mutex_lock(data, CACHE_MTX);
 	if (channel->block_size != blksize) {
 #ifndef NO_IO_CACHE
+		wait_for_reads(data);
 		if ((retval = flush_cached_blocks(channel, data, 0)))
-			return retval;
+			goto out;
 #endif
 
 		channel->block_size = blksize;
 		free_cache(data);
-		if ((retval = alloc_cache(channel, data)))
-			return retval;
+		retval = alloc_cache(channel, data);
 	}
-	return 0;
+out:
+	mutex_unlock(data, CACHE_MTX);
+	return retval;
 }
 
 static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			       int count, void *buf)
 {
 	struct unix_private_data *data;
-	struct unix_cache *cache, *reuse[READ_DIRECT_SIZE];
+	struct unix_cache *cache;
 	errcode_t	retval;
 	char		*cp;
-	int		i, j;
+	int		i, j, actual, stable;
+	unsigned long	gen;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 #ifdef NO_IO_CACHE
-	return raw_read_blk(channel, data, block, count, buf);
+	retval = raw_read_blk(channel, data, block, count, buf, &actual);
+	if (retval)
+		retval = read_error(channel, block, count, buf, actual, retval);
+	return retval;
 #else
 	/*
 	 * If we're doing an odd-sized read or a very large read,
 	 * flush out the cache and then do a direct read.
 	 */
 	if (count < 0 || count > WRITE_DIRECT_SIZE) {
-		if ((retval = flush_cached_blocks(channel, data, 0)))
+		mutex_lock(data, CACHE_MTX);
+		retval = flush_cached_blocks(channel, data, 0);
+		mutex_unlock(data, CACHE_MTX);
+		if (retval)
 			return retval;
-		return raw_read_blk(channel, data, block, count, buf);
+		retval = raw_read_blk(channel, data, block, count, buf,
+				      &actual);
+		if (retval)
+			retval = read_error(channel, block, count, buf,
+					    actual, retval);
+		return retval;
 	}
 
 	cp = buf;
+	mutex_lock(data, CACHE_MTX);
 	while (count > 0) {
 		/* If it's in the cache, use it! */
-		if ((cache = find_cached_block(data, block, &reuse[0]))) {
+		if ((cache = lookup_cached_block(data, block))) {
+			data->io_stats.cache_hits++;
 #ifdef DEBUG
 			printf("Using cached block %lu\n", block);
 #endif
@@ -852,20 +1233,35 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			cp += channel->block_size;
 			continue;
 		}
-		if (count == 1) {
+		/*
+		 * Whatever is read from here on is only kept if no write
+		 * got in while the cache lock was dropped.
+		 */
+		gen = data->write_gen;
+		stable = (data->writes_in_flight == 0);
+		if (count == 1 && (cache = reuse_cache(channel, data, block))) {
 			/*
 			 * Special case where we read directly into the
 			 * cache buffer; important in the O_DIRECT case
 			 */
-			cache = reuse[0];
-			reuse_cache(channel, data, cache, block);
-			if ((retval = raw_read_blk(channel, data, block, 1,
-						   cache->buf))) {
-				cache->in_use = 0;
-				return retval;
-			}
+			data->io_stats.cache_misses++;
+			cache->in_flight = 1;
+			data->reads_in_flight++;
+			mutex_unlock(data, CACHE_MTX);
+			retval = raw_read_blk(channel, data, block, 1,
+					      cache->buf, &actual);
+			mutex_lock(data, CACHE_MTX);
 			memcpy(cp, cache->buf, channel->block_size);
-			return 0;
+			cache->in_flight = 0;
+			data->reads_in_flight--;
+			if (retval || !stable || gen != data->write_gen)
+				unhash_cache(data, cache);
+			cache_wake(data);
+			mutex_unlock(data, CACHE_MTX);
+			if (retval)
+				retval = read_error(channel, block, 1, cp,
+						    actual, retval);
+			return retval;
 		}
 
 		/*
@@ -873,24 +1269,37 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 		 * single read request
 		 */
 		for (i=1; i < count; i++)
-			if (find_cached_block(data, block+i, &reuse[i]))
+			if (find_cached_block(data, block+i))
 				break;
+		data->io_stats.cache_misses += i;
 #ifdef DEBUG
 		printf("Reading %d blocks starting at %lu\n", i, block);
 #endif
-		if ((retval = raw_read_blk(channel, data, block, i, cp)))
-			return retval;
+		mutex_unlock(data, CACHE_MTX);
+		retval = raw_read_blk(channel, data, block, i, cp, &actual);
+		if (retval)
+			retval = read_error(channel, block, i, cp, actual,
+					    retval);
+		mutex_lock(data, CACHE_MTX);
+		if (retval)
+			goto out;
 
 		/* Save the results in the cache */
+		if (!stable || gen != data->write_gen)
+			stable = 0;
 		for (j=0; j < i; j++) {
+			if (stable && !find_cached_block(data, block) &&
+			    (cache = reuse_cache(channel, data, block)))
+				memcpy(cache->buf, cp, channel->block_size);
 			count--;
-			cache = reuse[j];
-			reuse_cache(channel, data, cache, block++);
-			memcpy(cache->buf, cp, channel->block_size);
+			block++;
 			cp += channel->block_size;
 		}
 	}
-	return 0;
+	retval = 0;
+out:
+	mutex_unlock(data, CACHE_MTX);
+	return retval;
 #endif /* NO_IO_CACHE */
 }
 
@@ -904,26 +1313,44 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 				int count, const void *buf)
 {
 	struct unix_private_data *data;
-	struct unix_cache *cache, *reuse;
+	struct unix_cache *cache;
 	errcode_t	retval = 0;
 	const char	*cp;
-	int		writethrough;
+	int		writethrough, actual;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 #ifdef NO_IO_CACHE
-	return raw_write_blk(channel, data, block, count, buf);
+	retval = raw_write_blk(channel, data, block, count, buf, &actual);
+	if (retval)
+		retval = write_error(channel, block, count, buf, actual,
+				     retval);
+	return retval;
 #else
 	/*
 	 * If we're doing an odd-sized write or a very large write,
-	 * flush out the cache completely and then do a direct write.
+	 * write back the cache, drop any stale copies of the blocks
+	 * being overwritten, and then do a direct write.
 	 */
+	mutex_lock(data, CACHE_MTX);
 	if (count < 0 || count > WRITE_DIRECT_SIZE) {
-		if ((retval = flush_cached_blocks(channel, data, 1)))
-			return retval;
-		return raw_write_blk(channel, data, block, count, buf);
+		if ((retval = flush_cached_blocks(channel, data, 0)))
+			goto out;
+		invalidate_cached_range(data, block, (count < 0) ?
+			(-count + channel->block_size - 1) /
+			channel->block_size : count);
+		begin_write(data);
+		mutex_unlock(data, CACHE_MTX);
+		retval = raw_write_blk(channel, data, block, count, buf,
+				       &actual);
+		if (retval)
+			retval = write_error(channel, block, count, buf,
+					     actual, retval);
+		mutex_lock(data, CACHE_MTX);
+		end_write(data);
+		goto out;
 	}
 
 	/*
@@ -931,16 +1358,29 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 	 * if we're in write-through cache mode, and then fill the
 	 * cache with the blocks.
 	 */
+	data->write_gen++;
 	writethrough = channel->flags & CHANNEL_FLAGS_WRITETHROUGH;
-	if (writethrough)
-		retval = raw_write_blk(channel, data, block, count, buf);
+	if (writethrough) {
+		begin_write(data);
+		mutex_unlock(data, CACHE_MTX);
+		retval = raw_write_blk(channel, data, block, count, buf,
+				       &actual);
+		if (retval)
+			retval = write_error(channel, block, count, buf,
+					     actual, retval);
+		mutex_lock(data, CACHE_MTX);
+		end_write(data);
+	}
 
 	cp = buf;
 	while (count > 0) {
-		cache = find_cached_block(data, block, &reuse);
+		cache = lookup_cached_block(data, block);
+		if (!cache)
+			cache = reuse_cache(channel, data, block);
 		if (!cache) {
-			cache = reuse;
-			reuse_cache(channel, data, cache, block);
+			/* Every entry is being read; wait for one */
+			cache_wait(data);
+			continue;
 		}
 		if (cache->buf != cp)
 			memcpy(cache->buf, cp, channel->block_size);
@@ -949,6 +1389,8 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 		block++;
 		cp += channel->block_size;
 	}
+out:
+	mutex_unlock(data, CACHE_MTX);
 	return retval;
 #endif /* NO_IO_CACHE */
 }
@@ -995,24 +1437,29 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 		return EXT2_ET_UNIMPLEMENTED;
 	}
 
+	mutex_lock(data, CACHE_MTX);
 #ifndef NO_IO_CACHE
 	/*
 	 * Flush out the cache completely
 	 */
-	if ((retval = flush_cached_blocks(channel, data, 1)))
-		return retval;
+	retval = flush_cached_blocks(channel, data, 1);
 #endif
 
-	if (lseek(data->dev, offset + data->offset, SEEK_SET) < 0)
-		return errno;
-
-	actual = write(data->dev, buf, size);
-	if (actual < 0)
-		return errno;
-	if (actual != size)
-		return EXT2_ET_SHORT_WRITE;
-
-	return 0;
+	if (!retval) {
+		mutex_lock(data, BOUNCE_MTX);
+		if (lseek(data->dev, offset + data->offset, SEEK_SET) < 0)
+			retval = errno;
+		else {
+			actual = write(data->dev, buf, size);
+			if (actual < 0)
+				retval = errno;
+			else if (actual != size)
+				retval = EXT2_ET_SHORT_WRITE;
+		}
+		mutex_unlock(data, BOUNCE_MTX);
+	}
+	mutex_unlock(data, CACHE_MTX);
+	return retval;
 }
 
 /*
@@ -1028,7 +1475,9 @@ static errcode_t unix_flush(io_channel channel)
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 #ifndef NO_IO_CACHE
+	mutex_lock(data, CACHE_MTX);
 	retval = flush_cached_blocks(channel, data, 0);
+	mutex_unlock(data, CACHE_MTX);
 #endif
 	if (!retval && fsync(data->dev) != 0)
 		return errno;
@@ -1040,6 +1489,7 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 {
 	struct unix_private_data *data;
 	unsigned long long tmp;
+	errcode_t retval;
 	char *end;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
@@ -1058,6 +1508,27 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 			return EXT2_ET_INVALID_ARGUMENT;
 		return 0;
 	}
+	if (!strcmp(option, "cache_blocks")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		tmp = strtoull(arg, &end, 0);
+		if (*end || tmp < MIN_CACHE_SIZE || tmp > MAX_CACHE_SIZE)
+			return EXT2_ET_INVALID_ARGUMENT;
+		mutex_lock(data, CACHE_MTX);
+		retval = 0;
+#ifndef NO_IO_CACHE
+		wait_for_reads(data);
+		retval = flush_cached_blocks(channel, data, 0);
+#endif
+		if (!retval) {
+			free_cache(data);
+			data->cache_size = tmp;
+			retval = alloc_cache(channel, data);
+		}
+		mutex_unlock(data, CACHE_MTX);
+		return retval;
+	}
 	return EXT2_ET_INVALID_ARGUMENT;
 }
 
@@ -1069,12 +1540,25 @@ static errcode_t unix_discard(io_channel channel, unsigned long long block,
 			      unsigned long long count)
 {
 	struct unix_private_data *data;
+	errcode_t	retval;
 	int		ret;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+#ifndef NO_IO_CACHE
+	mutex_lock(data, CACHE_MTX);
+	retval = flush_cached_blocks(channel, data, 0);
+	if (!retval) {
+		invalidate_cached_range(data, block, count);
+		begin_write(data);
+	}
+	mutex_unlock(data, CACHE_MTX);
+	if (retval)
+		return retval;
+#endif
+
 	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE) {
 #ifdef BLKDISCARD
 		__u64 range[2];
@@ -1103,11 +1587,20 @@ static errcode_t unix_discard(io_channel channel, unsigned long long block,
 	if (ret < 0) {
 		if (errno == EOPNOTSUPP)
 			goto unimplemented;
-		return errno;
+		retval = errno;
+		goto out;
 	}
-	return 0;
+	retval = 0;
+	goto out;
 unimplemented:
-	return EXT2_ET_UNIMPLEMENTED;
+	retval = EXT2_ET_UNIMPLEMENTED;
+out:
+#ifndef NO_IO_CACHE
+	mutex_lock(data, CACHE_MTX);
+	end_write(data);
+	mutex_unlock(data, CACHE_MTX);
+#endif
+	return retval;
 }
 
 /* parameters might not be used if OS doesn't support zeroout */
@@ -1117,6 +1610,7 @@ static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
 			      unsigned long long count)
 {
 	struct unix_private_data *data;
+	errcode_t	retval;
 	int		ret;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
@@ -1124,7 +1618,19 @@ static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 	if (safe_getenv("UNIX_IO_NOZEROOUT"))
-		goto unimplemented;
+		return EXT2_ET_UNIMPLEMENTED;
+
+#ifndef NO_IO_CACHE
+	mutex_lock(data, CACHE_MTX);
+	retval = flush_cached_blocks(channel, data, 0);
+	if (!retval) {
+		invalidate_cached_range(data, block, count);
+		begin_write(data);
+	}
+	mutex_unlock(data, CACHE_MTX);
+	if (retval)
+		return retval;
+#endif
 
 	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE) {
 		/* Not implemented until the BLKZEROOUT mess is fixed */
@@ -1133,8 +1639,10 @@ static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
 		/* Regular file, try to use truncate/punch/zero. */
 		struct stat statbuf;
 
-		if (count == 0)
-			return 0;
+		if (count == 0) {
+			retval = 0;
+			goto out;
+		}
 		/*
 		 * If we're trying to zero a range past the end of the file,
 		 * extend the file size, then truncate everything.
@@ -1173,11 +1681,20 @@ err:
 	if (ret < 0) {
 		if (errno == EOPNOTSUPP)
 			goto unimplemented;
-		return errno;
+		retval = errno;
+		goto out;
 	}
-	return 0;
+	retval = 0;
+	goto out;
 unimplemented:
-	return EXT2_ET_UNIMPLEMENTED;
+	retval = EXT2_ET_UNIMPLEMENTED;
+out:
+#ifndef NO_IO_CACHE
+	mutex_lock(data, CACHE_MTX);
+	end_write(data);
+	mutex_unlock(data, CACHE_MTX);
+#endif
+	return retval;
 }
 #pragma GCC diagnostic pop
 
@@ -293,14 +293,29 @@ out:
 #endif /* TRANSLATE_LINUX_ACLS */
 
 /*
- * ext2_file_t contains a struct inode, so we can't leave files open.
- * Use this as a proxy instead.
+ * ext2_file_t contains a struct inode, so we can't leave files open for
+ * writing.  Use this as a proxy instead.  Reads do keep an ext2_file_t
+ * around so that its read window and read-ahead state carry over from one
+ * op_read() to the next; it is thrown away whenever anything has taken the
+ * write lock since it was opened (see fuse2fs_reader()).
  */
 #define FUSE2FS_FILE_MAGIC	(0xEF53DEAFUL)
 struct fuse2fs_file_handle {
 	unsigned long magic;
 	ext2_ino_t ino;
 	int open_flags;
+	pthread_mutex_t read_lock;
+	ext2_file_t read_file;
+	unsigned long read_gen;
+};
+
+/* An error seen by translate_error(), not yet noted in the superblock */
+struct fuse2fs_error {
+	time_t time;
+	ext2_ino_t ino;
+	int line;
+	errcode_t err;
+	const char *func;
 };
 
 /* Main program context */
@@ -308,7 +323,12 @@ struct fuse2fs_file_handle {
 struct fuse2fs {
 	unsigned long magic;
 	ext2_filsys fs;
-	pthread_mutex_t bfl;
+	pthread_rwlock_t lock;
+	int write_locked;
+	unsigned long write_gen;
+	pthread_mutex_t error_lock;
+	unsigned int error_count;
+	struct fuse2fs_error first_error, last_error;
 	char *device;
 	int ro;
 	int debug;
@@ -320,6 +340,41 @@ struct fuse2fs {
 	unsigned int next_generation;
 };
 
+/*
+ * Operations which only look at the filesystem (lookups, stat, reads,
+ * readdir, xattr queries) hold the lock shared, so independent files can
+ * be read in parallel.  Anything that can change metadata or allocate
+ * blocks holds it exclusively.  Underneath, the filesystem is opened with
+ * EXT2_FLAG_THREADS so that the I/O channel's block cache and the inode
+ * cache are safe to use from several readers at once.
+ *
+ * Readers must not change the superblock, so the errors they run into
+ * are only queued up; whoever next drops the exclusive lock writes
+ * them out (see commit_errors()).
+ */
+static void commit_errors(struct fuse2fs *ff);
+
+static inline void fuse2fs_read_lock(struct fuse2fs *ff)
+{
+	pthread_rwlock_rdlock(&ff->lock);
+}
+
+static inline void fuse2fs_write_lock(struct fuse2fs *ff)
+{
+	pthread_rwlock_wrlock(&ff->lock);
+	ff->write_locked = 1;
+}
+
+static inline void fuse2fs_unlock(struct fuse2fs *ff)
+{
+	if (ff->write_locked) {
+		ff->write_locked = 0;
+		ff->write_gen++;
+		commit_errors(ff);
+	}
+	pthread_rwlock_unlock(&ff->lock);
+}
+
 #define FUSE2FS_CHECK_MAGIC(fs, ptr, num) do {if ((ptr)->magic != (num)) \
 	return translate_error((fs), 0, EXT2_ET_MAGIC_EXT2_FILE); \
 } while (0)
@@ -494,11 +549,26 @@ static int update_ctime(ext2_filsys fs, ext2_ino_t ino,
 	return 0;
 }
 
+static int atime_needs_update(struct ext2_inode_large *pinode,
+			      struct timespec *now)
+{
+	struct timespec atime, mtime;
+
+	EXT4_INODE_GET_XTIME(i_atime, &atime, pinode);
+	EXT4_INODE_GET_XTIME(i_mtime, &mtime, pinode);
+	/*
+	 * If atime is newer than mtime and atime hasn't been updated in thirty
+	 * seconds, skip the atime update.  Same idea as Linux "relatime".
+	 */
+	return !(atime.tv_sec >= mtime.tv_sec &&
+		 atime.tv_sec >= now->tv_sec - 30);
+}
+
 static int update_atime(ext2_filsys fs, ext2_ino_t ino)
 {
 	errcode_t err;
-	struct ext2_inode_large inode, *pinode;
-	struct timespec atime, mtime, now;
+	struct ext2_inode_large inode;
+	struct timespec now;
 
 	if (!(fs->flags & EXT2_FLAG_RW))
 		return 0;
@@ -508,15 +578,8 @@ static int update_atime(ext2_filsys fs, ext2_ino_t ino)
 	if (err)
 		return translate_error(fs, ino, err);
 
-	pinode = &inode;
-	EXT4_INODE_GET_XTIME(i_atime, &atime, pinode);
-	EXT4_INODE_GET_XTIME(i_mtime, &mtime, pinode);
 	get_now(&now);
-	/*
-	 * If atime is newer than mtime and atime hasn't been updated in thirty
-	 * seconds, skip the atime update.  Same idea as Linux "relatime".
-	 */
-	if (atime.tv_sec >= mtime.tv_sec && atime.tv_sec >= now.tv_sec - 30)
+	if (!atime_needs_update(&inode, &now))
 		return 0;
 	EXT4_INODE_SET_XTIME(i_atime, &now, &inode);
 
@@ -620,6 +683,37 @@ static int fs_writeable(ext2_filsys fs)
 	return (fs->flags & EXT2_FLAG_RW) && (fs->super->s_error_count == 0);
 }
 
+/*
+ * Readers hold the lock shared and must not write, so they only check
+ * whether the access time is stale; touch_atime() then does the update
+ * under the exclusive lock once the read is finished.
+ */
+static int atime_is_stale(ext2_filsys fs, ext2_ino_t ino)
+{
+	struct ext2_inode_large inode;
+	struct timespec now;
+
+	if (!fs_writeable(fs))
+		return 0;
+	memset(&inode, 0, sizeof(inode));
+	if (ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
+				   sizeof(inode)))
+		return 0;
+	get_now(&now);
+	return atime_needs_update(&inode, &now);
+}
+
+static int touch_atime(struct fuse2fs *ff, ext2_ino_t ino)
+{
+	int ret = 0;
+
+	fuse2fs_write_lock(ff);
+	if (fs_writeable(ff->fs))
+		ret = update_atime(ff->fs, ino);
+	fuse2fs_unlock(ff);
+	return ret;
+}
+
 static int check_inum_access(ext2_filsys fs, ext2_ino_t ino, mode_t mask)
 {
 	struct fuse_context *ctxt = fuse_get_context();
@@ -702,6 +796,7 @@ static void op_destroy(void *p EXT2FS_ATTR((unused)))
 	}
 	fs = ff->fs;
 	dbg_printf("%s: dev=%s\n", __func__, fs->device_name);
+	commit_errors(ff);
 	if (fs->flags & EXT2_FLAG_RW) {
 		fs->super->s_state |= EXT2_VALID_FS;
 		if (fs->super->s_error_count)
@@ -815,7 +910,7 @@ static int op_getattr(const char *path, struct stat *statbuf)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: path=%s\n", __func__, path);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -823,7 +918,7 @@ static int op_getattr(const char *path, struct stat *statbuf)
 	}
 	ret = stat_inode(fs, ino, statbuf);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -837,12 +932,13 @@ static int op_readlink(const char *path, char *buf, size_t len)
 	struct ext2_inode inode;
 	unsigned int got;
 	ext2_file_t file;
+	int stale_atime = 0;
 	int ret = 0;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: path=%s\n", __func__, path);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
@@ -893,14 +989,12 @@ out2:
 		memcpy(buf, (char *)inode.i_block, len);
 	buf[len] = 0;
 
-	if (fs_writeable(fs)) {
-		ret = update_atime(fs, ino);
-		if (ret)
-			goto out;
-	}
+	stale_atime = atime_is_stale(fs, ino);
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
+	if (stale_atime)
+		ret = touch_atime(ff, ino);
 	return ret;
 }
 
@@ -935,7 +1029,7 @@ static int op_mknod(const char *path, mode_t mode, dev_t dev)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_can_allocate(ff, 2)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -1026,7 +1120,7 @@ static int op_mknod(const char *path, mode_t mode, dev_t dev)
 	ext2fs_inode_alloc_stats2(fs, child, 1, 0);
 
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1064,7 +1158,7 @@ static int op_mkdir(const char *path, mode_t mode)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_can_allocate(ff, 1)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -1166,7 +1260,7 @@ static int op_mkdir(const char *path, mode_t mode)
 out3:
 	ext2fs_free_mem(&block);
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1304,9 +1398,9 @@ static int op_unlink(const char *path)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	ret = __op_unlink(ff, path);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -1414,9 +1508,9 @@ static int op_rmdir(const char *path)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	ret = __op_rmdir(ff, path);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -1449,7 +1543,7 @@ static int op_symlink(const char *src, const char *dest)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
 			   &parent);
 	*node_name = a;
@@ -1513,7 +1607,7 @@ static int op_symlink(const char *src, const char *dest)
 		goto out2;
 	}
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1558,7 +1652,7 @@ static int op_rename(const char *from, const char *to)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: renaming %s to %s\n", __func__, from, to);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_can_allocate(ff, 5)) {
 		ret = -ENOSPC;
 		goto out;
@@ -1763,7 +1857,7 @@ out2:
 	free(temp_from);
 	free(temp_to);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -1796,7 +1890,7 @@ static int op_link(const char *src, const char *dest)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_can_allocate(ff, 2)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -1865,7 +1959,7 @@ static int op_link(const char *src, const char *dest)
 		goto out2;
 
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -1883,7 +1977,7 @@ static int op_chmod(const char *path, mode_t mode)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -1926,7 +2020,7 @@ static int op_chmod(const char *path, mode_t mode)
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -1942,7 +2036,7 @@ static int op_chown(const char *path, uid_t owner, gid_t group)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -1993,7 +2087,7 @@ static int op_chown(const char *path, uid_t owner, gid_t group)
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -2009,7 +2103,7 @@ static int op_truncate(const char *path, off_t len)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
@@ -2045,7 +2139,7 @@ out2:
 	ret = update_mtime(fs, ino, NULL);
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return err;
 }
 
@@ -2083,6 +2177,8 @@ static int __op_open(struct fuse2fs *ff, const char *path,
 	if (err)
 		return translate_error(fs, 0, err);
 	file->magic = FUSE2FS_FILE_MAGIC;
+	file->read_file = NULL;
+	file->read_gen = 0;
 
 	file->open_flags = 0;
 	switch (fp->flags & O_ACCMODE) {
@@ -2129,6 +2225,7 @@ static int __op_open(struct fuse2fs *ff, const char *path,
 		} else
 			goto out;
 	}
+	pthread_mutex_init(&file->read_lock, NULL);
 	fp->fh = (uintptr_t)file;
 
 out:
@@ -2144,12 +2241,37 @@ static int op_open(const char *path, struct fuse_file_info *fp)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	ret = __op_open(ff, path, fp);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
+/*
+ * Return the handle's read-only ext2_file_t, reopening it if the
+ * filesystem has been written to since it was opened.  The caller holds
+ * the fuse2fs lock shared and fh->read_lock.
+ */
+static errcode_t fuse2fs_reader(struct fuse2fs *ff,
+				struct fuse2fs_file_handle *fh,
+				ext2_file_t *ret_file)
+{
+	errcode_t err;
+
+	if (fh->read_file && fh->read_gen != ff->write_gen) {
+		ext2fs_file_close(fh->read_file);
+		fh->read_file = NULL;
+	}
+	if (!fh->read_file) {
+		err = ext2fs_file_open(ff->fs, fh->ino, 0, &fh->read_file);
+		if (err)
+			return err;
+		fh->read_gen = ff->write_gen;
+	}
+	*ret_file = fh->read_file;
+	return 0;
+}
+
 static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 		   size_t len, off_t offset,
 		   struct fuse_file_info *fp)
@@ -2162,6 +2284,7 @@ static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 	ext2_file_t efp;
 	errcode_t err;
 	unsigned int got = 0;
+	int stale_atime = 0;
 	int ret = 0;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
@@ -2169,8 +2292,9 @@ static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d off=%jd len=%jd\n", __func__, fh->ino, offset,
 		   len);
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_file_open(fs, fh->ino, fh->open_flags, &efp);
+	fuse2fs_read_lock(ff);
+	pthread_mutex_lock(&fh->read_lock);
+	err = fuse2fs_reader(ff, fh, &efp);
 	if (err) {
 		ret = translate_error(fs, fh->ino, err);
 		goto out;
@@ -2179,31 +2303,21 @@ static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 	err = ext2fs_file_llseek(efp, offset, SEEK_SET, NULL);
 	if (err) {
 		ret = translate_error(fs, fh->ino, err);
-		goto out2;
+		goto out;
 	}
 
 	err = ext2fs_file_read(efp, buf, len, &got);
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
-		goto out2;
-	}
-
-out2:
-	err = ext2fs_file_close(efp);
-	if (ret)
-		goto out;
 	if (err) {
 		ret = translate_error(fs, fh->ino, err);
 		goto out;
 	}
 
-	if (fs_writeable(fs)) {
-		ret = update_atime(fs, fh->ino);
-		if (ret)
-			goto out;
-	}
+	stale_atime = atime_is_stale(fs, fh->ino);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_mutex_unlock(&fh->read_lock);
+	fuse2fs_unlock(ff);
+	if (stale_atime)
+		ret = touch_atime(ff, fh->ino);
 	return got ? (int) got : ret;
 }
 
@@ -2226,7 +2340,7 @@ static int op_write(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d off=%jd len=%jd\n", __func__, fh->ino, offset,
 		   len);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -2276,7 +2390,7 @@ out2:
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return got ? (int) got : ret;
 }
 
@@ -2295,15 +2409,22 @@ static int op_release(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
-	if (fs_writeable(fs) && fh->open_flags & EXT2_FILE_WRITE) {
-		err = ext2fs_flush2(fs, EXT2_FLAG_FLUSH_NO_SYNC);
-		if (err)
-			ret = translate_error(fs, fh->ino, err);
+	/* Read-only handles have nothing to flush */
+	if (fh->open_flags & EXT2_FILE_WRITE) {
+		fuse2fs_write_lock(ff);
+		if (fs_writeable(fs)) {
+			err = ext2fs_flush2(fs, EXT2_FLAG_FLUSH_NO_SYNC);
+			if (err)
+				ret = translate_error(fs, fh->ino, err);
+		}
+		fuse2fs_unlock(ff);
 	}
 	fp->fh = 0;
-	pthread_mutex_unlock(&ff->bfl);
 
+	/* A read-only file has nothing dirty, so this only frees memory */
+	if (fh->read_file)
+		ext2fs_file_close(fh->read_file);
+	pthread_mutex_destroy(&fh->read_lock);
 	ext2fs_free_mem(&fh);
 
 	return ret;
@@ -2326,13 +2447,13 @@ static int op_fsync(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
 	/* For now, flush everything, even if it's slow */
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (fs_writeable(fs) && fh->open_flags & EXT2_FILE_WRITE) {
 		err = ext2fs_flush2(fs, 0);
 		if (err)
 			ret = translate_error(fs, fh->ino, err);
 	}
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -2425,7 +2546,7 @@ static int op_getxattr(const char *path, const char *key, char *value,
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -2487,7 +2608,7 @@ out2:
 	if (err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -2526,7 +2647,7 @@ static int op_listxattr(const char *path, char *names, size_t len)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -2584,7 +2705,7 @@ out2:
 	if (err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -2606,7 +2727,7 @@ static int op_setxattr(const char *path EXT2FS_ATTR((unused)),
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -2669,7 +2790,7 @@ out2:
 	if (!ret && err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -2686,7 +2807,7 @@ static int op_removexattr(const char *path, const char *key)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -2738,7 +2859,7 @@ out2:
 	if (err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -2780,13 +2901,14 @@ static int op_readdir(const char *path EXT2FS_ATTR((unused)),
 	ext2_filsys fs;
 	errcode_t err;
 	struct readdir_iter i;
+	int stale_atime = 0;
 	int ret = 0;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	i.buf = buf;
 	i.func = fill_func;
 	err = ext2fs_dir_iterate2(fs, fh->ino, 0, NULL, op_readdir_iter, &i);
@@ -2795,13 +2917,11 @@ static int op_readdir(const char *path EXT2FS_ATTR((unused)),
 		goto out;
 	}
 
-	if (fs_writeable(fs)) {
-		ret = update_atime(fs, fh->ino);
-		if (ret)
-			goto out;
-	}
+	stale_atime = atime_is_stale(fs, fh->ino);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
+	if (stale_atime)
+		ret = touch_atime(ff, fh->ino);
 	return ret;
 }
 
@@ -2817,7 +2937,7 @@ static int op_access(const char *path, int mask)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf("%s: path=%s mask=0x%x\n", __func__, path, mask);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
@@ -2829,7 +2949,7 @@ static int op_access(const char *path, int mask)
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -2863,7 +2983,7 @@ static int op_create(const char *path, mode_t mode, struct fuse_file_info *fp)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_can_allocate(ff, 1)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -2951,7 +3071,7 @@ static int op_create(const char *path, mode_t mode, struct fuse_file_info *fp)
 	if (ret)
 		goto out2;
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 out:
 	free(temp_path);
 	return ret;
@@ -2973,7 +3093,7 @@ static int op_ftruncate(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d len=%jd\n", __func__, fh->ino, len);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -3005,7 +3125,7 @@ out2:
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return 0;
 }
 
@@ -3024,9 +3144,9 @@ static int op_fgetattr(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf("%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	ret = stat_inode(fs, fh->ino, statbuf);
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -3044,7 +3164,7 @@ static int op_utimens(const char *path, const struct timespec ctv[2])
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -3090,7 +3210,7 @@ static int op_utimens(const char *path, const struct timespec ctv[2])
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -3277,7 +3397,7 @@ static int op_ioctl(const char *path EXT2FS_ATTR((unused)), int cmd,
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	switch ((unsigned long) cmd) {
 #ifdef SUPPORT_I_FLAGS
 	case EXT2_IOC_GETFLAGS:
@@ -3302,7 +3422,7 @@ static int op_ioctl(const char *path EXT2FS_ATTR((unused)), int cmd,
 		dbg_printf("%s: Unknown ioctl %d\n", __func__, cmd);
 		ret = -ENOTTY;
 	}
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -3320,7 +3440,7 @@ static int op_bmap(const char *path, size_t blocksize EXT2FS_ATTR((unused)),
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_read_lock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -3335,7 +3455,7 @@ static int op_bmap(const char *path, size_t blocksize EXT2FS_ATTR((unused)),
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 	return ret;
 }
 
@@ -3559,7 +3679,7 @@ static int op_fallocate(const char *path EXT2FS_ATTR((unused)), int mode,
 	if (mode & ~(FL_PUNCH_HOLE_FLAG | FL_KEEP_SIZE_FLAG))
 		return -EINVAL;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_write_lock(ff);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -3569,7 +3689,7 @@ static int op_fallocate(const char *path EXT2FS_ATTR((unused)), int mode,
 	else
 		ret = fallocate_helper(fp, mode, offset, len);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	fuse2fs_unlock(ff);
 
 	return ret;
 }
@@ -3729,7 +3849,8 @@ int main(int argc, char *argv[])
 	errcode_t err;
 	char *logfile;
 	char extra_args[BUFSIZ];
-	int ret = 0, flags = EXT2_FLAG_64BITS | EXT2_FLAG_EXCLUSIVE;
+	int ret = 0, flags = EXT2_FLAG_64BITS | EXT2_FLAG_EXCLUSIVE |
+			    EXT2_FLAG_THREADS;
 
 	memset(&fctx, 0, sizeof(fctx));
 	fctx.magic = FUSE2FS_MAGIC;
@@ -3784,6 +3905,8 @@ int main(int argc, char *argv[])
 	}
 	fctx.fs = global_fs;
 	global_fs->priv_data = &fctx;
+	pthread_rwlock_init(&fctx.lock, NULL);
+	pthread_mutex_init(&fctx.error_lock, NULL);
 
 	ret = 3;
 	if (ext2fs_has_feature_journal_needs_recovery(global_fs->super)) {
@@ -3863,16 +3986,17 @@ int main(int argc, char *argv[])
 		printf("\n");
 	}
 
-	pthread_mutex_init(&fctx.bfl, NULL);
 	fuse_main(args.argc, args.argv, &fs_ops, &fctx);
-	pthread_mutex_destroy(&fctx.bfl);
 
 	ret = 0;
 out:
+	commit_errors(&fctx);
 	err = ext2fs_close(global_fs);
 	if (err)
 		com_err(argv[0], err, "while closing fs");
 	global_fs = NULL;
+	pthread_rwlock_destroy(&fctx.lock);
+	pthread_mutex_destroy(&fctx.error_lock);
 out_nofs:
 
 	return ret;
@@ -3961,28 +4085,64 @@ no_translation:
 			error_message(err), file, line);
 	fflush(ff->err_fp);
 
-	/* Make a note in the error log */
+	/*
+	 * Queue up a note for the error log.  Readers may get here
+	 * concurrently, so the superblock is left to commit_errors().
+	 */
 	get_now(&now);
-	fs->super->s_last_error_time = now.tv_sec;
-	fs->super->s_last_error_ino = ino;
-	fs->super->s_last_error_line = line;
-	fs->super->s_last_error_block = err; /* Yeah... */
-	strncpy((char *)fs->super->s_last_error_func, file,
+	pthread_mutex_lock(&ff->error_lock);
+	ff->last_error.time = now.tv_sec;
+	ff->last_error.ino = ino;
+	ff->last_error.line = line;
+	ff->last_error.err = err;
+	ff->last_error.func = file;
+	if (ff->error_count++ == 0)
+		ff->first_error = ff->last_error;
+	pthread_mutex_unlock(&ff->error_lock);
+	/* Nobody will look at the superblock after this */
+	if (ff->panic_on_error) {
+		commit_errors(ff);
+		abort();
+	}
+
+	return ret;
+}
+
+/*
+ * Write the errors queued up by translate_error() to the superblock.
+ * This changes and flushes fs->super, so the caller must hold the lock
+ * exclusively (or be the only thread, as in op_destroy()).
+ */
+static void commit_errors(struct fuse2fs *ff)
+{
+	ext2_filsys fs = ff->fs;
+	struct fuse2fs_error *e;
+
+	pthread_mutex_lock(&ff->error_lock);
+	if (!ff->error_count) {
+		pthread_mutex_unlock(&ff->error_lock);
+		return;
+	}
+	e = &ff->last_error;
+	fs->super->s_last_error_time = e->time;
+	fs->super->s_last_error_ino = e->ino;
+	fs->super->s_last_error_line = e->line;
+	fs->super->s_last_error_block = e->err; /* Yeah... */
+	strncpy((char *)fs->super->s_last_error_func, e->func,
 		sizeof(fs->super->s_last_error_func));
 	if (fs->super->s_first_error_time == 0) {
-		fs->super->s_first_error_time = now.tv_sec;
-		fs->super->s_first_error_ino = ino;
-		fs->super->s_first_error_line = line;
-		fs->super->s_first_error_block = err;
-		strncpy((char *)fs->super->s_first_error_func, file,
+		e = &ff->first_error;
+		fs->super->s_first_error_time = e->time;
+		fs->super->s_first_error_ino = e->ino;
+		fs->super->s_first_error_line = e->line;
+		fs->super->s_first_error_block = e->err;
+		strncpy((char *)fs->super->s_first_error_func, e->func,
 			sizeof(fs->super->s_first_error_func));
 	}
 
-	fs->super->s_error_count++;
+	fs->super->s_error_count += ff->error_count;
+	ff->error_count = 0;
+	pthread_mutex_unlock(&ff->error_lock);
 	ext2fs_mark_super_dirty(fs);
 	ext2fs_flush(fs);
-	if (ff->panic_on_error)
-		abort();
-
-	return ret;
 }
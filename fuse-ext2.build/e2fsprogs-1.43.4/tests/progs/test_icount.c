@@ -75,6 +75,10 @@ void do_create_icount(int argc, char **argv)
 		flags |= EXT2_ICOUNT_OPT_INCREMENT;
 		argv++; argc--;
 	}
+	if (argc && !strcmp("-p", *argv)) {
+		flags |= EXT2_ICOUNT_OPT_PAGED;
+		argv++; argc--;
+	}
 	if (argc) {
 		if (parse_inode(progname, "icount size", argv[0], &size))
 			return;
@@ -17,327 +17,3635 @@
 #include <time.h>
 #include <stdio.h>
 #include <errno.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdarg.h>
 
 #include "ext2_fs.h"
 
 #define superblockOffset 1024
 #define groupOffset 1024
-#define ext2BlockSize 1024
+
+// ext4 fields beyond the end of the ext2_fs.h superblock, as byte offsets
+#define superFeatureIncompatOffset 0x60
+#define superFeatureRoCompatOffset 0x64
+#define superUuidOffset 0x68
+#define superReservedGdtBlocksOffset 0xCE
+#define superDescSizeOffset 0xFE
+#define superBlocksCountHiOffset 0x150
+#define superLogGroupsPerFlexOffset 0x174
+#define superChecksumSeedOffset 0x270
+#define superChecksumOffset 0x3FC
+
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED 0x2000
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+
+#define EXT4_EXTENTS_FL 0x00080000
+
+// ext4_group_desc checksum fields
+#define descBlockBitmapCsumLoOffset 0x18
+#define descInodeBitmapCsumLoOffset 0x1A
+#define descChecksumOffset 0x1E
+#define descBlockBitmapCsumHiOffset 0x38
+#define descInodeBitmapCsumHiOffset 0x3A
+#define EXT2_MIN_DESC_SIZE 32
+#define EXT2_MIN_DESC_SIZE_64BIT 64
+
+#define descFlagsOffset 0x12
+#define descItableUnusedLoOffset 0x1C
+#define descItableUnusedHiOffset 0x32
+#define EXT4_BG_INODE_UNINIT 0x0001
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+// high halves of the ext4_group_desc location and count fields
+#define descBlockBitmapHiOffset 0x20
+#define descInodeBitmapHiOffset 0x24
+#define descInodeTableHiOffset 0x28
+#define descFreeBlocksHiOffset 0x2C
+#define descFreeInodesHiOffset 0x2E
+
+// ext2_inode_large checksum fields
+#define inodeGenerationOffset 0x64
+#define inodeChecksumLoOffset 0x7C
+#define inodeExtraIsizeOffset 0x80
+#define inodeChecksumHiOffset 0x82
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+#define EXT4_INODE_CSUM_HI_EXTRA_END 4
 
 struct ext2_super_block superBuffer;
 struct ext2_inode inodeBuffer;
-struct ext2_group_desc *groupBuffer;
+// Group descriptor fields widened to their full ext4 size.
+struct groupInfo
+{
+    uint64_t blockBitmap;
+    uint64_t inodeBitmap;
+    uint64_t inodeTable;
+    uint32_t freeBlocks;
+    uint32_t freeInodes;
+    uint32_t itableUnused;
+    uint16_t flags; // EXT4_BG_*, only meaningful with uninit_bg or metadata_csum
+};
+
+struct groupInfo *groups;
+uint8_t *groupDescRaw; // on-disk descriptors, descSize bytes each
+uint8_t *groupCorrupt; // per group: groupDescBad | blockBitmapBad | inodeBitmapBad
+
+#define groupDescBad 1
+#define blockBitmapBad 2
+#define inodeBitmapBad 4
+
+unsigned int blockSize;
+unsigned int inodeSize;
+unsigned int descSize;
+uint64_t blocksCount;
+uint32_t groupCount;
+uint32_t groupsPerFlex;
+uint32_t inodeTableBlocks;
+uint32_t gdtBlocks;
+int sparseSuper;
+int groupCsum; // uninit_bg or metadata_csum: descriptors carry EXT4_BG_* flags
+
+int metadataCsum;
+uint32_t csumSeed;
+int badCsumFd = -1;
+
+// CRC32C
+
+uint32_t crc32cTable[8][256];
+uint32_t (*crc32c)(uint32_t crc, const uint8_t *buf, size_t len);
+
+// Slice-by-8, the same table-driven scheme as lib/ext2fs/crc32c.c, with the
+// tables generated at startup instead of at build time.
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+        lo ^= crc;
+        crc = crc32cTable[7][lo & 0xFF] ^ crc32cTable[6][(lo >> 8) & 0xFF] ^
+              crc32cTable[5][(lo >> 16) & 0xFF] ^ crc32cTable[4][lo >> 24] ^
+              crc32cTable[3][hi & 0xFF] ^ crc32cTable[2][(hi >> 8) & 0xFF] ^
+              crc32cTable[1][(hi >> 16) & 0xFF] ^ crc32cTable[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
 
-// Superblock Summary
+    while (len--)
+    {
+        crc = crc32cTable[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
 
-void createSuperblockSummary(int fd, const char *path)
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const uint8_t *buf, size_t len)
 {
-    int superblockFd = creat(path, S_IRWXU); // file owner has read, write and execute permissions
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+    while (len--)
+    {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+
+    return crc;
+}
+#endif
+
+void initCrc32c(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            crc32cTable[t][i] = (crc32cTable[t - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][i] & 0xFF];
+        }
+    }
+
+    crc32c = crc32cSoftware;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32c = crc32cHardware;
+    }
+#endif
+}
+
+// Metadata checksums
+
+uint16_t getU16(const void *base, size_t offset)
+{
+    uint16_t value;
+    memcpy(&value, (const uint8_t *)base + offset, sizeof(value));
+    return value;
+}
+
+uint32_t getU32(const void *base, size_t offset)
+{
+    uint32_t value;
+    memcpy(&value, (const uint8_t *)base + offset, sizeof(value));
+    return value;
+}
+
+void reportBadChecksum(const char *kind, uint32_t number)
+{
+    if (badCsumFd >= 0)
+    {
+        dprintf(badCsumFd, "BADCSUM,%s,%u\n", kind, number);
+    }
+}
+
+int verifyGroupDesc(const uint8_t *raw, uint32_t group)
+{
+    if (!metadataCsum)
+        return 1;
+
+    uint8_t zero[2] = {0, 0};
+    uint32_t crc = crc32c(csumSeed, (const uint8_t *)&group, sizeof(group));
+    crc = crc32c(crc, raw, descChecksumOffset);
+    crc = crc32c(crc, zero, sizeof(zero));
+    crc = crc32c(crc, raw + descChecksumOffset + 2, descSize - descChecksumOffset - 2);
+
+    return getU16(raw, descChecksumOffset) == (crc & 0xFFFF);
+}
+
+int verifyBitmap(const uint8_t *rawDesc, const uint8_t *bitmap, size_t size, size_t loOffset, size_t hiOffset)
+{
+    if (!metadataCsum)
+        return 1;
+
+    uint32_t provided = getU16(rawDesc, loOffset);
+    uint32_t calculated = crc32c(csumSeed, bitmap, size);
+    if (descSize >= hiOffset + 2)
+        provided |= (uint32_t)getU16(rawDesc, hiOffset) << 16;
+    else
+        calculated &= 0xFFFF;
+
+    return provided == calculated;
+}
+
+int verifyInode(const uint8_t *raw, uint32_t inodeNum)
+{
+    if (!metadataCsum)
+        return 1;
+
+    int hasHi = inodeSize > EXT2_GOOD_OLD_INODE_SIZE &&
+                getU16(raw, inodeExtraIsizeOffset) >= EXT4_INODE_CSUM_HI_EXTRA_END;
+
+    uint8_t zero[2] = {0, 0};
+    uint32_t generation = getU32(raw, inodeGenerationOffset);
+    uint32_t crc = crc32c(csumSeed, (const uint8_t *)&inodeNum, sizeof(inodeNum));
+    crc = crc32c(crc, (const uint8_t *)&generation, sizeof(generation));
+    crc = crc32c(crc, raw, inodeChecksumLoOffset);
+    crc = crc32c(crc, zero, sizeof(zero));
+    if (hasHi)
+    {
+        crc = crc32c(crc, raw + inodeChecksumLoOffset + 2, inodeChecksumHiOffset - inodeChecksumLoOffset - 2);
+        crc = crc32c(crc, zero, sizeof(zero));
+        crc = crc32c(crc, raw + inodeChecksumHiOffset + 2, inodeSize - inodeChecksumHiOffset - 2);
+    }
+    else
+    {
+        crc = crc32c(crc, raw + inodeChecksumLoOffset + 2, inodeSize - inodeChecksumLoOffset - 2);
+    }
+
+    uint32_t provided = getU16(raw, inodeChecksumLoOffset);
+    if (hasHi)
+        provided |= (uint32_t)getU16(raw, inodeChecksumHiOffset) << 16;
+    else
+        crc &= 0xFFFF;
+
+    return provided == crc;
+}
+
+// Scan kernels
+//
+// The bitmap, inode-table and indirect-block loops are written once as
+// always-inline bodies and instantiated for each common block and inode size,
+// so every instance has a compile-time trip count and stride. selectKernels
+// picks the instances matching the superblock; other geometries fall back to
+// versions that read the sizes at run time.
+
+// Collects the index of every clear bit in a bitmap of the given size.
+static inline __attribute__((always_inline)) size_t freeBitsKernel(const uint8_t *bitmap, unsigned int bytes, uint32_t *out)
+{
+    size_t n = 0;
+    for (unsigned int w = 0; w < bytes / 8; w++)
+    {
+        uint64_t word;
+        memcpy(&word, bitmap + w * 8, sizeof(word));
+        uint64_t clear = ~word;
+        while (clear != 0)
+        {
+            out[n++] = w * 64 + __builtin_ctzll(clear);
+            clear &= clear - 1;
+        }
+    }
+    return n;
+}
+
+// Collects the index of every non-zero block pointer.
+static inline __attribute__((always_inline)) size_t liveIndirectKernel(const uint32_t *block, unsigned int entries, uint32_t *out)
+{
+    size_t n = 0;
+    for (unsigned int i = 0; i < entries; i++)
+    {
+        out[n] = i;
+        n += block[i] != 0;
+    }
+    return n;
+}
+
+// Collects the index of every in-use inode (non-zero mode and link count).
+static inline __attribute__((always_inline)) size_t liveInodesKernel(const uint8_t *table, uint32_t count, unsigned int stride, uint32_t *out)
+{
+    size_t n = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const struct ext2_inode *inode = (const struct ext2_inode *)(table + (size_t)i * stride);
+        out[n] = i;
+        n += inode->i_mode != 0 && inode->i_links_count != 0;
+    }
+    return n;
+}
+
+#define DEFINE_BLOCK_KERNELS(BS)                                         \
+    size_t freeBits##BS(const uint8_t *bitmap, uint32_t *out)            \
+    {                                                                    \
+        return freeBitsKernel(bitmap, BS, out);                          \
+    }                                                                    \
+    size_t liveIndirect##BS(const uint32_t *block, uint32_t *out)        \
+    {                                                                    \
+        return liveIndirectKernel(block, BS / sizeof(uint32_t), out);    \
+    }
+
+#define DEFINE_INODE_KERNEL(IS)                                                 \
+    size_t liveInodes##IS(const uint8_t *table, uint32_t count, uint32_t *out) \
+    {                                                                           \
+        return liveInodesKernel(table, count, IS, out);                         \
+    }
+
+DEFINE_BLOCK_KERNELS(1024)
+DEFINE_BLOCK_KERNELS(2048)
+DEFINE_BLOCK_KERNELS(4096)
+DEFINE_BLOCK_KERNELS(65536)
+
+DEFINE_INODE_KERNEL(128)
+DEFINE_INODE_KERNEL(256)
+
+size_t freeBitsAny(const uint8_t *bitmap, uint32_t *out)
+{
+    return freeBitsKernel(bitmap, blockSize, out);
+}
+
+size_t liveIndirectAny(const uint32_t *block, uint32_t *out)
+{
+    return liveIndirectKernel(block, blockSize / sizeof(uint32_t), out);
+}
+
+size_t liveInodesAny(const uint8_t *table, uint32_t count, uint32_t *out)
+{
+    return liveInodesKernel(table, count, inodeSize, out);
+}
+
+struct blockKernels
+{
+    unsigned int blockSize;
+    size_t (*freeBits)(const uint8_t *bitmap, uint32_t *out);
+    size_t (*liveIndirect)(const uint32_t *block, uint32_t *out);
+};
+
+struct inodeKernels
+{
+    unsigned int inodeSize;
+    size_t (*liveInodes)(const uint8_t *table, uint32_t count, uint32_t *out);
+};
+
+struct blockKernels blockKernelTable[] = {
+    {1024, freeBits1024, liveIndirect1024},
+    {2048, freeBits2048, liveIndirect2048},
+    {4096, freeBits4096, liveIndirect4096},
+    {65536, freeBits65536, liveIndirect65536},
+    {0, freeBitsAny, liveIndirectAny}};
+
+struct inodeKernels inodeKernelTable[] = {
+    {128, liveInodes128},
+    {256, liveInodes256},
+    {0, liveInodesAny}};
+
+struct blockKernels *blockKernel;
+struct inodeKernels *inodeKernel;
+
+void selectKernels(void)
+{
+    blockKernel = blockKernelTable;
+    while (blockKernel->blockSize != 0 && blockKernel->blockSize != blockSize)
+        blockKernel++;
+
+    inodeKernel = inodeKernelTable;
+    while (inodeKernel->inodeSize != 0 && inodeKernel->inodeSize != inodeSize)
+        inodeKernel++;
+}
+
+// Distributions
+//
+// A log-linear sketch: values below 16 are counted exactly and every power of
+// two above that is split into 16 buckets, so quantiles are within 1/16 of the
+// true value and two sketches merge by adding their counters.
+
+#define sketchSubBits 4
+#define sketchSub (1 << sketchSubBits)
+#define sketchBuckets (sketchSub + (64 - sketchSubBits) * sketchSub)
+
+struct distribution
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[sketchBuckets];
+};
+
+unsigned int sketchIndex(uint64_t value)
+{
+    if (value < sketchSub)
+        return value;
+
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned int mantissa = (value >> (exponent - sketchSubBits)) & (sketchSub - 1);
+    return sketchSub + (exponent - sketchSubBits) * sketchSub + mantissa;
+}
+
+uint64_t sketchLowerBound(unsigned int index)
+{
+    if (index < sketchSub)
+        return index;
+
+    unsigned int exponent = (index - sketchSub) / sketchSub + sketchSubBits;
+    uint64_t mantissa = (index - sketchSub) % sketchSub;
+    return (sketchSub + mantissa) << (exponent - sketchSubBits);
+}
+
+void recordValue(struct distribution *d, uint64_t value)
+{
+    if (d->count == 0 || value < d->min)
+        d->min = value;
+    if (value > d->max)
+        d->max = value;
+    d->count++;
+    d->sum += value;
+    d->buckets[sketchIndex(value)]++;
+}
+
+void mergeDistribution(struct distribution *into, const struct distribution *from)
+{
+    if (from->count == 0)
+        return;
+
+    if (into->count == 0 || from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+    into->count += from->count;
+    into->sum += from->sum;
+    for (unsigned int i = 0; i < sketchBuckets; i++)
+    {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+uint64_t quantile(const struct distribution *d, double q)
+{
+    if (d->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * (d->count - 1));
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < sketchBuckets; i++)
+    {
+        seen += d->buckets[i];
+        if (seen > rank)
+        {
+            uint64_t value = sketchLowerBound(i);
+            return value < d->min ? d->min : value > d->max ? d->max : value;
+        }
+    }
+    return d->max;
+}
+
+// Image I/O
+//
+// Every read of the image goes through readImage. With --direct the image is
+// opened O_DIRECT, which needs the buffer, offset and length all aligned to
+// the device's sector size; directAlignment covers 512-byte and 4K sectors.
+// Large reads land straight in buffers from allocImageBuffer, and anything
+// unaligned goes through a per-thread bounce buffer.
+
+#define directAlignment 4096
+
+int directIO;
+uint64_t bytesRead;
+uint64_t readCount;
+
+// Rate limiting
+//
+// Two token buckets, bytes and reads, refilled at the configured rates times
+// an adaptive scale. Every latencyWindow reads the p99 read latency is
+// compared with the best p99 seen so far: well above it the scale halves, near
+// it the scale creeps back up to 1. Sequential reads (bitmap and inode-table
+// runs) may draw the buckets down to empty, random reads (directory, indirect
+// and extent blocks) only while a reserve is left, so under throttling the
+// sequential runs go first. Reads may overdraw a bucket; the debt is paid off
+// before the next read of the same class.
+
+#define ioSequential 0
+#define ioRandom 1
+#define latencyWindow 64
+#define minRateScale (1.0 / 16)
+#define latencyFloor 500 // us; cache hits and fast devices never trigger a back-off
+
+struct rateLimiter
+{
+    pthread_mutex_t lock;
+    double bytesPerSecond; // 0 means unlimited
+    double readsPerSecond;
+    double scale;
+    double byteTokens;
+    double readTokens;
+    struct timespec refilled;
+    struct distribution latency; // microseconds, current window
+    uint64_t bestP99;
+};
+
+struct rateLimiter limiter = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 1.0, 0, 0, {0, 0}, {0}, 0};
+
+int rateLimited(void)
+{
+    return limiter.bytesPerSecond != 0 || limiter.readsPerSecond != 0;
+}
+
+double secondsBetween(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Bucket level below which reads of the class must wait.
+double bucketReserve(double perSecond, int ioClass)
+{
+    return ioClass == ioRandom ? perSecond * limiter.scale / 4 : 0;
+}
+
+void acquireTokens(size_t bytes, int ioClass)
+{
+    pthread_mutex_lock(&limiter.lock);
+    for (;;)
+    {
+        // Buckets hold at most one second's worth at the current scale.
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = secondsBetween(&limiter.refilled, &now);
+        limiter.refilled = now;
+
+        double byteRate = limiter.bytesPerSecond * limiter.scale;
+        double readRate = limiter.readsPerSecond * limiter.scale;
+        limiter.byteTokens += elapsed * byteRate;
+        if (limiter.byteTokens > byteRate)
+            limiter.byteTokens = byteRate;
+        limiter.readTokens += elapsed * readRate;
+        if (limiter.readTokens > readRate)
+            limiter.readTokens = readRate;
+
+        double wait = 0;
+        if (byteRate != 0 && limiter.byteTokens < bucketReserve(limiter.bytesPerSecond, ioClass))
+        {
+            wait = (bucketReserve(limiter.bytesPerSecond, ioClass) - limiter.byteTokens) / byteRate;
+        }
+        if (readRate != 0 && limiter.readTokens < bucketReserve(limiter.readsPerSecond, ioClass) + 1)
+        {
+            double readWait = (bucketReserve(limiter.readsPerSecond, ioClass) + 1 - limiter.readTokens) / readRate;
+            if (readWait > wait)
+                wait = readWait;
+        }
+
+        if (wait <= 0)
+            break;
+
+        pthread_mutex_unlock(&limiter.lock);
+        struct timespec pause = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&limiter.lock);
+    }
+
+    if (limiter.bytesPerSecond != 0)
+        limiter.byteTokens -= bytes;
+    if (limiter.readsPerSecond != 0)
+        limiter.readTokens -= 1;
+    pthread_mutex_unlock(&limiter.lock);
+}
+
+void recordLatency(const struct timespec *start, const struct timespec *end)
+{
+    pthread_mutex_lock(&limiter.lock);
+    recordValue(&limiter.latency, (uint64_t)(secondsBetween(start, end) * 1e6));
+    if (limiter.latency.count == latencyWindow)
+    {
+        uint64_t p99 = quantile(&limiter.latency, 0.99);
+        if (limiter.bestP99 == 0 || p99 < limiter.bestP99)
+            limiter.bestP99 = p99;
+
+        uint64_t baseline = limiter.bestP99 > latencyFloor ? limiter.bestP99 : latencyFloor;
+        if (p99 > baseline * 2)
+        {
+            limiter.scale /= 2;
+            if (limiter.scale < minRateScale)
+                limiter.scale = minRateScale;
+        }
+        else if (p99 * 2 < baseline * 3)
+        {
+            limiter.scale *= 1.25;
+            if (limiter.scale > 1)
+                limiter.scale = 1;
+        }
+        memset(&limiter.latency, 0, sizeof(limiter.latency));
+    }
+    pthread_mutex_unlock(&limiter.lock);
+}
+
+__thread uint8_t *bounceBuffer;
+__thread size_t bounceSize;
+
+void *allocImageBuffer(size_t size)
+{
+    void *buffer;
+    if (posix_memalign(&buffer, directAlignment, size) != 0)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+ssize_t readImageAs(int fd, void *buf, size_t len, off_t offset, int ioClass)
+{
+    struct timespec issued;
+    if (rateLimited())
+    {
+        acquireTokens(len, ioClass);
+        clock_gettime(CLOCK_MONOTONIC, &issued);
+    }
+
+    ssize_t got;
+    ssize_t transferred; // what the device moved, including alignment padding
+    if (!directIO || ((uintptr_t)buf % directAlignment == 0 && len % directAlignment == 0 && offset % directAlignment == 0))
+    {
+        got = transferred = pread(fd, buf, len, offset);
+    }
+    else
+    {
+        off_t start = offset & ~(off_t)(directAlignment - 1);
+        size_t head = offset - start;
+        size_t span = (head + len + directAlignment - 1) & ~(size_t)(directAlignment - 1);
+        if (bounceSize < span)
+        {
+            free(bounceBuffer);
+            bounceBuffer = allocImageBuffer(span);
+            bounceSize = span;
+        }
+
+        // Near the end of the image the read comes back short.
+        got = transferred = pread(fd, bounceBuffer, span, start);
+        if (got >= 0)
+        {
+            got = (size_t)got > head ? got - (ssize_t)head : 0;
+            if ((size_t)got > len)
+                got = len;
+            memcpy(buf, bounceBuffer + head, got);
+        }
+    }
+
+    if (transferred > 0)
+    {
+        __atomic_fetch_add(&bytesRead, transferred, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&readCount, 1, __ATOMIC_RELAXED);
+    }
+    if (rateLimited())
+    {
+        struct timespec completed;
+        clock_gettime(CLOCK_MONOTONIC, &completed);
+        recordLatency(&issued, &completed);
+    }
+    return got;
+}
+
+ssize_t readImage(int fd, void *buf, size_t len, off_t offset)
+{
+    return readImageAs(fd, buf, len, offset, ioRandom);
+}
+
+// Opens the image, with O_DIRECT when asked. Filesystems that refuse O_DIRECT
+// fall back to buffered reads, told not to keep the pages around.
+int openImage(const char *filename)
+{
+    if (directIO)
+    {
+        int fd = open(filename, O_RDONLY | O_DIRECT);
+        if (fd >= 0)
+            return fd;
+
+        fprintf(stderr, "Warning: O_DIRECT not supported for %s, using buffered reads\n", filename);
+        directIO = 0;
+        fd = open(filename, O_RDONLY);
+        if (fd >= 0)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+        return fd;
+    }
+    return open(filename, O_RDONLY);
+}
+
+void reportThroughput(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = secondsBetween(start, &end);
+
+    fprintf(stderr, "Read %" PRIu64 " bytes in %" PRIu64 " reads, %.3f s, %.1f MB/s\n",
+            bytesRead, readCount, seconds, seconds > 0 ? bytesRead / seconds / (1024 * 1024) : 0.0);
+    if (rateLimited())
+    {
+        fprintf(stderr, "Rate limit scale %.3f, best p99 read latency %" PRIu64 " us\n", limiter.scale, limiter.bestP99);
+    }
+}
+
+// With --timings every phase of the scan writes a PHASE record to stderr:
+// its name, wall-clock seconds, image reads issued and bytes read. The
+// Makefile's bench-check target compares these against a stored baseline.
+int phaseTimings;
+struct timespec phaseStart;
+uint64_t phaseReads;
+uint64_t phaseBytes;
+
+void beginPhase(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &phaseStart);
+    phaseReads = readCount;
+    phaseBytes = bytesRead;
+}
+
+void endPhase(const char *name)
+{
+    if (phaseTimings)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fprintf(stderr, "PHASE,%s,%.6f,%" PRIu64 ",%" PRIu64 "\n",
+                name, secondsBetween(&phaseStart, &now), readCount - phaseReads, bytesRead - phaseBytes);
+    }
+    beginPhase();
+}
+
+// Filesystem access
+
+void readSuperblock(int fd)
+{
+    if (readImage(fd, &superBuffer, sizeof(struct ext2_super_block), superblockOffset) != sizeof(struct ext2_super_block))
+    {
+        fprintf(stderr, "Error: could not read superblock\n");
+        exit(1);
+    }
+
+    blockSize = EXT2_MIN_BLOCK_SIZE << superBuffer.s_log_block_size;
+    inodeSize = superBuffer.s_rev_level == 0 ? EXT2_GOOD_OLD_INODE_SIZE : superBuffer.s_inode_size;
+
+    uint32_t incompat = getU32(&superBuffer, superFeatureIncompatOffset);
+    uint32_t roCompat = getU32(&superBuffer, superFeatureRoCompatOffset);
+
+    if (superBuffer.s_blocks_per_group == 0 || superBuffer.s_inodes_per_group == 0 || blockSize > 65536)
+    {
+        fprintf(stderr, "Error: superblock geometry is invalid\n");
+        exit(1);
+    }
+
+    blocksCount = superBuffer.s_blocks_count;
+    descSize = EXT2_MIN_DESC_SIZE;
+    if (incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+    {
+        blocksCount |= (uint64_t)getU32(&superBuffer, superBlocksCountHiOffset) << 32;
+        descSize = getU16(&superBuffer, superDescSizeOffset);
+        if (descSize < EXT2_MIN_DESC_SIZE_64BIT)
+            descSize = EXT2_MIN_DESC_SIZE_64BIT;
+    }
+
+    groupCount = (blocksCount - superBuffer.s_first_data_block + superBuffer.s_blocks_per_group - 1) / superBuffer.s_blocks_per_group;
+    groupsPerFlex = 1;
+    if (incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG)
+        groupsPerFlex = 1U << ((const uint8_t *)&superBuffer)[superLogGroupsPerFlexOffset];
+    inodeTableBlocks = ((uint64_t)superBuffer.s_inodes_per_group * inodeSize + blockSize - 1) / blockSize;
+    gdtBlocks = ((uint64_t)groupCount * descSize + blockSize - 1) / blockSize;
+    sparseSuper = (roCompat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) != 0;
+    groupCsum = (roCompat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+
+    selectKernels();
+
+    initCrc32c();
+    metadataCsum = (roCompat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) != 0;
+    if (metadataCsum)
+    {
+        if (incompat & EXT4_FEATURE_INCOMPAT_CSUM_SEED)
+            csumSeed = getU32(&superBuffer, superChecksumSeedOffset);
+        else
+            csumSeed = crc32c(~0U, (const uint8_t *)&superBuffer + superUuidOffset, 16);
+
+        if (crc32c(~0U, (const uint8_t *)&superBuffer, superChecksumOffset) != getU32(&superBuffer, superChecksumOffset))
+        {
+            fprintf(stderr, "Warning: superblock checksum mismatch\n");
+            reportBadChecksum("superblock", 0);
+        }
+    }
+}
+
+// The descriptor table starts in the block after the one holding the superblock.
+off_t groupDescOffset(uint32_t group)
+{
+    return (off_t)(superBuffer.s_first_data_block + 1) * blockSize + (off_t)group * descSize;
+}
+
+void decodeGroupDesc(const uint8_t *raw, struct groupInfo *info)
+{
+    const struct ext2_group_desc *desc = (const struct ext2_group_desc *)raw;
+
+    info->blockBitmap = desc->bg_block_bitmap;
+    info->inodeBitmap = desc->bg_inode_bitmap;
+    info->inodeTable = desc->bg_inode_table;
+    info->freeBlocks = desc->bg_free_blocks_count;
+    info->freeInodes = desc->bg_free_inodes_count;
+    info->flags = groupCsum ? getU16(raw, descFlagsOffset) : 0;
+    info->itableUnused = groupCsum ? getU16(raw, descItableUnusedLoOffset) : 0;
+
+    if (descSize >= EXT2_MIN_DESC_SIZE_64BIT)
+    {
+        if (groupCsum)
+            info->itableUnused |= (uint32_t)getU16(raw, descItableUnusedHiOffset) << 16;
+        info->blockBitmap |= (uint64_t)getU32(raw, descBlockBitmapHiOffset) << 32;
+        info->inodeBitmap |= (uint64_t)getU32(raw, descInodeBitmapHiOffset) << 32;
+        info->inodeTable |= (uint64_t)getU32(raw, descInodeTableHiOffset) << 32;
+        info->freeBlocks |= (uint32_t)getU16(raw, descFreeBlocksHiOffset) << 16;
+        info->freeInodes |= (uint32_t)getU16(raw, descFreeInodesHiOffset) << 16;
+    }
+}
+
+// Reads a single group descriptor straight from the descriptor table, so callers
+// that only need a few groups never pay for loading all of them. Returns -1 if
+// the descriptor fails its checksum.
+int readGroupDesc(int fd, uint32_t group, struct groupInfo *info, uint8_t *raw)
+{
+    readImage(fd, raw, descSize, groupDescOffset(group));
+    decodeGroupDesc(raw, info);
+
+    return verifyGroupDesc(raw, group) ? 0 : -1;
+}
+
+// With sparse_super only groups 0, 1 and powers of 3, 5 and 7 keep backups.
+int groupHasSuper(uint32_t group)
+{
+    if (group <= 1 || !sparseSuper)
+        return group <= 1 || !sparseSuper;
+
+    for (uint32_t base = 3; base <= 7; base += 2)
+    {
+        uint64_t power = base;
+        while (power < group)
+            power *= base;
+        if (power == group)
+            return 1;
+    }
+    return 0;
+}
+
+// BLOCK_UNINIT groups have no bitmap on disk. Their only used blocks are the
+// superblock and descriptor backups, and the group's own bitmaps and inode
+// table when they were not moved elsewhere by flex_bg.
+void synthesizeBlockBitmap(uint32_t group, uint8_t *bitmap)
+{
+    memset(bitmap, 0, blockSize);
+
+    uint64_t start = (uint64_t)group * superBuffer.s_blocks_per_group + superBuffer.s_first_data_block;
+    uint64_t end = start + superBuffer.s_blocks_per_group;
+    uint32_t used = 0;
+
+    if (groupHasSuper(group))
+        used = 1 + gdtBlocks + getU16(&superBuffer, superReservedGdtBlocksOffset);
+    for (uint32_t b = 0; b < used && b < superBuffer.s_blocks_per_group; b++)
+        bitmap[b / 8] |= 1 << (b % 8);
+
+    uint64_t own[] = {groups[group].blockBitmap, groups[group].inodeBitmap};
+    for (int k = 0; k < 2; k++)
+    {
+        if (own[k] >= start && own[k] < end)
+            bitmap[(own[k] - start) / 8] |= 1 << ((own[k] - start) % 8);
+    }
+    for (uint64_t b = groups[group].inodeTable; b < groups[group].inodeTable + inodeTableBlocks; b++)
+    {
+        if (b >= start && b < end)
+            bitmap[(b - start) / 8] |= 1 << ((b - start) % 8);
+    }
+
+    // Bits past the end of the group (and of a short last group) stay set.
+    uint64_t groupBlocks = superBuffer.s_blocks_per_group;
+    if (end > blocksCount)
+        groupBlocks = blocksCount - start;
+    for (uint64_t b = groupBlocks; b < (uint64_t)blockSize * 8; b++)
+        bitmap[b / 8] |= 1 << (b % 8);
+}
+
+// INODE_UNINIT groups have every inode free.
+void synthesizeInodeBitmap(uint8_t *bitmap)
+{
+    memset(bitmap, 0xFF, blockSize);
+    memset(bitmap, 0, superBuffer.s_inodes_per_group / 8);
+}
+
+#define maxCoalescedRead (64 * 1024 * 1024)
+
+uint64_t groupLocation(uint32_t group, size_t field)
+{
+    return *(const uint64_t *)((const uint8_t *)&groups[group] + field);
+}
+
+// flex_bg packs the bitmaps and inode tables of neighbouring groups back to
+// back. This reads the longest such run starting at `first` (the structure at
+// `field`, `stride` blocks per group) with one pread, and returns the number of
+// groups it covers. Runs stop at corrupt descriptors and at maxCoalescedRead.
+uint32_t readGroupRun(int fd, uint32_t first, uint32_t numGroups, size_t field, uint64_t stride,
+                      uint8_t **buffer, size_t *bufferSize)
+{
+    uint64_t runBytes = stride * blockSize;
+    uint64_t maxGroups = maxCoalescedRead / runBytes;
+    if (maxGroups == 0)
+        maxGroups = 1;
+
+    uint64_t start = groupLocation(first, field);
+    uint32_t count = 1;
+    while (first + count < numGroups && count < maxGroups &&
+           !(groupCorrupt[first + count] & groupDescBad) &&
+           groupLocation(first + count, field) == start + count * stride)
+    {
+        count++;
+    }
+
+    size_t needed = (size_t)(count * runBytes);
+    if (*bufferSize < needed)
+    {
+        free(*buffer);
+        *buffer = allocImageBuffer(needed);
+        *bufferSize = needed;
+    }
+
+    readImageAs(fd, *buffer, needed, (off_t)start * blockSize, ioSequential);
+    return count;
+}
+
+// Locates an inode by number: group = (n - 1) / s_inodes_per_group, then the
+// remainder indexes into that group's inode table.
+int readInode(int fd, unsigned int inodeNum, struct ext2_inode *inode)
+{
+    if (inodeNum == 0 || inodeNum > superBuffer.s_inodes_count)
+    {
+        return -1;
+    }
+
+    unsigned int group = (inodeNum - 1) / superBuffer.s_inodes_per_group;
+    unsigned int index = (inodeNum - 1) % superBuffer.s_inodes_per_group;
+
+    struct groupInfo desc;
+    if (groups != NULL)
+    {
+        if (groupCorrupt[group] & groupDescBad)
+            return -1;
+        desc = groups[group];
+    }
+    else
+    {
+        uint8_t rawDesc[descSize];
+        if (readGroupDesc(fd, group, &desc, rawDesc) != 0)
+        {
+            reportBadChecksum("group", group);
+            return -1;
+        }
+    }
+
+    uint8_t raw[inodeSize];
+    off_t inodeOffset = (off_t)desc.inodeTable * blockSize + (off_t)index * inodeSize;
+    if (readImage(fd, raw, inodeSize, inodeOffset) != (ssize_t)inodeSize)
+    {
+        return -1;
+    }
+
+    if (!verifyInode(raw, inodeNum))
+    {
+        reportBadChecksum("inode", inodeNum);
+        return -1;
+    }
+
+    memcpy(inode, raw, sizeof(struct ext2_inode));
+    return 0;
+}
+
+// Superblock Summary
+
+void createSuperblockSummary(int fd, const char *path)
+{
+    (void)fd;
+
+    int superblockFd = creat(path, S_IRWXU); // file owner has read, write and execute permissions
+
+    int retSize = blockSize;
+
+    dprintf(superblockFd, "SUPERBLOCK,");
+
+    dprintf(superblockFd, "%" PRIu64 ",", blocksCount);
+
+    dprintf(superblockFd, "%d,", superBuffer.s_inodes_count);
+
+    dprintf(superblockFd, "%d,", retSize);
+
+    dprintf(superblockFd, "%d,", superBuffer.s_inode_size);
+
+    dprintf(superblockFd, "%d,", superBuffer.s_blocks_per_group);
+
+    dprintf(superblockFd, "%d,", superBuffer.s_inodes_per_group);
+
+    dprintf(superblockFd, "%d\n", superBuffer.s_first_ino);
+
+    close(superblockFd);
+}
+
+// Group Summary
+
+// Decodes and verifies every group descriptor. Returns the number of groups.
+int loadGroupTable(int fd)
+{
+    int numberOfGroups = groupCount;
+
+    groups = malloc(numberOfGroups * sizeof(struct groupInfo));
+    groupCorrupt = calloc(numberOfGroups, 1);
+    groupDescRaw = malloc((size_t)numberOfGroups * descSize);
+
+    // The descriptor table is contiguous, so it is read in one go.
+    readImageAs(fd, groupDescRaw, (size_t)numberOfGroups * descSize, groupDescOffset(0), ioSequential);
+
+    for (int i = 0; i < numberOfGroups; i++)
+    {
+        uint8_t *rawDesc = groupDescRaw + (size_t)i * descSize;
+        decodeGroupDesc(rawDesc, &groups[i]);
+
+        if (!verifyGroupDesc(rawDesc, i))
+        {
+            // A descriptor that fails its checksum cannot be trusted to point at
+            // bitmaps or an inode table, so the whole group is skipped.
+            groupCorrupt[i] = groupDescBad;
+            reportBadChecksum("group", i);
+        }
+    }
+
+    return numberOfGroups;
+}
+
+// Number of blocks in the group; the last group may be short.
+uint32_t groupBlocks(uint32_t group)
+{
+    uint64_t groupStart = (uint64_t)group * superBuffer.s_blocks_per_group + superBuffer.s_first_data_block;
+    if (groupStart + superBuffer.s_blocks_per_group > blocksCount)
+        return blocksCount - groupStart;
+    return superBuffer.s_blocks_per_group;
+}
+
+int createGroupSummary(int fd, const char *path) // returns number of froups
+{
+    int numberOfGroups = loadGroupTable(fd);
+
+    uint64_t lastGroupBlocks = blocksCount - (uint64_t)(numberOfGroups - 1) * superBuffer.s_blocks_per_group;
+    int inodeRemainder = superBuffer.s_inodes_count % superBuffer.s_inodes_per_group;
+
+    int groupFd = creat(path, S_IRWXU);
+
+    int i = 0;
+    for (; i < numberOfGroups; i++)
+    {
+        if (groupCorrupt[i] & groupDescBad)
+        {
+            continue;
+        }
+
+        dprintf(groupFd, "GROUP,");
+
+        dprintf(groupFd, "%d,", i);
+
+        if ((i + 1) == numberOfGroups)
+        {
+            dprintf(groupFd, "%" PRIu64 ",", lastGroupBlocks);
+        }
+        else
+        {
+            dprintf(groupFd, "%u,", superBuffer.s_blocks_per_group);
+        }
+
+        if (inodeRemainder == 0)
+        {
+            dprintf(groupFd, "%d,", superBuffer.s_inodes_per_group);
+        }
+        else
+        {
+            if ((i + 1) == numberOfGroups)
+            {
+                dprintf(groupFd, "%d,", inodeRemainder);
+            }
+            else
+            {
+                dprintf(groupFd, "%d,", superBuffer.s_inodes_per_group);
+            }
+        }
+
+        dprintf(groupFd, "%u,", groups[i].freeBlocks);
+
+        dprintf(groupFd, "%u,", groups[i].freeInodes);
+
+        dprintf(groupFd, "%" PRIu64 ",", groups[i].blockBitmap);
+
+        dprintf(groupFd, "%" PRIu64 ",", groups[i].inodeBitmap);
+
+        dprintf(groupFd, "%" PRIu64 "\n", groups[i].inodeTable);
+    }
+
+    close(groupFd);
+
+    return numberOfGroups;
+}
+
+// Free extents
+//
+// Free runs are found a 64-bit word at a time, so following them costs no
+// more than the bitmap scan that lists the free blocks.
+
+// Returns the index of the first bit at or after pos that equals set, or bits.
+uint32_t nextBit(const uint8_t *bitmap, uint32_t pos, uint32_t bits, int set)
+{
+    while (pos < bits)
+    {
+        uint64_t word;
+        memcpy(&word, bitmap + (pos / 64) * 8, sizeof(word));
+        if (!set)
+            word = ~word;
+        word &= ~0ULL << (pos % 64);
+        if (word != 0)
+        {
+            uint32_t found = (pos & ~63U) + __builtin_ctzll(word);
+            return found < bits ? found : bits;
+        }
+        pos = (pos & ~63U) + 64;
+    }
+    return bits;
+}
+
+// Free extent counts by length: bucket k holds extents of 2^(k-1) to 2^k - 1 blocks.
+struct freeHistogram
+{
+    uint64_t extents;
+    uint64_t blocks;
+    uint64_t largest;
+    uint64_t count[65];
+    uint64_t countBlocks[65];
+};
+
+void recordFreeExtent(struct freeHistogram *histogram, uint64_t length)
+{
+    int k = 64 - __builtin_clzll(length);
+    histogram->extents++;
+    histogram->blocks += length;
+    histogram->count[k]++;
+    histogram->countBlocks[k] += length;
+    if (length > histogram->largest)
+        histogram->largest = length;
+}
+
+// Follows free runs across consecutive bitmaps. Runs are fed to whichever of
+// the sketch and the histogram are set.
+struct freeRunTracker
+{
+    uint64_t open; // length of the run reaching the end of the last bitmap
+    struct distribution *sketch;
+    struct freeHistogram *histogram;
+};
+
+void closeFreeRun(struct freeRunTracker *tracker)
+{
+    if (tracker->open == 0)
+        return;
+
+    if (tracker->sketch != NULL)
+        recordValue(tracker->sketch, tracker->open);
+    if (tracker->histogram != NULL)
+        recordFreeExtent(tracker->histogram, tracker->open);
+    tracker->open = 0;
+}
+
+// Feeds every free run in the bitmap to the tracker, which joins a run that
+// reaches the end of the bitmap to one starting the next. When group is set
+// it also gets the runs cut at the bitmap's edges. Returns the number of free bits.
+uint64_t recordFreeRuns(const uint8_t *bitmap, uint32_t bits, struct freeRunTracker *tracker, struct freeHistogram *group)
+{
+    if (bits != 0 && (bitmap[0] & 1))
+        closeFreeRun(tracker);
+
+    uint64_t freeCount = 0;
+    uint32_t pos = 0;
+    while (pos < bits)
+    {
+        uint32_t start = nextBit(bitmap, pos, bits, 0);
+        if (start >= bits)
+            break;
+
+        uint32_t end = nextBit(bitmap, start, bits, 1);
+        freeCount += end - start;
+        tracker->open += end - start;
+        if (group != NULL)
+            recordFreeExtent(group, end - start);
+        if (end == bits)
+            break;
+
+        closeFreeRun(tracker);
+        pos = end;
+    }
+    return freeCount;
+}
+
+// Free Block Summary
+
+// Writes the free-space fragmentation records: one FREEFRAG per group with its
+// free blocks, free extents cut at the group's edges and the largest of them,
+// then FREEHIST per power-of-two length range over extents that may span groups.
+void printFreeFrag(int fragFd, const struct freeHistogram *groupFrag, int numOfGroups, const struct freeHistogram *global)
+{
+    for (int i = 0; i < numOfGroups; i++)
+    {
+        if (groupCorrupt[i] & (groupDescBad | blockBitmapBad))
+            continue;
+
+        dprintf(fragFd, "FREEFRAG,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                i, groupFrag[i].blocks, groupFrag[i].extents, groupFrag[i].largest);
+    }
+
+    for (int k = 1; k <= 64; k++)
+    {
+        if (global->count[k] != 0)
+        {
+            dprintf(fragFd, "FREEHIST,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                    (uint64_t)1 << (k - 1), ((uint64_t)1 << (k - 1)) * 2 - 1, global->count[k], global->countBlocks[k]);
+        }
+    }
+}
+
+// fragPath may be NULL, in which case no fragmentation records are written.
+void createFreeSummary(int fd, const char *groupPath, const char *inodePath, const char *fragPath, int numOfGroups)
+{
+    int freeGroupFd = creat(groupPath, S_IRWXU);
+    int freeInodeFd = creat(inodePath, S_IRWXU);
+
+    struct freeHistogram *groupFrag = NULL;
+    struct freeHistogram globalFrag = {0};
+    struct freeRunTracker tracker = {0, NULL, &globalFrag};
+    if (fragPath != NULL)
+    {
+        groupFrag = calloc(numOfGroups, sizeof(struct freeHistogram));
+    }
+
+    uint8_t *bitmapRun = NULL;
+    size_t bitmapRunSize = 0;
+    uint32_t *freeBits = malloc((size_t)blockSize * 8 * sizeof(uint32_t));
+
+    // Block bitmaps first, then inode bitmaps, each read a flex group at a time.
+    // Each bitmap's checksum is checked before any of its bits are trusted.
+    int i = 0;
+    while (i < numOfGroups)
+    {
+        if (groupCorrupt[i] & groupDescBad)
+        {
+            closeFreeRun(&tracker);
+            i++;
+            continue;
+        }
+
+        uint32_t run = readGroupRun(fd, i, numOfGroups, offsetof(struct groupInfo, blockBitmap), 1, &bitmapRun, &bitmapRunSize);
+        for (uint32_t r = 0; r < run; r++, i++)
+        {
+            uint8_t *blockBitmap = bitmapRun + (size_t)r * blockSize;
+            if (groups[i].flags & EXT4_BG_BLOCK_UNINIT)
+            {
+                synthesizeBlockBitmap(i, blockBitmap);
+            }
+            else if (!verifyBitmap(groupDescRaw + (size_t)i * descSize, blockBitmap, superBuffer.s_blocks_per_group / 8, descBlockBitmapCsumLoOffset, descBlockBitmapCsumHiOffset))
+            {
+                groupCorrupt[i] |= blockBitmapBad;
+                reportBadChecksum("block_bitmap", i);
+                closeFreeRun(&tracker);
+                continue;
+            }
+
+            uint64_t groupStart = (uint64_t)i * superBuffer.s_blocks_per_group + superBuffer.s_first_data_block;
+            size_t count = blockKernel->freeBits(blockBitmap, freeBits);
+            for (size_t k = 0; k < count; k++) // 0 means free
+            {
+                dprintf(freeGroupFd, "BFREE,%" PRIu64 "\n", groupStart + freeBits[k]);
+            }
+
+            if (groupFrag != NULL)
+            {
+                recordFreeRuns(blockBitmap, groupBlocks(i), &tracker, &groupFrag[i]);
+            }
+        }
+    }
+    closeFreeRun(&tracker);
+
+    i = 0;
+    while (i < numOfGroups)
+    {
+        if (groupCorrupt[i] & groupDescBad)
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t run = readGroupRun(fd, i, numOfGroups, offsetof(struct groupInfo, inodeBitmap), 1, &bitmapRun, &bitmapRunSize);
+        for (uint32_t r = 0; r < run; r++, i++)
+        {
+            uint8_t *inodeBitmap = bitmapRun + (size_t)r * blockSize;
+            if (groups[i].flags & EXT4_BG_INODE_UNINIT)
+            {
+                synthesizeInodeBitmap(inodeBitmap);
+            }
+            else if (!verifyBitmap(groupDescRaw + (size_t)i * descSize, inodeBitmap, superBuffer.s_inodes_per_group / 8, descInodeBitmapCsumLoOffset, descInodeBitmapCsumHiOffset))
+            {
+                groupCorrupt[i] |= inodeBitmapBad;
+                reportBadChecksum("inode_bitmap", i);
+                continue;
+            }
+
+            size_t count = blockKernel->freeBits(inodeBitmap, freeBits);
+            for (size_t k = 0; k < count; k++) // 0 means free
+            {
+                dprintf(freeInodeFd, "IFREE,%u\n", i * superBuffer.s_inodes_per_group + freeBits[k] + 1);
+            }
+        }
+    }
+
+    free(bitmapRun);
+    free(freeBits);
+
+    if (groupFrag != NULL)
+    {
+        int fragFd = creat(fragPath, S_IRWXU);
+        printFreeFrag(fragFd, groupFrag, numOfGroups, &globalFrag);
+        close(fragFd);
+        free(groupFrag);
+    }
+
+    close(freeGroupFd);
+    close(freeInodeFd);
+}
+
+void formatTime(uint32_t t, char *buf)
+{
+    time_t timer = t;
+    struct tm *ts = gmtime(&timer);
+    strftime(buf, 80, "%m/%d/%y %H:%M:%S", ts);
+}
+
+// Bounded traversal
+//
+// Corrupt images can point indirect and directory blocks anywhere, including
+// back at blocks already read. Every metadata block read during the scan goes
+// through visitBlock, which refuses blocks outside the filesystem and blocks
+// already visited, so the total work stays linear in the image size. The
+// limits below cap it further; zero means unlimited.
+
+struct traversalLimits
+{
+    unsigned long inodeBlocks;
+    unsigned long imageBlocks;
+    unsigned long inodeOutput;
+    unsigned long imageOutput;
+    int depth;
+};
+
+struct traversalLimits limits = {0, 0, 0, 0, 3};
+
+struct traversalState
+{
+    int active;
+    uint32_t inodeNum;
+    unsigned long inodeBlocks;
+    unsigned long inodeOutput;
+    unsigned long imageBlocks;
+    unsigned long imageOutput;
+    int depth;
+    int exhausted; // an image-wide limit was hit; the scan stops
+    const char *truncated;
+    uint8_t *visited;
+};
+
+// Each scanning thread keeps its own state; only the visited bitmap is shared.
+__thread struct traversalState traversal;
+int truncFd = -1;
+FILE *visitedLog; // with --checkpoint, every block marked visited, in order
+
+void startTraversal(void)
+{
+    free(traversal.visited);
+    memset(&traversal, 0, sizeof(traversal));
+    traversal.visited = calloc(blocksCount / 8 + 1, 1);
+}
+
+void truncateInode(const char *reason)
+{
+    if (traversal.truncated == NULL)
+    {
+        traversal.truncated = reason;
+    }
+}
+
+void beginInode(uint32_t inodeNum)
+{
+    traversal.active = 1;
+    traversal.inodeNum = inodeNum;
+    traversal.inodeBlocks = 0;
+    traversal.inodeOutput = 0;
+    traversal.depth = 0;
+    traversal.truncated = NULL;
+}
+
+void endInode(void)
+{
+    if (traversal.truncated != NULL && truncFd >= 0)
+    {
+        dprintf(truncFd, "TRUNCATED,%u,%s\n", traversal.inodeNum, traversal.truncated);
+    }
+    traversal.active = 0;
+}
+
+// Returns 1 if the block may be read. Outside a scan only the range check applies.
+int visitBlock(uint64_t blockNum)
+{
+    if (blockNum < superBuffer.s_first_data_block || blockNum >= blocksCount)
+    {
+        truncateInode("block_range");
+        return 0;
+    }
+    if (!traversal.active)
+    {
+        return 1;
+    }
+
+    if (traversal.visited != NULL)
+    {
+        uint8_t bit = 1 << (blockNum % 8);
+        if (__atomic_fetch_or(&traversal.visited[blockNum / 8], bit, __ATOMIC_RELAXED) & bit)
+        {
+            truncateInode("cycle");
+            return 0;
+        }
+        if (visitedLog != NULL)
+        {
+            fwrite(&blockNum, sizeof(blockNum), 1, visitedLog);
+        }
+    }
+
+    if (limits.inodeBlocks != 0 && traversal.inodeBlocks >= limits.inodeBlocks)
+    {
+        truncateInode("inode_blocks");
+        return 0;
+    }
+    if (limits.imageBlocks != 0 && traversal.imageBlocks >= limits.imageBlocks)
+    {
+        truncateInode("image_blocks");
+        traversal.exhausted = 1;
+        return 0;
+    }
+
+    traversal.inodeBlocks++;
+    traversal.imageBlocks++;
+    return 1;
+}
+
+// Formats one record and writes it only if it fits in the output budgets.
+// Returns -1 once a budget is spent so callers can stop generating records.
+int emitRecord(int outFd, const char *format, ...)
+{
+    char record[1024];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(record, sizeof(record), format, args);
+    va_end(args);
+
+    if (len < 0)
+        return -1;
+    if ((size_t)len >= sizeof(record))
+        len = sizeof(record) - 1;
+
+    if (traversal.active)
+    {
+        if (limits.inodeOutput != 0 && traversal.inodeOutput + len > limits.inodeOutput)
+        {
+            truncateInode("inode_output");
+            return -1;
+        }
+        if (limits.imageOutput != 0 && traversal.imageOutput + len > limits.imageOutput)
+        {
+            truncateInode("image_output");
+            traversal.exhausted = 1;
+            return -1;
+        }
+        traversal.inodeOutput += len;
+        traversal.imageOutput += len;
+    }
+
+    write(outFd, record, len);
+    return 0;
+}
+
+// Checkpoints
+//
+// With --checkpoint FILE the inode scan saves its progress at group
+// boundaries, at most every checkpointInterval seconds and once more when the
+// scan ends: the next group to scan, the length of every record stream, the
+// image-wide traversal counters and how much of the visited-block log (FILE
+// plus ".visited") is valid. --resume truncates the streams back to those
+// lengths, replays the log into the visited bitmap and carries on from that
+// group, so the output matches a run that was never interrupted. The
+// superblock, group and free-space passes are cheap and simply run again.
+
+#define checkpointInterval 10
+#define checkpointMagic "lab3a-checkpoint 1"
+
+#define streamInode 0
+#define streamDirent 1
+#define streamIndirect 2
+#define streamExtent 3
+#define streamBadCsum 4
+#define streamTruncated 5
+#define streamCount 6
+
+struct checkpointState
+{
+    const char *path; // NULL when checkpointing is off
+    int resume;
+    time_t saved;
+    uint32_t nextGroup;
+    off_t offsets[streamCount];
+    unsigned long imageBlocks;
+    unsigned long imageOutput;
+    int exhausted;
+    uint64_t visitedCount;
+};
+
+struct checkpointState checkpoint;
+
+// Identifies the image and the limits; a checkpoint only resumes a scan that
+// would have produced the same records.
+void checkpointFingerprint(char *buf, size_t size)
+{
+    const uint8_t *uuid = (const uint8_t *)&superBuffer + superUuidOffset;
+    int len = snprintf(buf, size, "image ");
+    for (int k = 0; k < 16; k++)
+    {
+        len += snprintf(buf + len, size - len, "%02x", uuid[k]);
+    }
+    snprintf(buf + len, size - len, " %" PRIu64 " %u %u\nlimits %lu %lu %lu %lu %d\n",
+             blocksCount, superBuffer.s_wtime, superBuffer.s_mtime,
+             limits.inodeBlocks, limits.imageBlocks, limits.inodeOutput, limits.imageOutput, limits.depth);
+}
+
+char *visitedLogPath(void)
+{
+    char *logPath = malloc(strlen(checkpoint.path) + sizeof(".visited"));
+    sprintf(logPath, "%s.visited", checkpoint.path);
+    return logPath;
+}
+
+// Reads the checkpoint left by an interrupted scan of this image.
+void loadCheckpoint(void)
+{
+    FILE *file = fopen(checkpoint.path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: could not open checkpoint '%s'\n", checkpoint.path);
+        exit(1);
+    }
+
+    char expected[256];
+    char found[256];
+    checkpointFingerprint(expected, sizeof(expected));
+    size_t len = fread(found, 1, sizeof(found) - 1, file);
+    found[len] = '\0';
+
+    char *state = strstr(found, "\ngroup ");
+    size_t headerLen = strlen(checkpointMagic) + 1;
+    if (len < headerLen || strncmp(found, checkpointMagic "\n", headerLen) != 0 || state == NULL ||
+        (size_t)(state + 1 - found) != headerLen + strlen(expected) || strncmp(found + headerLen, expected, strlen(expected)) != 0)
+    {
+        fprintf(stderr, "Error: checkpoint '%s' does not match this image and these limits\n", checkpoint.path);
+        exit(1);
+    }
+
+    long long offsets[streamCount];
+    if (sscanf(state + 1, "group %u\nvisited %" SCNu64 "\ntraversal %lu %lu %d\nstreams %lld %lld %lld %lld %lld %lld\n",
+               &checkpoint.nextGroup, &checkpoint.visitedCount,
+               &checkpoint.imageBlocks, &checkpoint.imageOutput, &checkpoint.exhausted,
+               &offsets[0], &offsets[1], &offsets[2], &offsets[3], &offsets[4], &offsets[5]) != 11)
+    {
+        fprintf(stderr, "Error: checkpoint '%s' is malformed\n", checkpoint.path);
+        exit(1);
+    }
+    for (int k = 0; k < streamCount; k++)
+    {
+        checkpoint.offsets[k] = offsets[k];
+    }
+
+    fclose(file);
+}
+
+// Opens a record stream, picking up where the checkpoint left it on --resume.
+int openStream(const char *path, int stream)
+{
+    if (!checkpoint.resume)
+    {
+        return creat(path, S_IRWXU);
+    }
+
+    int streamFd = open(path, O_WRONLY);
+    if (streamFd < 0 || ftruncate(streamFd, checkpoint.offsets[stream]) != 0)
+    {
+        fprintf(stderr, "Error: could not resume output file '%s'\n", path);
+        exit(1);
+    }
+    lseek(streamFd, 0, SEEK_END);
+    return streamFd;
+}
+
+// Restores the traversal as it was at the checkpoint and reopens the visited
+// log for appending. Call after startTraversal.
+void resumeTraversal(void)
+{
+    char *logPath = visitedLogPath();
+
+    if (checkpoint.resume)
+    {
+        traversal.imageBlocks = checkpoint.imageBlocks;
+        traversal.imageOutput = checkpoint.imageOutput;
+        traversal.exhausted = checkpoint.exhausted;
+
+        int logFd = open(logPath, O_RDWR);
+        if (logFd < 0 || ftruncate(logFd, checkpoint.visitedCount * sizeof(uint64_t)) != 0)
+        {
+            fprintf(stderr, "Error: could not resume visited-block log '%s'\n", logPath);
+            exit(1);
+        }
+        close(logFd);
+
+        visitedLog = fopen(logPath, "r+");
+        uint64_t blockNum;
+        while (fread(&blockNum, sizeof(blockNum), 1, visitedLog) == 1)
+        {
+            if (blockNum < blocksCount)
+                traversal.visited[blockNum / 8] |= 1 << (blockNum % 8);
+        }
+        fseek(visitedLog, 0, SEEK_END);
+    }
+    else
+    {
+        visitedLog = fopen(logPath, "w");
+    }
+
+    if (visitedLog == NULL)
+    {
+        fprintf(stderr, "Error: could not open visited-block log '%s'\n", logPath);
+        exit(1);
+    }
+    free(logPath);
+}
+
+// Writes the checkpoint once every stream it describes is on disk. The file
+// is replaced by rename, so a crash leaves either the old or the new one.
+void saveCheckpoint(uint32_t nextGroup, const int *streams)
+{
+    fflush(visitedLog);
+    fdatasync(fileno(visitedLog));
+
+    char tempPath[4096];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", checkpoint.path);
+    FILE *file = fopen(tempPath, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Warning: could not write checkpoint '%s'\n", tempPath);
+        return;
+    }
+
+    char fingerprint[256];
+    checkpointFingerprint(fingerprint, sizeof(fingerprint));
+    fprintf(file, "%s\n%sgroup %u\nvisited %" PRIu64 "\ntraversal %lu %lu %d\nstreams",
+            checkpointMagic, fingerprint, nextGroup, (uint64_t)(ftello(visitedLog) / sizeof(uint64_t)),
+            traversal.imageBlocks, traversal.imageOutput, traversal.exhausted);
+    for (int k = 0; k < streamCount; k++)
+    {
+        fdatasync(streams[k]);
+        fprintf(file, " %lld", (long long)lseek(streams[k], 0, SEEK_CUR));
+    }
+    fprintf(file, "\n");
+
+    fflush(file);
+    fsync(fileno(file));
+    fclose(file);
+    rename(tempPath, checkpoint.path);
+
+    checkpoint.saved = time(NULL);
+}
+
+void maybeCheckpoint(uint32_t nextGroup, const int *streams)
+{
+    if (checkpoint.path != NULL && time(NULL) - checkpoint.saved >= checkpointInterval)
+    {
+        saveCheckpoint(nextGroup, streams);
+    }
+}
+
+// Called once the whole scan has been written out.
+void finishCheckpoint(void)
+{
+    if (visitedLog != NULL)
+    {
+        fclose(visitedLog);
+        visitedLog = NULL;
+    }
+
+    char *logPath = visitedLogPath();
+    unlink(logPath);
+    unlink(checkpoint.path);
+    free(logPath);
+}
+
+void processIndirect(int fd, int indirFd, uint32_t inodeNum, uint32_t blockNum, uint64_t offset, int level)
+{
+    if (traversal.depth >= limits.depth)
+    {
+        truncateInode("depth");
+        return;
+    }
+    if (!visitBlock(blockNum))
+    {
+        return;
+    }
+    traversal.depth++;
+
+    uint32_t *indirectBlock = allocImageBuffer(blockSize);
+    uint32_t *live = malloc(blockSize);
+    readImage(fd, indirectBlock, blockSize, (off_t)blockNum * blockSize);
+
+    // Each entry at this level spans pointersPerBlock^(level - 1) logical blocks.
+    uint64_t span = 1;
+    for (int l = 1; l < level; l++)
+    {
+        span *= blockSize / sizeof(uint32_t);
+    }
+
+    size_t count = blockKernel->liveIndirect(indirectBlock, live);
+    for (size_t k = 0; k < count && !traversal.exhausted; k++)
+    {
+        uint32_t i = live[k];
+        if (emitRecord(indirFd, "INDIRECT,%u,%d,%" PRIu64 ",%u,%u\n",
+                       inodeNum,
+                       level,
+                       offset + i * span,
+                       blockNum,
+                       indirectBlock[i]) != 0)
+        {
+            break;
+        }
+
+        if (level > 1)
+        {
+            processIndirect(fd, indirFd, inodeNum, indirectBlock[i], offset + i * span, level - 1);
+        }
+    }
+
+    free(indirectBlock);
+    free(live);
+    traversal.depth--;
+}
+
+// Extent trees
+
+// On-disk extent structures, as in lib/ext2fs/ext3_extents.h
+struct ext3_extent
+{
+    __u32 ee_block;    // first logical block extent covers
+    __u16 ee_len;      // number of blocks covered by extent
+    __u16 ee_start_hi; // high 16 bits of physical block
+    __u32 ee_start;    // low 32 bits of physical block
+};
+
+struct ext3_extent_idx
+{
+    __u32 ei_block;   // index covers logical blocks from 'block'
+    __u32 ei_leaf;    // pointer to the physical block of the next level
+    __u16 ei_leaf_hi; // high 16 bits of physical block
+    __u16 ei_unused;
+};
+
+struct ext3_extent_header
+{
+    __u16 eh_magic;   // probably will support different formats
+    __u16 eh_entries; // number of valid entries
+    __u16 eh_max;     // capacity of store in entries
+    __u16 eh_depth;   // has tree real underlaying blocks?
+    __u32 eh_generation;
+};
+
+#define EXT3_EXT_MAGIC 0xF30A
+#define EXT_INIT_MAX_LEN (1 << 15)
+#define maxExtentDepth 5
+
+int hasExtents(struct ext2_inode *inode)
+{
+    return (inode->i_flags & EXT4_EXTENTS_FL) != 0;
+}
+
+typedef int (*extentFn)(uint32_t logical, uint64_t physical, uint32_t len, void *arg);
+
+// Walks one extent tree node. Index entries are followed depth-first, so leaf
+// extents come out in logical order. A non-zero return from fn stops the walk.
+// Index blocks are marked visited only if markIndex is set; a walk that reads
+// the tree a second time for the same inode just range-checks them.
+int walkExtentNode(int fd, const uint8_t *node, size_t nodeSize, int expectedDepth, int markIndex, extentFn fn, void *arg)
+{
+    const struct ext3_extent_header *header = (const struct ext3_extent_header *)node;
+
+    if (header->eh_magic != EXT3_EXT_MAGIC ||
+        header->eh_entries > (nodeSize - sizeof(struct ext3_extent_header)) / sizeof(struct ext3_extent) ||
+        header->eh_depth > maxExtentDepth ||
+        (expectedDepth >= 0 && header->eh_depth != expectedDepth))
+    {
+        truncateInode("extent_header");
+        return 0;
+    }
+
+    if (header->eh_depth == 0)
+    {
+        const struct ext3_extent *extent = (const struct ext3_extent *)(header + 1);
+        for (int i = 0; i < header->eh_entries; i++)
+        {
+            uint32_t len = extent[i].ee_len;
+            if (len > EXT_INIT_MAX_LEN)
+                len -= EXT_INIT_MAX_LEN; // uninitialized extent
+
+            uint64_t physical = ((uint64_t)extent[i].ee_start_hi << 32) | extent[i].ee_start;
+            int ret = fn(extent[i].ee_block, physical, len, arg);
+            if (ret != 0)
+                return ret;
+        }
+        return 0;
+    }
+
+    uint8_t *child = allocImageBuffer(blockSize);
+    const struct ext3_extent_idx *index = (const struct ext3_extent_idx *)(header + 1);
+    int ret = 0;
+
+    for (int i = 0; i < header->eh_entries && ret == 0 && !traversal.exhausted; i++)
+    {
+        uint64_t leaf = ((uint64_t)index[i].ei_leaf_hi << 32) | index[i].ei_leaf;
+        if (markIndex && !visitBlock(leaf))
+            continue;
+        if (!markIndex && (leaf < superBuffer.s_first_data_block || leaf >= blocksCount))
+        {
+            truncateInode("block_range");
+            continue;
+        }
+
+        readImage(fd, child, blockSize, (off_t)leaf * blockSize);
+        ret = walkExtentNode(fd, child, blockSize, header->eh_depth - 1, markIndex, fn, arg);
+    }
+
+    free(child);
+    return ret;
+}
+
+// The root node lives in the inode's i_block array.
+int walkExtents(int fd, struct ext2_inode *inode, int markIndex, extentFn fn, void *arg)
+{
+    return walkExtentNode(fd, (const uint8_t *)inode->i_block, sizeof(inode->i_block), -1, markIndex, fn, arg);
+}
+
+struct extentOutput
+{
+    int extentFd;
+    uint32_t inodeNum;
+};
+
+int printExtent(uint32_t logical, uint64_t physical, uint32_t len, void *arg)
+{
+    struct extentOutput *out = arg;
+
+    return emitRecord(out->extentFd, "EXTENT,%u,%u,%" PRIu64 ",%u\n",
+                      out->inodeNum,
+                      logical,
+                      physical,
+                      len);
+}
+
+// Arena allocation
+
+struct arenaChunk
+{
+    struct arenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct arena
+{
+    struct arenaChunk *head;
+};
+
+#define arenaChunkSize (64 * 1024)
+
+// Bump-allocates from the current chunk. Nothing is freed individually; the
+// whole arena is released at once with arenaRelease.
+void *arenaAlloc(struct arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+
+    struct arenaChunk *chunk = arena->head;
+    if (chunk == NULL || chunk->used + size > chunk->size)
+    {
+        size_t chunkSize = size > arenaChunkSize ? size : arenaChunkSize;
+        chunk = malloc(sizeof(struct arenaChunk) + chunkSize);
+        if (chunk == NULL)
+        {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        arena->head = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void arenaRelease(struct arena *arena)
+{
+    while (arena->head != NULL)
+    {
+        struct arenaChunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+// Name interning
+//
+// Directory entry names repeat heavily across a tree ('.git', 'index',
+// 'Makefile'), so each distinct name is stored once in an arena and looked up
+// through an open-addressing table. Slots keep the name's hash, so probes
+// compare hashes before bytes and growing the table never rehashes a name.
+
+struct nameSlot
+{
+    const char *name; // NULL for an empty slot
+    uint32_t hash;
+    uint8_t len;
+};
+
+struct nameTable
+{
+    struct nameSlot *slots;
+    uint32_t capacity; // a power of two
+    uint32_t count;
+    struct arena strings;
+};
+
+#define initialNameSlots 1024
+
+// FNV-1a
+uint32_t nameHash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return hash;
+}
+
+void growNameTable(struct nameTable *table)
+{
+    uint32_t capacity = table->capacity != 0 ? table->capacity * 2 : initialNameSlots;
+    struct nameSlot *slots = calloc(capacity, sizeof(struct nameSlot));
+    if (slots == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < table->capacity; i++)
+    {
+        if (table->slots[i].name == NULL)
+            continue;
+
+        uint32_t k = table->slots[i].hash & (capacity - 1);
+        while (slots[k].name != NULL)
+            k = (k + 1) & (capacity - 1);
+        slots[k] = table->slots[i];
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+}
+
+// Returns the table's copy of the name, adding it on first sight. The copy
+// stays valid until freeNameTable.
+const char *internName(struct nameTable *table, const char *name, uint8_t len, uint32_t hash)
+{
+    // Keep the load under 3/4 so probe runs stay short.
+    if ((table->count + 1) * 4 > table->capacity * 3)
+        growNameTable(table);
+
+    uint32_t k = hash & (table->capacity - 1);
+    while (table->slots[k].name != NULL)
+    {
+        struct nameSlot *slot = &table->slots[k];
+        if (slot->hash == hash && slot->len == len && memcmp(slot->name, name, len) == 0)
+            return slot->name;
+        k = (k + 1) & (table->capacity - 1);
+    }
+
+    char *copy = arenaAlloc(&table->strings, len);
+    memcpy(copy, name, len);
+    table->slots[k] = (struct nameSlot){copy, hash, len};
+    table->count++;
+    return copy;
+}
+
+void freeNameTable(struct nameTable *table)
+{
+    arenaRelease(&table->strings);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Path reconstruction
+
+// Compact parent/name index built while directories are scanned. Each inode
+// keeps the first link that names it; '.' and '..' are not recorded.
+struct pathIndex
+{
+    uint32_t count;
+    uint32_t *parent;
+    const char **name;
+    uint8_t *nameLen;
+    char **path; // memoized full paths, filled in by resolvePaths
+    struct nameTable names;
+};
+
+struct pathIndex *pathIndex;
+
+#define maxPathDepth 4096
+
+struct pathIndex *createPathIndex(uint32_t inodeCount)
+{
+    struct pathIndex *index = calloc(1, sizeof(struct pathIndex));
+    index->count = inodeCount;
+    index->parent = calloc(inodeCount + 1, sizeof(uint32_t));
+    index->name = calloc(inodeCount + 1, sizeof(const char *));
+    index->nameLen = calloc(inodeCount + 1, sizeof(uint8_t));
+    index->path = calloc(inodeCount + 1, sizeof(char *));
+    if (index->parent == NULL || index->name == NULL || index->nameLen == NULL || index->path == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    return index;
+}
+
+void recordPathEntry(struct pathIndex *index, uint32_t parent, struct ext2_dir_entry *dir)
+{
+    if (dir->inode == 0 || dir->inode > index->count || index->parent[dir->inode] != 0 || dir->inode == EXT2_ROOT_INO)
+        return;
+    if ((dir->name_len == 1 && dir->name[0] == '.') ||
+        (dir->name_len == 2 && dir->name[0] == '.' && dir->name[1] == '.'))
+        return;
+
+    index->parent[dir->inode] = parent;
+    index->name[dir->inode] = internName(&index->names, dir->name, dir->name_len, nameHash(dir->name, dir->name_len));
+    index->nameLen[dir->inode] = dir->name_len;
+}
+
+// Pins a known path for an inode, e.g. the root of a --path query, so that
+// descendants resolve relative to it instead of needing the whole tree.
+void seedPath(struct pathIndex *index, uint32_t inodeNum, const char *path)
+{
+    if (inodeNum != 0 && inodeNum <= index->count)
+    {
+        size_t len = strlen(path);
+        while (len > 0 && path[len - 1] == '/')
+            len--;
+        int needSlash = path[0] != '/';
+
+        char *copy = arenaAlloc(&index->names.strings, len + needSlash + 2);
+        copy[0] = '/';
+        memcpy(copy + needSlash, path, len);
+        copy[len + needSlash] = '\0';
+        if (copy[0] == '\0' || (len == 0 && needSlash))
+            strcpy(copy, "/");
+        index->path[inodeNum] = copy;
+    }
+}
+
+// Walks up the parent chain until it meets a memoized ancestor, then builds
+// and publishes the prefixes on the way back down. Racing threads may build
+// the same prefix; the first compare-and-swap wins and the loser reuses it.
+char *resolveOnePath(struct pathIndex *index, uint32_t inodeNum, struct arena *arena, uint32_t *chain)
+{
+    int depth = 0;
+    uint32_t current = inodeNum;
+    char *base;
+
+    while ((base = __atomic_load_n(&index->path[current], __ATOMIC_ACQUIRE)) == NULL)
+    {
+        if (index->parent[current] == 0 || depth == maxPathDepth)
+            return NULL; // orphaned, or a cycle in a corrupt image
+        chain[depth++] = current;
+        current = index->parent[current];
+    }
+
+    while (depth > 0)
+    {
+        uint32_t node = chain[--depth];
+        size_t baseLen = strlen(base);
+        int needSlash = baseLen == 0 || base[baseLen - 1] != '/';
+
+        char *path = arenaAlloc(arena, baseLen + needSlash + index->nameLen[node] + 1);
+        memcpy(path, base, baseLen);
+        if (needSlash)
+            path[baseLen] = '/';
+        memcpy(path + baseLen + needSlash, index->name[node], index->nameLen[node]);
+        path[baseLen + needSlash + index->nameLen[node]] = '\0';
+
+        char *expected = NULL;
+        if (!__atomic_compare_exchange_n(&index->path[node], &expected, path, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            path = expected;
+        }
+        base = path;
+    }
+
+    return base;
+}
+
+struct pathWorker
+{
+    pthread_t thread;
+    struct pathIndex *index;
+    uint32_t *next;
+    struct arena arena;
+};
+
+#define pathBatchSize 1024
+
+void *pathWorkerMain(void *arg)
+{
+    struct pathWorker *worker = arg;
+    struct pathIndex *index = worker->index;
+    uint32_t *chain = malloc(maxPathDepth * sizeof(uint32_t));
+
+    for (;;)
+    {
+        uint32_t start = __atomic_fetch_add(worker->next, pathBatchSize, __ATOMIC_RELAXED);
+        if (start > index->count)
+            break;
+
+        uint32_t end = start + pathBatchSize;
+        if (end > index->count + 1)
+            end = index->count + 1;
+
+        for (uint32_t i = start; i < end; i++)
+        {
+            if (index->parent[i] != 0)
+                resolveOnePath(index, i, &worker->arena, chain);
+        }
+    }
+
+    free(chain);
+    return NULL;
+}
+
+// Resolves full paths for every indexed inode across all online CPUs, then
+// writes PATH records in inode order so the output is deterministic.
+void createPathSummary(struct pathIndex *index, const char *path)
+{
+    int pathFd = creat(path, S_IRWXU);
+
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1)
+        threadCount = 1;
+
+    // The calling thread takes the last slot itself, so a failed pthread_create
+    // only costs parallelism, never correctness.
+    struct pathWorker *workers = calloc(threadCount, sizeof(struct pathWorker));
+    uint32_t next = 1;
+
+    long launched = 0;
+    for (; launched < threadCount - 1; launched++)
+    {
+        workers[launched].index = index;
+        workers[launched].next = &next;
+        if (pthread_create(&workers[launched].thread, NULL, pathWorkerMain, &workers[launched]) != 0)
+            break;
+    }
+
+    workers[threadCount - 1].index = index;
+    workers[threadCount - 1].next = &next;
+    pathWorkerMain(&workers[threadCount - 1]);
+
+    for (long t = 0; t < launched; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    for (uint32_t i = 1; i <= index->count; i++)
+    {
+        if (index->path[i] != NULL)
+        {
+            dprintf(pathFd, "PATH,%u,'%s'\n", i, index->path[i]);
+        }
+    }
+
+    for (long t = 0; t < threadCount; t++)
+    {
+        arenaRelease(&workers[t].arena);
+    }
+    free(workers);
+
+    close(pathFd);
+}
+
+void freePathIndex(struct pathIndex *index)
+{
+    freeNameTable(&index->names);
+    free(index->parent);
+    free(index->name);
+    free(index->nameLen);
+    free(index->path);
+    free(index);
+}
+
+struct inodeQueue
+{
+    uint32_t *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    uint8_t *seen; // one bit per inode number
+};
+
+void queuePush(struct inodeQueue *queue, uint32_t inodeNum)
+{
+    if (inodeNum == 0 || inodeNum > superBuffer.s_inodes_count)
+        return;
+    if (queue->seen[(inodeNum - 1) / 8] & (1 << ((inodeNum - 1) % 8)))
+        return;
+    queue->seen[(inodeNum - 1) / 8] |= 1 << ((inodeNum - 1) % 8);
+
+    if (queue->tail == queue->capacity)
+    {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->items = realloc(queue->items, queue->capacity * sizeof(uint32_t));
+    }
+    queue->items[queue->tail++] = inodeNum;
+}
+
+struct inodeQueue *subtreeQueue; // set while a --path query is descending
+
+int enqueueChild(struct ext2_dir_entry *dir, int offset, void *arg)
+{
+    (void)offset;
+
+    if ((dir->name_len == 1 && dir->name[0] == '.') ||
+        (dir->name_len == 2 && dir->name[0] == '.' && dir->name[1] == '.'))
+    {
+        return 0;
+    }
+
+    queuePush(arg, dir->inode);
+    return 0;
+}
+
+typedef int (*dirEntryFn)(struct ext2_dir_entry *dir, int offset, void *arg);
+
+// Calls fn for each entry with a non-zero inode in one directory block that
+// has already been read into memory. A rec_len that would leave the block
+// ends the walk and truncates the inode. A non-zero return from fn stops the
+// walk and is passed back to the caller.
+int walkDirectoryBlock(const uint8_t *block, dirEntryFn fn, void *arg)
+{
+    unsigned int j = 0;
+    while (j + 8 <= blockSize)
+    {
+        struct ext2_dir_entry *dir = (struct ext2_dir_entry *)(block + j);
+        if (dir->rec_len < 8 || dir->rec_len % 4 != 0 || j + dir->rec_len > blockSize)
+        {
+            // A bad rec_len would otherwise stall or derail the walk.
+            truncateInode("dirent");
+            break;
+        }
+        if (dir->inode != 0 && j + 8 + dir->name_len <= blockSize)
+        {
+            int ret = fn(dir, j, arg);
+            if (ret != 0)
+            {
+                return ret;
+            }
+        }
+        j += dir->rec_len;
+    }
+    return 0;
+}
+
+// Logical to physical mapping for one directory block. Only the blocks on the
+// path are read, and they are range-checked rather than marked visited, since
+// the scan reads them again when it prints the inode's INDIRECT or EXTENT
+// records. Returns 0 for holes and unreadable maps.
+uint64_t mapLogicalBlock(int fd, struct ext2_inode *inode, uint32_t logical)
+{
+    uint8_t *node = allocImageBuffer(blockSize);
+    uint64_t physical = 0;
+
+    if (hasExtents(inode))
+    {
+        memcpy(node, inode->i_block, sizeof(inode->i_block));
+        size_t nodeSize = sizeof(inode->i_block);
+        for (int depth = 0; depth <= maxExtentDepth; depth++)
+        {
+            const struct ext3_extent_header *header = (const struct ext3_extent_header *)node;
+            if (header->eh_magic != EXT3_EXT_MAGIC ||
+                header->eh_entries > (nodeSize - sizeof(struct ext3_extent_header)) / sizeof(struct ext3_extent))
+                break;
+
+            if (header->eh_depth == 0)
+            {
+                const struct ext3_extent *extent = (const struct ext3_extent *)(header + 1);
+                for (int i = 0; i < header->eh_entries; i++)
+                {
+                    uint32_t len = extent[i].ee_len > EXT_INIT_MAX_LEN ? extent[i].ee_len - EXT_INIT_MAX_LEN : extent[i].ee_len;
+                    if (logical >= extent[i].ee_block && logical - extent[i].ee_block < len)
+                    {
+                        physical = (((uint64_t)extent[i].ee_start_hi << 32) | extent[i].ee_start) + (logical - extent[i].ee_block);
+                        break;
+                    }
+                }
+                break;
+            }
+
+            // Index entries are sorted; descend into the last one starting at or before the block.
+            const struct ext3_extent_idx *index = (const struct ext3_extent_idx *)(header + 1);
+            int chosen = -1;
+            for (int i = 0; i < header->eh_entries && index[i].ei_block <= logical; i++)
+                chosen = i;
+            if (chosen < 0)
+                break;
+
+            uint64_t child = ((uint64_t)index[chosen].ei_leaf_hi << 32) | index[chosen].ei_leaf;
+            if (child < superBuffer.s_first_data_block || child >= blocksCount)
+                break;
+            readImage(fd, node, blockSize, (off_t)child * blockSize);
+            nodeSize = blockSize;
+        }
+    }
+    else
+    {
+        uint32_t pointers = blockSize / sizeof(uint32_t);
+        uint32_t path[3];
+        int levels;
+        uint32_t next;
+
+        if (logical < EXT2_NDIR_BLOCKS)
+        {
+            levels = 0;
+            next = inode->i_block[logical];
+        }
+        else if ((logical -= EXT2_NDIR_BLOCKS) < pointers)
+        {
+            levels = 1;
+            next = inode->i_block[EXT2_IND_BLOCK];
+            path[0] = logical;
+        }
+        else if ((logical -= pointers) < (uint64_t)pointers * pointers)
+        {
+            levels = 2;
+            next = inode->i_block[EXT2_DIND_BLOCK];
+            path[0] = logical / pointers;
+            path[1] = logical % pointers;
+        }
+        else
+        {
+            logical -= pointers * pointers;
+            levels = 3;
+            next = inode->i_block[EXT2_TIND_BLOCK];
+            path[0] = logical / pointers / pointers;
+            path[1] = logical / pointers % pointers;
+            path[2] = logical % pointers;
+        }
+
+        for (int level = 0; level < levels && next != 0; level++)
+        {
+            if (next < superBuffer.s_first_data_block || next >= blocksCount || path[level] >= pointers)
+            {
+                next = 0;
+                break;
+            }
+            readImage(fd, node, blockSize, (off_t)next * blockSize);
+            next = ((const uint32_t *)node)[path[level]];
+        }
+        physical = next;
+    }
+
+    free(node);
+    return physical;
+}
+
+// Hashed directories
+//
+// Directories with EXT2_INDEX_FL keep a hash tree over their leaf blocks. The
+// root lives in block 0 behind the '.' and '..' entries; interior nodes are
+// blocks holding one empty entry that spans the block, followed by the index.
+// Index entries are (hash, logical block) pairs sorted by hash, the first one
+// holding the limit and count instead of a hash. The hash is ext2fs_dirhash
+// from lib/ext2fs/dirhash.c, reimplemented below.
+
+#define EXT2_INDEX_FL 0x00001000
+#define superHashSeedOffset 0xEC
+#define superFlagsOffset 0x160
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+#define EXT2_HASH_LEGACY 0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA 2
+#define EXT2_HASH_LEGACY_UNSIGNED 3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED 5
+
+#define dxRootInfoOffset 24
+#define dxNodeEntriesOffset 8
+#define maxHtreeLevels 3
+
+int hashOrder; // --hash-order: list indexed directories leaf by leaf in hash order
+
+void teaTransform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++)
+    {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = (a << s) | (a >> (32 - s)))
+#define K1 0
+#define K2 013240474631U
+#define K3 015666365641U
+
+// Cut-down MD4: three rounds of eight steps over 32 bytes of input.
+void halfMd4Transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1, 3);
+    ROUND(F, d, a, b, c, in[1] + K1, 7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1, 3);
+    ROUND(F, d, a, b, c, in[5] + K1, 7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+#undef ROUND
+#undef F
+#undef G
+#undef H
+#undef K1
+#undef K2
+#undef K3
+
+// The hash from before the tree hashes, kept for old filesystems.
+uint32_t legacyHash(const char *name, int len, int unsignedChars)
+{
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+    for (int i = 0; i < len; i++)
+    {
+        int c = unsignedChars ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Packs up to num * 4 bytes of the name into words, padded with the length.
+void nameToHashBuffer(const char *msg, int len, uint32_t *buf, int num, int unsignedChars)
+{
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > num * 4)
+        len = num * 4;
+    for (int i = 0; i < len; i++)
+    {
+        if ((i % 4) == 0)
+            val = pad;
+        int c = unsignedChars ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = c + (val << 8);
+        if ((i % 4) == 3)
+        {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+// Returns -1 for hash versions this tree does not know.
+int dirHash(int version, const char *name, int len, uint32_t *hash)
+{
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint32_t in[8];
+    int unsignedChars = version >= EXT2_HASH_LEGACY_UNSIGNED;
+
+    // An all-zero seed means the default one.
+    const uint8_t *seed = (const uint8_t *)&superBuffer + superHashSeedOffset;
+    for (int k = 0; k < 16; k++)
+    {
+        if (seed[k] != 0)
+        {
+            memcpy(buf, seed, sizeof(buf));
+            break;
+        }
+    }
+
+    switch (version)
+    {
+    case EXT2_HASH_LEGACY:
+    case EXT2_HASH_LEGACY_UNSIGNED:
+        *hash = legacyHash(name, len, unsignedChars);
+        break;
+    case EXT2_HASH_HALF_MD4:
+    case EXT2_HASH_HALF_MD4_UNSIGNED:
+        for (const char *p = name; len > 0; len -= 32, p += 32)
+        {
+            nameToHashBuffer(p, len, in, 8, unsignedChars);
+            halfMd4Transform(buf, in);
+        }
+        *hash = buf[1];
+        break;
+    case EXT2_HASH_TEA:
+    case EXT2_HASH_TEA_UNSIGNED:
+        for (const char *p = name; len > 0; len -= 16, p += 16)
+        {
+            nameToHashBuffer(p, len, in, 4, unsignedChars);
+            teaTransform(buf, in);
+        }
+        *hash = buf[0];
+        break;
+    default:
+        return -1;
+    }
+
+    *hash &= ~1U;
+    return 0;
+}
+
+struct htree
+{
+    int hashVersion;
+    int levels; // index levels below the root
+    uint64_t rootBlock;
+    uint8_t *root;
+};
+
+// Reads and checks the root of an indexed directory. Returns 0 if the
+// directory is not indexed or its root cannot be trusted.
+int openHtree(int fd, struct ext2_inode *inode, struct htree *tree)
+{
+    if (!(inode->i_flags & EXT2_INDEX_FL))
+        return 0;
+
+    tree->rootBlock = mapLogicalBlock(fd, inode, 0);
+    if (tree->rootBlock < superBuffer.s_first_data_block || tree->rootBlock >= blocksCount)
+        return 0;
+
+    tree->root = allocImageBuffer(blockSize);
+    readImage(fd, tree->root, blockSize, (off_t)tree->rootBlock * blockSize);
+
+    const uint8_t *info = tree->root + dxRootInfoOffset;
+    tree->hashVersion = info[4];
+    tree->levels = info[6];
+    if (getU32(info, 0) != 0 || info[5] != 8 || tree->levels >= maxHtreeLevels || tree->hashVersion > EXT2_HASH_TEA)
+    {
+        free(tree->root);
+        return 0;
+    }
+
+    if (getU32(&superBuffer, superFlagsOffset) & EXT2_FLAGS_UNSIGNED_HASH)
+        tree->hashVersion += EXT2_HASH_LEGACY_UNSIGNED;
+    return 1;
+}
+
+// Returns the number of index entries in the node, or 0 if the count and
+// limit do not fit the block.
+unsigned int dxEntryCount(const uint8_t *node, size_t entriesOffset)
+{
+    unsigned int limit = getU16(node, entriesOffset);
+    unsigned int count = getU16(node, entriesOffset + 2);
+    if (count == 0 || count > limit || limit > (blockSize - entriesOffset) / 8)
+        return 0;
+    return count;
+}
+
+uint32_t dxHash(const uint8_t *node, size_t entriesOffset, unsigned int i)
+{
+    return i == 0 ? 0 : getU32(node, entriesOffset + 8 * i);
+}
+
+uint32_t dxBlock(const uint8_t *node, size_t entriesOffset, unsigned int i)
+{
+    return getU32(node, entriesOffset + 8 * i + 4) & 0x0FFFFFFF;
+}
+
+// Interior nodes start with an unused entry covering the whole block.
+int isHtreeNode(const uint8_t *block)
+{
+    const struct ext2_dir_entry *dir = (const struct ext2_dir_entry *)block;
+    return dir->inode == 0 && dir->rec_len == blockSize && dxEntryCount(block, dxNodeEntriesOffset) != 0;
+}
+
+struct directoryWalk
+{
+    int fd;
+    struct ext2_inode *inode;
+    uint8_t *block;
+    int indexed;
+    dirEntryFn fn;
+    void *arg;
+};
+
+// Reads one directory block and calls fn for its entries. Interior index
+// nodes of an indexed directory carry no entries and are skipped.
+int walkDirectoryData(struct directoryWalk *walk, uint32_t logical, uint64_t physical)
+{
+    if (!visitBlock(physical))
+        return 0;
+
+    readImage(walk->fd, walk->block, blockSize, (off_t)physical * blockSize);
+    if (walk->indexed && logical != 0 && isHtreeNode(walk->block))
+        return 0;
+    return walkDirectoryBlock(walk->block, walk->fn, walk->arg);
+}
+
+// Follows every index entry of a node in order, which lists the leaves in hash order.
+int walkHtreeNode(struct directoryWalk *walk, const uint8_t *node, size_t entriesOffset, int levels)
+{
+    unsigned int count = dxEntryCount(node, entriesOffset);
+    if (count == 0)
+    {
+        truncateInode("htree");
+        return 0;
+    }
+
+    uint8_t *child = levels > 0 ? allocImageBuffer(blockSize) : NULL;
+    int ret = 0;
+    for (unsigned int i = 0; i < count && ret == 0 && !traversal.exhausted; i++)
+    {
+        uint32_t logical = dxBlock(node, entriesOffset, i);
+        uint64_t physical = mapLogicalBlock(walk->fd, walk->inode, logical);
+        if (physical == 0)
+            continue;
+
+        if (levels == 0)
+        {
+            ret = walkDirectoryData(walk, logical, physical);
+        }
+        else if (visitBlock(physical))
+        {
+            readImage(walk->fd, child, blockSize, (off_t)physical * blockSize);
+            ret = walkHtreeNode(walk, child, dxNodeEntriesOffset, levels - 1);
+        }
+    }
+
+    free(child);
+    return ret;
+}
+
+struct nameLookup
+{
+    const char *name;
+    size_t nameLen;
+    uint32_t found;
+};
+
+int matchName(struct ext2_dir_entry *dir, int offset, void *arg)
+{
+    (void)offset;
+    struct nameLookup *lookup = arg;
+
+    if (dir->name_len == lookup->nameLen && memcmp(dir->name, lookup->name, lookup->nameLen) == 0)
+    {
+        lookup->found = dir->inode;
+        return 1;
+    }
+    return 0;
+}
+
+// Looks a name up by descending the index to the one leaf whose hash range
+// holds it, plus the following leaves whose first hash continues a collision.
+// Returns the inode number, or 0 if the name was not found that way.
+uint32_t lookupHtree(int fd, struct ext2_inode *inode, const char *name, size_t len)
+{
+    struct htree tree;
+    if (!openHtree(fd, inode, &tree))
+        return 0;
+
+    uint32_t hash;
+    if (dirHash(tree.hashVersion, name, len, &hash) != 0)
+    {
+        free(tree.root);
+        return 0;
+    }
+
+    uint8_t *node = tree.root;
+    size_t entriesOffset = dxRootInfoOffset + 8;
+    uint8_t *block = allocImageBuffer(blockSize);
+    struct nameLookup lookup = {name, len, 0};
+
+    for (int level = 0; level <= tree.levels; level++)
+    {
+        unsigned int count = dxEntryCount(node, entriesOffset);
+        if (count == 0)
+            break;
+
+        // Last entry whose hash is at or below the name's.
+        unsigned int low = 0, high = count;
+        while (high - low > 1)
+        {
+            unsigned int mid = (low + high) / 2;
+            if (dxHash(node, entriesOffset, mid) <= hash)
+                low = mid;
+            else
+                high = mid;
+        }
+
+        if (level < tree.levels)
+        {
+            uint64_t physical = mapLogicalBlock(fd, inode, dxBlock(node, entriesOffset, low));
+            if (physical < superBuffer.s_first_data_block || physical >= blocksCount)
+                break;
+            readImage(fd, block, blockSize, (off_t)physical * blockSize);
+            if (node != tree.root)
+                memcpy(node, block, blockSize);
+            else
+                node = memcpy(allocImageBuffer(blockSize), block, blockSize);
+            entriesOffset = dxNodeEntriesOffset;
+            continue;
+        }
+
+        for (unsigned int i = low; i < count && lookup.found == 0; i++)
+        {
+            if (i != low && dxHash(node, entriesOffset, i) != (hash | 1))
+                break;
+
+            uint64_t physical = mapLogicalBlock(fd, inode, dxBlock(node, entriesOffset, i));
+            if (physical < superBuffer.s_first_data_block || physical >= blocksCount)
+                continue;
+            readImage(fd, block, blockSize, (off_t)physical * blockSize);
+            walkDirectoryBlock(block, matchName, &lookup);
+        }
+    }
+
+    if (node != tree.root)
+        free(node);
+    free(tree.root);
+    free(block);
+    return lookup.found;
+}
+
+int walkDirectoryExtent(uint32_t logical, uint64_t physical, uint32_t len, void *arg)
+{
+    struct directoryWalk *walk = arg;
+
+    for (uint32_t b = 0; b < len && !traversal.exhausted; b++)
+    {
+        int ret = walkDirectoryData(walk, logical + b, physical + b);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+// Directories past the twelve direct blocks continue through the indirect
+// blocks, which are range-checked rather than visited, as in mapLogicalBlock.
+int walkDirectoryIndirect(struct directoryWalk *walk, uint32_t blockNum, int level, uint32_t *logical, uint32_t endLogical)
+{
+    uint32_t pointers = blockSize / sizeof(uint32_t);
+    uint64_t span = 1;
+    for (int k = 1; k < level; k++)
+        span *= pointers;
+
+    if (blockNum < superBuffer.s_first_data_block || blockNum >= blocksCount)
+    {
+        truncateInode("block_range");
+        *logical += span * pointers;
+        return 0;
+    }
+
+    uint32_t *indirectBlock = allocImageBuffer(blockSize);
+    readImage(walk->fd, indirectBlock, blockSize, (off_t)blockNum * blockSize);
+
+    int ret = 0;
+    for (uint32_t k = 0; k < pointers && *logical < endLogical && ret == 0 && !traversal.exhausted; k++)
+    {
+        if (indirectBlock[k] == 0)
+        {
+            *logical += span;
+        }
+        else if (level == 1)
+        {
+            ret = walkDirectoryData(walk, *logical, indirectBlock[k]);
+            (*logical)++;
+        }
+        else
+        {
+            ret = walkDirectoryIndirect(walk, indirectBlock[k], level - 1, logical, endLogical);
+        }
+    }
+
+    free(indirectBlock);
+    return ret;
+}
+
+// Calls fn for every live entry in the directory's data blocks. A non-zero
+// return from fn stops the walk and is passed back to the caller.
+int walkDirectory(int fd, struct ext2_inode *inode, dirEntryFn fn, void *arg)
+{
+    uint8_t *block = allocImageBuffer(blockSize);
+    struct directoryWalk walk = {fd, inode, block, (inode->i_flags & EXT2_INDEX_FL) != 0, fn, arg};
+    int ret = 0;
+
+    struct htree tree;
+    if (hashOrder && walk.indexed && openHtree(fd, inode, &tree))
+    {
+        // '.' and '..' sit in front of the root; the leaves follow in index order.
+        if (visitBlock(tree.rootBlock))
+            ret = walkDirectoryBlock(tree.root, fn, arg);
+        if (ret == 0)
+            ret = walkHtreeNode(&walk, tree.root, dxRootInfoOffset + 8, tree.levels);
+        free(tree.root);
+        free(block);
+        return ret;
+    }
+
+    // The index blocks are left to the EXTENT pass, which marks them visited.
+    if (hasExtents(inode))
+    {
+        ret = walkExtents(fd, inode, 0, walkDirectoryExtent, &walk);
+        free(block);
+        return ret;
+    }
+
+    int i = 0;
+    while (ret == 0 && i < EXT2_NDIR_BLOCKS && inode->i_block[i] != 0 && !traversal.exhausted)
+    {
+        ret = walkDirectoryData(&walk, i, inode->i_block[i]);
+        i++;
+    }
+
+    uint32_t logical = EXT2_NDIR_BLOCKS;
+    uint32_t endLogical = ((uint64_t)inode->i_size + blockSize - 1) / blockSize;
+    for (int level = 1; level <= 3 && i == EXT2_NDIR_BLOCKS && ret == 0 && logical < endLogical && !traversal.exhausted; level++)
+    {
+        uint32_t pointers = blockSize / sizeof(uint32_t);
+        uint64_t span = pointers;
+        for (int k = 1; k < level; k++)
+            span *= pointers;
+
+        if (inode->i_block[EXT2_NDIR_BLOCKS + level - 1] == 0)
+            logical += span;
+        else
+            ret = walkDirectoryIndirect(&walk, inode->i_block[EXT2_NDIR_BLOCKS + level - 1], level, &logical, endLogical);
+    }
+
+    free(block);
+    return ret;
+}
+
+struct direntOutput
+{
+    int dirFd;
+    int inodeNum;
+};
+
+int printDirent(struct ext2_dir_entry *dir, int offset, void *arg)
+{
+    struct direntOutput *out = arg;
+
+    if (pathIndex != NULL)
+    {
+        recordPathEntry(pathIndex, out->inodeNum, dir);
+    }
+
+    if (subtreeQueue != NULL)
+    {
+        enqueueChild(dir, offset, subtreeQueue);
+    }
+
+    return emitRecord(out->dirFd, "DIRENT,%d,%d,%d,%d,%d,\'%.*s\'\n",
+                      out->inodeNum,    // parent inode number
+                      offset,           // offset value
+                      dir->inode,       // referenced inode number
+                      dir->rec_len,     // entry length
+                      dir->name_len,    // name length
+                      dir->name_len, dir->name);
+}
+
+void processDirectory(int fd, int dirFd, struct ext2_inode *inode, int inodeNum)
+{
+    struct direntOutput out = {dirFd, inodeNum};
+    walkDirectory(fd, inode, printDirent, &out);
+}
+
+// Emits the INODE record for one inode, followed by its DIRENT and INDIRECT or EXTENT records.
+void processInode(int fd, int inodeFd, int dirFd, int indirFd, int extentFd, struct ext2_inode *inode, unsigned int j)
+{
+    uint16_t fileType = inode->i_mode;
+    if (fileType & 0x8000)
+        fileType = 'f';
+    else if (fileType & 0x4000)
+        fileType = 'd';
+    else if (fileType & 0xA000)
+        fileType = 's';
+    else
+        fileType = '?';
+
+    // Get Time from Inode
+    char lastChangeTime[100];
+    char modificationTime[100];
+    char accessTime[100];
+    formatTime(inode->i_ctime, lastChangeTime);
+    formatTime(inode->i_mtime, modificationTime);
+    formatTime(inode->i_atime, accessTime);
+
+    char blocks[EXT2_N_BLOCKS * 11 + 1];
+    int blocksLen = 0;
+    for (int k = 0; k < EXT2_N_BLOCKS; k++)
+    {
+        blocksLen += sprintf(blocks + blocksLen, ",%u", inode->i_block[k]);
+    }
+
+    // For regular files i_dir_acl holds the high half of the size.
+    uint64_t size = inode->i_size;
+    if ((inode->i_mode & 0xF000) == 0x8000)
+        size |= (uint64_t)inode->i_dir_acl << 32;
+
+    beginInode(j);
+
+    emitRecord(inodeFd, "INODE,%u,%c,%o,%u,%u,%u,%s,%s,%s,%" PRIu64 ",%u%s\n",
+               j,
+               fileType,
+               inode->i_mode & 0xFFF,
+               inode->i_uid,
+               inode->i_gid,
+               inode->i_links_count,
+               lastChangeTime,
+               modificationTime,
+               accessTime,
+               size,
+               inode->i_blocks,
+               blocks);
+
+    if (fileType == 'd' || fileType == 'f')
+    {
+        if (fileType == 'd')
+        {
+            processDirectory(fd, dirFd, inode, j);
+        }
+
+        if (hasExtents(inode))
+        {
+            // i_block holds an extent tree root, not block pointers.
+            struct extentOutput out = {extentFd, j};
+            walkExtents(fd, inode, 1, printExtent, &out);
+        }
+        else
+        {
+            // Each call is different directory.
+            uint64_t pointers = blockSize / sizeof(uint32_t);
+            if (inode->i_block[12] != 0)
+            {
+                processIndirect(fd, indirFd, j, inode->i_block[12], 12, 1);
+            }
+            if (inode->i_block[13] != 0)
+            {
+                processIndirect(fd, indirFd, j, inode->i_block[13], 12 + pointers, 2);
+            }
+            if (inode->i_block[14] != 0)
+            {
+                processIndirect(fd, indirFd, j, inode->i_block[14], 12 + pointers + pointers * pointers, 3);
+            }
+        }
+    }
+
+    endInode();
+}
+
+// Inode Summary
+
+// Number of leading inode table slots in the group that may hold live inodes.
+uint32_t initializedInodes(uint32_t group)
+{
+    uint32_t count = superBuffer.s_inodes_per_group;
+    if ((uint64_t)group * superBuffer.s_inodes_per_group + count > superBuffer.s_inodes_count)
+    {
+        count = superBuffer.s_inodes_count > (uint64_t)group * superBuffer.s_inodes_per_group
+                    ? superBuffer.s_inodes_count - group * superBuffer.s_inodes_per_group
+                    : 0;
+    }
+
+    // The tail of the table past bg_itable_unused may never have been
+    // zeroed, and an INODE_UNINIT table holds nothing at all.
+    if (groups[group].flags & EXT4_BG_INODE_UNINIT)
+    {
+        count = 0;
+    }
+    else if (groups[group].itableUnused < count)
+    {
+        count -= groups[group].itableUnused;
+    }
+    else if (groups[group].itableUnused != 0)
+    {
+        count = 0;
+    }
 
-    int blockSize = 1024;
-    int retSize = blockSize << superBuffer.s_log_block_size;
+    return count;
+}
 
-    pread(fd, &superBuffer, sizeof(struct ext2_super_block), superblockOffset);
+void createInodeSummary(int fd, const char *path, const char *dirPath, const char *indirPath, const char *extentPath, int numOfGroups)
+{
+    int inodeFd = openStream(path, streamInode);
+    int dirFd = openStream(dirPath, streamDirent);
+    int indirFd = openStream(indirPath, streamIndirect);
+    int extentFd = openStream(extentPath, streamExtent);
+    const int streams[streamCount] = {inodeFd, dirFd, indirFd, extentFd, badCsumFd, truncFd};
+
+    uint8_t *tableRun = NULL;
+    size_t tableRunSize = 0;
+    uint32_t *live = malloc(superBuffer.s_inodes_per_group * sizeof(uint32_t));
+
+    startTraversal();
+    if (checkpoint.path != NULL)
+    {
+        resumeTraversal();
+        checkpoint.saved = time(NULL);
+    }
 
-    dprintf(superblockFd, "SUPERBLOCK,");
+    int i = checkpoint.resume ? (int)checkpoint.nextGroup : 0;
+    while (i < numOfGroups && !traversal.exhausted)
+    {
+        if ((uint64_t)i * superBuffer.s_inodes_per_group >= superBuffer.s_inodes_count)
+        {
+            break;
+        }
+        if (groupCorrupt[i] & groupDescBad)
+        {
+            i++;
+            maybeCheckpoint(i, streams);
+            continue;
+        }
 
-    dprintf(superblockFd, "%d,", superBuffer.s_blocks_count);
+        // With flex_bg the inode tables of a whole flex group arrive in one read.
+        uint32_t run = readGroupRun(fd, i, numOfGroups, offsetof(struct groupInfo, inodeTable), inodeTableBlocks, &tableRun, &tableRunSize);
+        for (uint32_t r = 0; r < run && !traversal.exhausted; r++, i++)
+        {
+            uint8_t *inodeTable = tableRun + (size_t)r * inodeTableBlocks * blockSize;
 
-    dprintf(superblockFd, "%d,", superBuffer.s_inodes_count);
+            size_t liveCount = inodeKernel->liveInodes(inodeTable, initializedInodes(i), live);
+            for (size_t k = 0; k < liveCount && !traversal.exhausted; k++)
+            {
+                unsigned int index = live[k];
+                unsigned int j = i * superBuffer.s_inodes_per_group + index + 1;
 
-    dprintf(superblockFd, "%d,", retSize);
+                uint8_t *raw = inodeTable + (size_t)index * inodeSize;
+                memcpy(&inodeBuffer, raw, sizeof(struct ext2_inode));
 
-    dprintf(superblockFd, "%d,", superBuffer.s_inode_size);
+                // Skipping a corrupt inode keeps garbage block pointers from
+                // expanding into pages of junk INDIRECT records.
+                if (!verifyInode(raw, j))
+                {
+                    reportBadChecksum("inode", j);
+                    continue;
+                }
+                processInode(fd, inodeFd, dirFd, indirFd, extentFd, &inodeBuffer, j);
+            }
 
-    dprintf(superblockFd, "%d,", superBuffer.s_blocks_per_group);
+            maybeCheckpoint(i + 1, streams);
+        }
+    }
 
-    dprintf(superblockFd, "%d,", superBuffer.s_inodes_per_group);
+    if (checkpoint.path != NULL)
+    {
+        saveCheckpoint(numOfGroups, streams);
+    }
 
-    dprintf(superblockFd, "%d\n", superBuffer.s_first_ino);
+    free(tableRun);
+    free(live);
 
-    close(superblockFd);
+    close(inodeFd);
+    close(dirFd);
+    close(indirFd);
+    close(extentFd);
 }
 
-// Group Summary
+// Targeted queries
 
-int createGroupSummary(int fd, const char *path) // returns number of froups
+int isInUse(struct ext2_inode *inode)
 {
-    int numberOfGroups = superBuffer.s_blocks_count / superBuffer.s_blocks_per_group + 1;
-
-    int blockRemainder = superBuffer.s_blocks_count % superBuffer.s_blocks_per_group;
-    int inodeRemainder = superBuffer.s_inodes_count % superBuffer.s_inodes_per_group;
+    return inode->i_mode != 0 && inode->i_links_count != 0;
+}
 
-    groupBuffer = malloc(numberOfGroups * sizeof(struct ext2_group_desc));
+int isDirectory(struct ext2_inode *inode)
+{
+    return (inode->i_mode & 0xF000) == 0x4000;
+}
 
-    int groupFd = creat(path, S_IRWXU);
+// Resolves an absolute path by walking directory blocks from the root inode.
+// Returns 0 if any component is missing or is not a directory.
+uint32_t resolvePath(int fd, const char *path)
+{
+    uint32_t current = EXT2_ROOT_INO;
+    struct ext2_inode inode;
 
-    int i = 0;
-    for (; i < numberOfGroups; i++)
+    const char *p = path;
+    while (*p != '\0')
     {
-        pread(fd, &groupBuffer[i], sizeof(struct ext2_group_desc), superblockOffset + groupOffset + sizeof(struct ext2_group_desc) * i);
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
 
-        dprintf(groupFd, "GROUP,");
+        const char *end = strchr(p, '/');
+        size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
 
-        dprintf(groupFd, "%d,", i);
+        if (readInode(fd, current, &inode) != 0 || !isDirectory(&inode))
+        {
+            return 0;
+        }
 
-        if (blockRemainder == 0)
+        // Indexed directories are searched through their hash tree first; the
+        // linear walk only runs if that fails, e.g. on a damaged index.
+        struct nameLookup lookup = {p, len, lookupHtree(fd, &inode, p, len)};
+        if (lookup.found == 0)
         {
-            dprintf(groupFd, "%d,", superBuffer.s_blocks_per_group);
+            walkDirectory(fd, &inode, matchName, &lookup);
         }
-        else
+        if (lookup.found == 0)
         {
-            if ((i + 1) == numberOfGroups)
-            {
-                dprintf(groupFd, "%d,", blockRemainder);
-            }
-            else
-            {
-                dprintf(groupFd, "%d,", superBuffer.s_blocks_per_group);
-            }
+            return 0;
         }
 
-        if (inodeRemainder == 0)
+        current = lookup.found;
+        p += len;
+    }
+
+    return current;
+}
+
+// Dumps only the listed inodes, or (with descend set) everything reachable from
+// them through directory entries. Each inode is read directly from its group's
+// inode table, so the cost follows the number of inodes visited, not the image size.
+void createQuerySummary(int fd, const char *path, const char *dirPath, const char *indirPath, const char *extentPath,
+                        uint32_t *roots, size_t rootCount, int descend)
+{
+    int inodeFd = creat(path, S_IRWXU);
+    int dirFd = creat(dirPath, S_IRWXU);
+    int indirFd = creat(indirPath, S_IRWXU);
+    int extentFd = creat(extentPath, S_IRWXU);
+
+    struct inodeQueue queue = {NULL, 0, 0, 0, NULL};
+    queue.seen = calloc(superBuffer.s_inodes_count / 8 + 1, 1);
+
+    startTraversal();
+
+    for (size_t i = 0; i < rootCount; i++)
+    {
+        queuePush(&queue, roots[i]);
+    }
+
+    struct ext2_inode inode;
+    while (queue.head < queue.tail)
+    {
+        uint32_t inodeNum = queue.items[queue.head++];
+
+        if (readInode(fd, inodeNum, &inode) != 0)
         {
-            dprintf(groupFd, "%d,", superBuffer.s_inodes_per_group);
+            fprintf(stderr, "Warning: inode %u could not be read\n", inodeNum);
+            continue;
         }
-        else
+        if (!isInUse(&inode))
         {
-            if ((i + 1) == numberOfGroups)
-            {
-                dprintf(groupFd, "%d,", inodeRemainder);
-            }
-            else
-            {
-                dprintf(groupFd, "%d,", superBuffer.s_inodes_per_group);
-            }
+            fprintf(stderr, "Warning: inode %u is not in use\n", inodeNum);
+            continue;
         }
 
-        dprintf(groupFd, "%d,", groupBuffer[i].bg_free_blocks_count);
+        // Children are queued by the same directory walk that prints the
+        // DIRENT records, so each directory block is read only once.
+        subtreeQueue = descend ? &queue : NULL;
+        processInode(fd, inodeFd, dirFd, indirFd, extentFd, &inode, inodeNum);
+        subtreeQueue = NULL;
 
-        dprintf(groupFd, "%d,", groupBuffer[i].bg_free_inodes_count);
+        if (traversal.exhausted)
+        {
+            break;
+        }
+    }
 
-        dprintf(groupFd, "%d,", groupBuffer[i].bg_block_bitmap);
+    free(queue.items);
+    free(queue.seen);
 
-        dprintf(groupFd, "%d,", groupBuffer[i].bg_inode_bitmap);
+    close(inodeFd);
+    close(dirFd);
+    close(indirFd);
+    close(extentFd);
+}
 
-        dprintf(groupFd, "%d\n", groupBuffer[i].bg_inode_table);
+// Summary statistics
+//
+// --summary replaces the records with one JSON report describing how file
+// sizes, block counts, directory fan-out, free extents and group utilization
+// are distributed. Inode tables are scanned on every online CPU, each thread
+// into its own accumulator, and the accumulators are merged once the scan is
+// done.
+
+// Prints the distribution as a JSON object. The histogram folds the sketch
+// into power-of-two buckets keyed by their lower bound.
+void printDistribution(const char *name, const struct distribution *d)
+{
+    printf("  \"%s\": {\"count\": %" PRIu64 ", \"sum\": %" PRIu64 ", \"min\": %" PRIu64 ", \"max\": %" PRIu64
+           ", \"mean\": %.2f, \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"histogram\": {",
+           name, d->count, d->sum, d->min, d->max,
+           d->count != 0 ? (double)d->sum / d->count : 0.0,
+           quantile(d, 0.50), quantile(d, 0.90), quantile(d, 0.99));
+
+    uint64_t powers[65] = {0};
+    for (unsigned int i = 0; i < sketchBuckets; i++)
+    {
+        uint64_t lower = sketchLowerBound(i);
+        powers[lower == 0 ? 0 : 64 - __builtin_clzll(lower)] += d->buckets[i];
     }
 
-    close(groupFd);
+    const char *separator = "";
+    for (int k = 0; k <= 64; k++)
+    {
+        if (powers[k] != 0)
+        {
+            printf("%s\"%" PRIu64 "\": %" PRIu64, separator, k == 0 ? 0 : (uint64_t)1 << (k - 1), powers[k]);
+            separator = ", ";
+        }
+    }
+    printf("}},\n");
+}
 
-    return numberOfGroups;
+struct scanStats
+{
+    uint64_t inodes;
+    uint64_t files;
+    uint64_t directories;
+    uint64_t symlinks;
+    uint64_t other;
+    uint64_t badInodes;
+    uint64_t truncated;
+    struct distribution fileSize;
+    struct distribution inodeBlocks;
+    struct distribution fanout;
+};
+
+void mergeScanStats(struct scanStats *into, const struct scanStats *from)
+{
+    into->inodes += from->inodes;
+    into->files += from->files;
+    into->directories += from->directories;
+    into->symlinks += from->symlinks;
+    into->other += from->other;
+    into->badInodes += from->badInodes;
+    into->truncated += from->truncated;
+    mergeDistribution(&into->fileSize, &from->fileSize);
+    mergeDistribution(&into->inodeBlocks, &from->inodeBlocks);
+    mergeDistribution(&into->fanout, &from->fanout);
 }
 
-// Free Block Summary
+int countEntry(struct ext2_dir_entry *dir, int offset, void *arg)
+{
+    (void)offset;
+    uint64_t *entries = arg;
+
+    // '.' and '..' are not children.
+    if (!(dir->name_len == 1 && dir->name[0] == '.') &&
+        !(dir->name_len == 2 && dir->name[0] == '.' && dir->name[1] == '.'))
+    {
+        (*entries)++;
+    }
+    return 0;
+}
 
-void createFreeSummary(int fd, const char *groupPath, const char *inodePath, int numOfGroups)
+void summarizeInode(int fd, struct ext2_inode *inode, uint32_t inodeNum, struct scanStats *stats)
 {
-    int freeGroupFd = creat(groupPath, S_IRWXU);
-    int freeInodeFd = creat(inodePath, S_IRWXU);
+    stats->inodes++;
 
-    uint8_t uint8Buffer;
+    // i_blocks counts 512-byte sectors.
+    recordValue(&stats->inodeBlocks, inode->i_blocks / (blockSize / 512));
 
-    int i = 0;
-    for (; i < numOfGroups; i++)
+    switch (inode->i_mode & 0xF000)
+    {
+    case 0x8000:
+        // For regular files i_dir_acl holds the high half of the size.
+        stats->files++;
+        recordValue(&stats->fileSize, (uint64_t)inode->i_dir_acl << 32 | inode->i_size);
+        break;
+    case 0x4000:
     {
-        int blockSize = 1024 << superBuffer.s_log_block_size;
+        stats->directories++;
+        uint64_t entries = 0;
+        beginInode(inodeNum);
+        walkDirectory(fd, inode, countEntry, &entries);
+        if (traversal.truncated != NULL)
+            stats->truncated++;
+        endInode();
+        recordValue(&stats->fanout, entries);
+        break;
+    }
+    case 0xA000:
+        stats->symlinks++;
+        break;
+    default:
+        stats->other++;
+        break;
+    }
+}
 
-        int j = 0;
-        for (; j < blockSize; j++)
-        {
-            int bitmapLocation = EXT2_MIN_BLOCK_SIZE << superBuffer.s_log_block_size;
+struct summaryWorker
+{
+    pthread_t thread;
+    int fd;
+    uint32_t numGroups;
+    uint32_t *next;
+    uint8_t *visited;
+    struct scanStats stats;
+};
+
+// Workers claim a flex group at a time, so each claim is one coalesced read.
+// The traversal budgets apply to each worker separately.
+void *summaryWorkerMain(void *arg)
+{
+    struct summaryWorker *worker = arg;
+    uint8_t *tableRun = NULL;
+    size_t tableRunSize = 0;
+    uint32_t *live = malloc(superBuffer.s_inodes_per_group * sizeof(uint32_t));
 
-            pread(fd, &uint8Buffer, 1, groupBuffer[i].bg_block_bitmap * bitmapLocation + j);
+    traversal.visited = worker->visited;
 
-            int k = 0;
-            for (; k < 8; k++)
-            {
-                if ((uint8Buffer & 1 << k) == 0) // 0 means free
-                {
-                    dprintf(freeGroupFd, "BFREE,");
+    while (!traversal.exhausted)
+    {
+        uint32_t first = __atomic_fetch_add(worker->next, groupsPerFlex, __ATOMIC_RELAXED);
+        if (first >= worker->numGroups || (uint64_t)first * superBuffer.s_inodes_per_group >= superBuffer.s_inodes_count)
+            break;
 
-                    int blockNumber = i * superBuffer.s_blocks_per_group + j * 8 + k + 1;
-                    dprintf(freeGroupFd, "%d\n", blockNumber);
-                }
+        uint32_t end = first + groupsPerFlex < worker->numGroups ? first + groupsPerFlex : worker->numGroups;
+        uint32_t i = first;
+        while (i < end && !traversal.exhausted)
+        {
+            if (groupCorrupt[i] & groupDescBad)
+            {
+                i++;
+                continue;
             }
 
-            pread(fd, &uint8Buffer, 1, groupBuffer[i].bg_inode_bitmap * bitmapLocation + j);
-
-            k = 0;
-            for (; k < 8; k++)
+            uint32_t run = readGroupRun(worker->fd, i, end, offsetof(struct groupInfo, inodeTable), inodeTableBlocks, &tableRun, &tableRunSize);
+            for (uint32_t r = 0; r < run && !traversal.exhausted; r++, i++)
             {
-                if ((uint8Buffer & 1 << k) == 0) // 0 means free
+                uint8_t *inodeTable = tableRun + (size_t)r * inodeTableBlocks * blockSize;
+                size_t liveCount = inodeKernel->liveInodes(inodeTable, initializedInodes(i), live);
+                for (size_t k = 0; k < liveCount && !traversal.exhausted; k++)
                 {
-                    dprintf(freeInodeFd, "IFREE,");
+                    uint32_t j = i * superBuffer.s_inodes_per_group + live[k] + 1;
+                    uint8_t *raw = inodeTable + (size_t)live[k] * inodeSize;
+                    if (!verifyInode(raw, j))
+                    {
+                        worker->stats.badInodes++;
+                        continue;
+                    }
 
-                    int inodeNumber = i * superBuffer.s_inodes_per_group + j * 8 + k + 1;
-                    dprintf(freeInodeFd, "%d\n", inodeNumber);
+                    struct ext2_inode inode;
+                    memcpy(&inode, raw, sizeof(inode));
+                    summarizeInode(worker->fd, &inode, j, &worker->stats);
                 }
             }
         }
     }
 
-    close(freeGroupFd);
-    close(freeInodeFd);
+    free(tableRun);
+    free(live);
+    return NULL;
 }
 
-void formatTime(uint32_t t, char *buf)
+struct freeStats
 {
-    time_t timer = t;
-    struct tm *ts = gmtime(&timer);
-    strftime(buf, 80, "%m/%d/%y %H:%M:%S", ts);
-}
+    uint64_t freeBlocks;
+    uint64_t badBitmaps;
+    uint64_t utilization[11]; // groups per 10% band of used blocks
+    struct distribution extents;
+};
 
-void processIndirect(int fd, int indirFd, int inodeNum, int blockNum, int offset, int level)
+void summarizeFreeSpace(int fd, int numOfGroups, struct freeStats *stats)
 {
-    uint32_t indirectBlock[ext2BlockSize];
-    pread(fd, &indirectBlock, ext2BlockSize, blockNum * ext2BlockSize);
+    uint8_t *bitmapRun = NULL;
+    size_t bitmapRunSize = 0;
+    struct freeRunTracker tracker = {0, &stats->extents, NULL};
 
-    int lim = (ext2BlockSize / sizeof(int));
     int i = 0;
-    while (i < lim)
-    {
-        if (indirectBlock[i] != 0)
-        {
-            //fprintf(stderr, "Test1");
-            dprintf(indirFd, "INDIRECT,%d,", inodeNum);
-            // fprintf(stderr, "Test2");
-            dprintf(indirFd, "%d,", level);
-            //  fprintf(stderr, "Test3");
-            dprintf(indirFd, "%d,", offset + i);
-            dprintf(indirFd, "%d,", blockNum);
-            dprintf(indirFd, "%d\n", indirectBlock[i]);
-            // dprintf(indirFd, "INDIRECT, %u, %u, %u, %u, %u\n", inodeNum,
-            //         level,
-            //         offset + i,
-            //         blockNum,
-            //         indirectBlock[i]);
-
-            if (level > 1)
+    while (i < numOfGroups)
+    {
+        if (groupCorrupt[i] & groupDescBad)
+        {
+            closeFreeRun(&tracker);
+            i++;
+            continue;
+        }
+
+        uint32_t run = readGroupRun(fd, i, numOfGroups, offsetof(struct groupInfo, blockBitmap), 1, &bitmapRun, &bitmapRunSize);
+        for (uint32_t r = 0; r < run; r++, i++)
+        {
+            uint8_t *blockBitmap = bitmapRun + (size_t)r * blockSize;
+            if (groups[i].flags & EXT4_BG_BLOCK_UNINIT)
+            {
+                synthesizeBlockBitmap(i, blockBitmap);
+            }
+            else if (!verifyBitmap(groupDescRaw + (size_t)i * descSize, blockBitmap, superBuffer.s_blocks_per_group / 8, descBlockBitmapCsumLoOffset, descBlockBitmapCsumHiOffset))
             {
-                processIndirect(fd, indirFd, inodeNum, indirectBlock[i], offset + i, level - 1);
+                groupCorrupt[i] |= blockBitmapBad;
+                stats->badBitmaps++;
+                closeFreeRun(&tracker);
+                continue;
             }
+
+            uint32_t bits = groupBlocks(i);
+            uint64_t freeCount = recordFreeRuns(blockBitmap, bits, &tracker, NULL);
+            stats->freeBlocks += freeCount;
+            if (bits != 0)
+                stats->utilization[(bits - freeCount) * 10 / bits]++;
         }
-        i++;
     }
+    closeFreeRun(&tracker);
+
+    free(bitmapRun);
 }
 
-void processDirectory(int fd, int dirFd, struct ext2_inode *inode, int inodeNum)
+// Writes the --summary JSON report to standard output.
+void createStatsSummary(int fd, int numOfGroups)
 {
-    struct ext2_dir_entry dir;
-    int i = 0;
-    while (i < EXT2_NDIR_BLOCKS && inode->i_block[i] != 0)
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1)
+        threadCount = 1;
+
+    startTraversal();
+
+    struct summaryWorker *workers = calloc(threadCount, sizeof(struct summaryWorker));
+    uint32_t next = 0;
+
+    long launched = 0;
+    for (; launched < threadCount - 1; launched++)
     {
-        int j = 0;
-        while (j < ext2BlockSize)
-        {
-            pread(fd, &dir, sizeof(struct ext2_dir_entry), inode->i_block[i] * ext2BlockSize + j);
-            if (dir.inode != 0)
-            {
-                //DIRENT identifier
-                dprintf(dirFd, "DIRENT,");
-                //Parent inode number
-                dprintf(dirFd, "%d,", inodeNum);
-                //Offset value
-                dprintf(dirFd, "%d,", j);
-                //Reference inode number
-                dprintf(dirFd, "%d,", dir.inode);
-                //dir Length
-                dprintf(dirFd, "%d,", dir.rec_len);
-                //Name Length
-                dprintf(dirFd, "%d,", dir.name_len);
-                //Name
-                dprintf(dirFd, "\'%s\'\n", dir.name);
-            }
-            j += dir.rec_len;
-        }
-        i++;
+        workers[launched] = (struct summaryWorker){.fd = fd, .numGroups = numOfGroups, .next = &next, .visited = traversal.visited};
+        if (pthread_create(&workers[launched].thread, NULL, summaryWorkerMain, &workers[launched]) != 0)
+            break;
     }
 
-    // // Each call represents a different level.
-    // if (inode->i_block[12] > 0)
-    //     processIndirect(fd, indirFd, inodeNum, inode->i_block[EXT2_IND_BLOCK], 12, 1);
-    // if (inode->i_block[13] > 0)
-    //     processIndirect(fd, indirFd, inodeNum, inode->i_block[EXT2_DIND_BLOCK], 12 + 256, 2);
-    // if (inode->i_block[14] > 0)
-    //     processIndirect(fd, indirFd, inodeNum, inode->i_block[EXT2_TIND_BLOCK], 12 + 256 + (256 * 256), 3);
+    struct summaryWorker *self = &workers[threadCount - 1];
+    *self = (struct summaryWorker){.fd = fd, .numGroups = numOfGroups, .next = &next, .visited = traversal.visited};
+    summaryWorkerMain(self);
+
+    for (long t = 0; t < launched; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        mergeScanStats(&self->stats, &workers[t].stats);
+    }
+    struct scanStats *stats = &self->stats;
+
+    struct freeStats *freeSpace = calloc(1, sizeof(struct freeStats));
+    summarizeFreeSpace(fd, numOfGroups, freeSpace);
+
+    uint64_t badGroups = 0;
+    for (int i = 0; i < numOfGroups; i++)
+    {
+        if (groupCorrupt[i] & groupDescBad)
+            badGroups++;
+    }
+
+    printf("{\n");
+    printf("  \"blocks\": %" PRIu64 ",\n  \"block_size\": %u,\n  \"groups\": %d,\n  \"inodes\": %u,\n",
+           blocksCount, blockSize, numOfGroups, superBuffer.s_inodes_count);
+    printf("  \"inodes_used\": %" PRIu64 ",\n  \"files\": %" PRIu64 ",\n  \"directories\": %" PRIu64
+           ",\n  \"symlinks\": %" PRIu64 ",\n  \"other\": %" PRIu64 ",\n  \"free_blocks\": %" PRIu64 ",\n",
+           stats->inodes, stats->files, stats->directories, stats->symlinks, stats->other, freeSpace->freeBlocks);
+    printf("  \"bad_checksums\": {\"groups\": %" PRIu64 ", \"block_bitmaps\": %" PRIu64 ", \"inodes\": %" PRIu64 "},\n",
+           badGroups, freeSpace->badBitmaps, stats->badInodes);
+    printf("  \"truncated_directories\": %" PRIu64 ",\n", stats->truncated);
+    printDistribution("file_size", &stats->fileSize);
+    printDistribution("blocks_per_inode", &stats->inodeBlocks);
+    printDistribution("directory_fanout", &stats->fanout);
+    printDistribution("free_extents", &freeSpace->extents);
+
+    printf("  \"group_utilization\": {");
+    for (int band = 0; band <= 10; band++)
+    {
+        printf("%s\"%d\": %" PRIu64, band == 0 ? "" : ", ", band * 10, freeSpace->utilization[band]);
+    }
+    printf("}\n}\n");
+
+    free(freeSpace);
+    free(workers);
 }
 
-// Inode Summary
-void createInodeSummary(int fd, const char *path, const char *dirPath, const char *indirPath, int numOfGroups)
+// Parses "N[,M...]" into a list of inode numbers.
+size_t parseInodeList(const char *arg, uint32_t **list)
 {
-    int inodeFd = creat(path, S_IRWXU);
-    int dirFd = creat(dirPath, S_IRWXU);
-    int indirFd = creat(indirPath, S_IRWXU);
-    uint16_t fileType;
-    for (int i = 0; i < numOfGroups; i++)
+    size_t count = 0;
+    size_t capacity = 8;
+    *list = malloc(capacity * sizeof(uint32_t));
+
+    const char *p = arg;
+    while (*p != '\0')
     {
-        for (unsigned int j = 1; j < superBuffer.s_inodes_count; j++)
+        char *end;
+        errno = 0;
+        unsigned long value = strtoul(p, &end, 10);
+        if (end == p || errno != 0 || value == 0 || value > UINT32_MAX || (*end != ',' && *end != '\0'))
         {
-            pread(fd, &inodeBuffer, sizeof(struct ext2_inode), superblockOffset + 4 * groupOffset + sizeof(struct ext2_inode) * (j - 1));
-
-            if (inodeBuffer.i_mode != 0 && inodeBuffer.i_links_count != 0)
-            {
-                fileType = inodeBuffer.i_mode;
-                if (fileType & 0x8000)
-                    fileType = 'f';
-                else if (fileType & 0x4000)
-                    fileType = 'd';
-                else if (fileType & 0xA000)
-                    fileType = 's';
-                else
-                    fileType = '?';
-
-                // Get Time from Inode
-                char lastChangeTime[100];
-                char modificationTime[100];
-                char accessTime[100];
-                formatTime(inodeBuffer.i_ctime, lastChangeTime);
-                formatTime(inodeBuffer.i_mtime, modificationTime);
-                formatTime(inodeBuffer.i_atime, accessTime);
-
-                dprintf(inodeFd, "INODE,%u,%c,%o,%u,%u,%u,%s,%s,%s,%d,%d",
-                        j,
-                        fileType,
-                        inodeBuffer.i_mode & 0xFFF,
-                        inodeBuffer.i_uid,
-                        inodeBuffer.i_gid,
-                        inodeBuffer.i_links_count,
-                        lastChangeTime,
-                        modificationTime,
-                        accessTime,
-                        inodeBuffer.i_size,
-                        inodeBuffer.i_blocks);
-
-                for (int k = 0; k < EXT2_N_BLOCKS; k++)
-                {
-                    dprintf(inodeFd, ",%u", inodeBuffer.i_block[k]);
-                }
-                dprintf(inodeFd, "\n"); // or printf?
+            fprintf(stderr, "Error: invalid inode list '%s'\n", arg);
+            exit(1);
+        }
 
-                if (fileType == 'd' || fileType == 'f')
-                {
-                    if (fileType == 'd')
-                    {
-                        processDirectory(fd, dirFd, &inodeBuffer, j);
-                    }
-                    // Each call is different directory.
-                    if (inodeBuffer.i_block[12] != 0)
-                    {
-                        processIndirect(fd, indirFd, j, inodeBuffer.i_block[12], 12, 1);
-                    }
-                    if (inodeBuffer.i_block[13] != 0)
-                    {
-                        processIndirect(fd, indirFd, j, inodeBuffer.i_block[13], 12 + 256, 2);
-                    }
-                    if (inodeBuffer.i_block[14] != 0)
-                    {
-                        processIndirect(fd, indirFd, j, inodeBuffer.i_block[14], 12 + 256 + (256 * 256), 3);
-                    }
-                }
-            }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            *list = realloc(*list, capacity * sizeof(uint32_t));
         }
+        (*list)[count++] = (uint32_t)value;
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+unsigned long parseLimit(const char *arg, const char *option)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0)
+    {
+        fprintf(stderr, "Error: invalid value '%s' for %s\n", arg, option);
+        exit(1);
     }
+    return value;
 }
 
 // Change this code.
@@ -363,18 +3671,150 @@ int main(int argc, char *argv[])
     const char *inodePath = "inodeCSV.csv";
     const char *dirPath = "directoryCSV.csv";
     const char *indirPath = "indirectoryCSV.csv";
+    const char *pathPath = "pathCSV.csv";
+    const char *badCsumPath = "badcsumCSV.csv";
+    const char *truncPath = "truncCSV.csv";
+    const char *extentPath = "extentCSV.csv";
+    const char *fragPath = "freefragCSV.csv";
 
     char *filename;
 
-    if (argc != 2)
+    const char *queryInodes = NULL;
+    const char *queryPath = NULL;
+    int emitPaths = 0;
+    int summary = 0;
+    int freeFrag = 0;
+
+    static struct option longOptions[] = {
+        {"inode", required_argument, NULL, 'i'},
+        {"path", required_argument, NULL, 'p'},
+        {"paths", no_argument, NULL, 'P'},
+        {"max-inode-blocks", required_argument, NULL, 'b'},
+        {"max-blocks", required_argument, NULL, 'B'},
+        {"max-inode-output", required_argument, NULL, 'o'},
+        {"max-output", required_argument, NULL, 'O'},
+        {"max-depth", required_argument, NULL, 'd'},
+        {"summary", no_argument, NULL, 's'},
+        {"freefrag", no_argument, NULL, 'f'},
+        {"direct", no_argument, NULL, 'D'},
+        {"max-mbps", required_argument, NULL, 'm'},
+        {"max-iops", required_argument, NULL, 'I'},
+        {"checkpoint", required_argument, NULL, 'c'},
+        {"resume", no_argument, NULL, 'r'},
+        {"hash-order", no_argument, NULL, 'h'},
+        {"timings", no_argument, NULL, 't'},
+        {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            queryInodes = optarg;
+            break;
+        case 'p':
+            queryPath = optarg;
+            break;
+        case 'P':
+            emitPaths = 1;
+            break;
+        case 's':
+            summary = 1;
+            break;
+        case 'f':
+            freeFrag = 1;
+            break;
+        case 'D':
+            directIO = 1;
+            break;
+        case 'm':
+            limiter.bytesPerSecond = parseLimit(optarg, "--max-mbps") * 1024.0 * 1024.0;
+            break;
+        case 'I':
+            limiter.readsPerSecond = parseLimit(optarg, "--max-iops");
+            break;
+        case 'c':
+            checkpoint.path = optarg;
+            break;
+        case 'r':
+            checkpoint.resume = 1;
+            break;
+        case 'h':
+            hashOrder = 1;
+            break;
+        case 't':
+            phaseTimings = 1;
+            break;
+        case 'b':
+            limits.inodeBlocks = parseLimit(optarg, "--max-inode-blocks");
+            break;
+        case 'B':
+            limits.imageBlocks = parseLimit(optarg, "--max-blocks");
+            break;
+        case 'o':
+            limits.inodeOutput = parseLimit(optarg, "--max-inode-output");
+            break;
+        case 'O':
+            limits.imageOutput = parseLimit(optarg, "--max-output");
+            break;
+        case 'd':
+            limits.depth = (int)parseLimit(optarg, "--max-depth");
+            if (limits.depth < 1 || limits.depth > 3)
+            {
+                fprintf(stderr, "Error: --max-depth must be between 1 and 3\n");
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--inode N[,M...] | --path /a/b] [--paths] [--max-inode-blocks N] [--max-blocks N]\n"
+                            "       [--max-inode-output BYTES] [--max-output BYTES] [--max-depth N] [--summary | --freefrag] [--direct]\n"
+                            "       [--max-mbps N] [--max-iops N] [--checkpoint FILE [--resume]]\n"
+                            "       [--hash-order] [--timings] image\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    if (queryInodes != NULL && queryPath != NULL)
+    {
+        fprintf(stderr, "Error: --inode and --path cannot be combined.\n");
+        exit(1);
+    }
+
+    if (summary && (queryInodes != NULL || queryPath != NULL || emitPaths))
+    {
+        fprintf(stderr, "Error: --summary cannot be combined with --inode, --path or --paths.\n");
+        exit(1);
+    }
+
+    if (freeFrag && (summary || queryInodes != NULL || queryPath != NULL))
+    {
+        fprintf(stderr, "Error: --freefrag needs a full scan.\n");
+        exit(1);
+    }
+
+    if (checkpoint.resume && checkpoint.path == NULL)
+    {
+        fprintf(stderr, "Error: --resume needs --checkpoint.\n");
+        exit(1);
+    }
+
+    if (checkpoint.path != NULL && (summary || queryInodes != NULL || queryPath != NULL || emitPaths))
+    {
+        fprintf(stderr, "Error: --checkpoint needs a full scan without --paths.\n");
+        exit(1);
+    }
+
+    if (argc - optind != 1)
     {
         fprintf(stderr, "Error: Incorrect number of arguments.\n");
         exit(1);
     }
 
-    if (argv[1] != NULL)
+    if (argv[optind] != NULL)
     {
-        filename = argv[1];
+        filename = argv[optind];
     }
     else
     {
@@ -382,28 +3822,154 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    int fd = open(filename, O_RDONLY);
+    // Throughput goes to stderr so a scan can be paced against other I/O.
+    int reportIO = directIO || rateLimited();
+    struct timespec scanStart;
+    clock_gettime(CLOCK_MONOTONIC, &scanStart);
+    limiter.refilled = scanStart;
+    limiter.byteTokens = limiter.bytesPerSecond;
+    limiter.readTokens = limiter.readsPerSecond;
+
+    int fd = openImage(filename);
     if (fd < 0)
     {
         fprintf(stderr, "Could not open file with specified image");
         exit(1);
     }
 
+    beginPhase();
+
+    if (summary)
+    {
+        // No records at all, so none of the CSV files are created.
+        readSuperblock(fd);
+        createStatsSummary(fd, loadGroupTable(fd));
+        endPhase("summary");
+        close(fd);
+        if (reportIO)
+            reportThroughput(&scanStart);
+        return 0;
+    }
+
+    // A resumed scan already has the records from before the checkpoint.
+    if (!checkpoint.resume)
+    {
+        badCsumFd = creat(badCsumPath, S_IRWXU);
+        truncFd = creat(truncPath, S_IRWXU);
+    }
+    readSuperblock(fd);
+    if (checkpoint.resume)
+    {
+        loadCheckpoint();
+    }
+
+    if (emitPaths)
+    {
+        pathIndex = createPathIndex(superBuffer.s_inodes_count);
+    }
+
+    if (queryInodes != NULL || queryPath != NULL)
+    {
+        uint32_t *roots;
+        size_t rootCount;
+
+        if (queryInodes != NULL)
+        {
+            rootCount = parseInodeList(queryInodes, &roots);
+        }
+        else
+        {
+            roots = malloc(sizeof(uint32_t));
+            roots[0] = resolvePath(fd, queryPath);
+            rootCount = 1;
+            if (roots[0] == 0)
+            {
+                fprintf(stderr, "Error: could not resolve path '%s'\n", queryPath);
+                exit(1);
+            }
+        }
+
+        if (pathIndex != NULL)
+        {
+            seedPath(pathIndex, queryPath != NULL ? roots[0] : EXT2_ROOT_INO, queryPath != NULL ? queryPath : "/");
+        }
+
+        createQuerySummary(fd, inodePath, dirPath, indirPath, extentPath, roots, rootCount, queryPath != NULL);
+        free(roots);
+        endPhase("query");
+
+        close(badCsumFd);
+        printCSV(badCsumPath);
+        printCSV(inodePath);
+        printCSV(dirPath);
+        if (pathIndex != NULL)
+        {
+            createPathSummary(pathIndex, pathPath);
+            printCSV(pathPath);
+            freePathIndex(pathIndex);
+        }
+        printCSV(indirPath);
+        printCSV(extentPath);
+        close(truncFd);
+        printCSV(truncPath);
+        endPhase("output");
+
+        close(fd);
+        if (reportIO)
+            reportThroughput(&scanStart);
+        return 0;
+    }
+
+    if (pathIndex != NULL)
+    {
+        seedPath(pathIndex, EXT2_ROOT_INO, "/");
+    }
+
     createSuperblockSummary(fd, superPath);
+    endPhase("superblock");
     int numberOfGroups = createGroupSummary(fd, groupPath);
-    createInodeSummary(fd, inodePath, dirPath, indirPath, numberOfGroups);
-    createFreeSummary(fd, freeGroupPath, freeInodePath, numberOfGroups);
+    if (checkpoint.resume)
+    {
+        badCsumFd = openStream(badCsumPath, streamBadCsum);
+        truncFd = openStream(truncPath, streamTruncated);
+    }
+    endPhase("groups");
+    createInodeSummary(fd, inodePath, dirPath, indirPath, extentPath, numberOfGroups);
+    endPhase("inodes");
+    createFreeSummary(fd, freeGroupPath, freeInodePath, freeFrag ? fragPath : NULL, numberOfGroups);
+    endPhase("free");
     // createInodeSummary(fd, inodePath, numberOfGroups);
 
+    close(badCsumFd);
+
     printCSV(superPath);
     printCSV(groupPath);
+    printCSV(badCsumPath);
     printCSV(freeGroupPath);
     printCSV(freeInodePath);
+    if (freeFrag)
+    {
+        printCSV(fragPath);
+    }
     printCSV(inodePath);
     printCSV(dirPath);
+    if (pathIndex != NULL)
+    {
+        createPathSummary(pathIndex, pathPath);
+        printCSV(pathPath);
+        freePathIndex(pathIndex);
+    }
     printCSV(indirPath);
+    printCSV(extentPath);
+    close(truncFd);
+    printCSV(truncPath);
+    endPhase("output");
 
     close(fd);
+    if (reportIO)
+        reportThroughput(&scanStart);
+    if (checkpoint.path != NULL)
+        finishCheckpoint();
 
     //    SUPERBLOCK
     //    total number of blocks (decimal)